@@ -3,27 +3,84 @@
 // This work is licensed under the terms of the MIT license.
 // For a copy, see <https://opensource.org/licenses/MIT>.
 #pragma once
+#include <vector>
+#include "pybind11/numpy.h"
 #include "src/dynamics/dynamics.h"
 
 namespace py = pybind11;
 
+/**
+ * @brief Batched rollout for numpy arrays
+ *
+ * @param inputs Input sequences of shape (K, N, InputSize)
+ * @return py::array_t<double> States of shape (K, N + 1, State)
+ */
+template<class M, class I>
+py::array_t<double> GenerateBatchTrajectories(
+  const geometry::Matrix_t<double>& initial_state,
+  py::array_t<double, py::array::c_style | py::array::forcecast> inputs,
+  commons::Parameter* params) {
+  if (inputs.ndim() != 3 || inputs.shape(2) != M::kInputDim)
+    throw py::value_error("inputs need to be of shape (K, N, InputSize).");
+  const int num_sequences = inputs.shape(0);
+  const int num_steps = inputs.shape(1);
+  auto in = inputs.unchecked<3>();
+  std::vector<geometry::Batch_t<M::kInputDim>> batch_inputs(
+    num_steps, geometry::Batch_t<M::kInputDim>(M::kInputDim, num_sequences));
+  for (int k = 0; k < num_sequences; k++)
+    for (int t = 0; t < num_steps; t++)
+      for (int j = 0; j < M::kInputDim; j++)
+        batch_inputs[t](j, k) = in(k, t, j);
+
+  std::vector<geometry::Batch_t<M::kStateDim>> states;
+  {
+    py::gil_scoped_release release;
+    states = dynamics::GenerateBatchTrajectories<M, I>(initial_state,
+                                                       batch_inputs,
+                                                       params);
+  }
+  py::array_t<double> ret({num_sequences, num_steps + 1, M::kStateDim});
+  auto out = ret.mutable_unchecked<3>();
+  for (int k = 0; k < num_sequences; k++)
+    for (int t = 0; t <= num_steps; t++)
+      for (int j = 0; j < M::kStateDim; j++)
+        out(k, t, j) = states[t](j, k);
+  return ret;
+}
+
 void python_dynamics(py::module m) {
   using dynamics::GenerateDynamicTrajectory;
   using dynamics::SingleTrackModel;
   using dynamics::TripleIntModel;
   using dynamics::RobotArm;
   using dynamics::IntegrationRK4;
+  using dynamics::IntegrationExact;
+  using geometry::Matrix_t;
+  using commons::Parameter;
 
   m.def("GenerateTrajectorySingleTrack",
-    &dynamics::GenerateDynamicTrajectory<double,
-                                        SingleTrackModel,
-                                        IntegrationRK4>);
+    py::overload_cast<const Matrix_t<double>&,
+                      const Matrix_t<double>&,
+                      Parameter*>(
+      &GenerateDynamicTrajectory<double, SingleTrackModel, IntegrationRK4>));
   m.def("GenerateTrajectoryTripleInt",
-    &dynamics::GenerateDynamicTrajectory<double,
-                                        TripleIntModel,
-                                        IntegrationRK4>);
+    py::overload_cast<const Matrix_t<double>&,
+                      const Matrix_t<double>&,
+                      Parameter*>(
+      &GenerateDynamicTrajectory<double, TripleIntModel, IntegrationExact>));
   m.def("GenerateTrajectoryRobotArm",
-    &dynamics::GenerateDynamicTrajectory<double,
-                                        RobotArm,
-                                        IntegrationRK4>);
+    py::overload_cast<const Matrix_t<double>&,
+                      const Matrix_t<double>&,
+                      Parameter*>(
+      &GenerateDynamicTrajectory<double, RobotArm, IntegrationRK4>));
+  m.def("GenerateBatchTrajectoriesSingleTrack",
+    &GenerateBatchTrajectories<SingleTrackModel, IntegrationRK4>,
+    py::arg("initial_state"), py::arg("inputs"), py::arg("params"));
+  m.def("GenerateBatchTrajectoriesTripleInt",
+    &GenerateBatchTrajectories<TripleIntModel, IntegrationExact>,
+    py::arg("initial_state"), py::arg("inputs"), py::arg("params"));
+  m.def("GenerateDenseTrajectorySingleTrack",
+    &dynamics::GenerateDenseTrajectory<SingleTrackModel>,
+    py::arg("initial_states"), py::arg("inputs"), py::arg("params"),
+    py::arg("num_samples") = 10);
 }
\ No newline at end of file
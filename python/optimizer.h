@@ -13,8 +13,10 @@
 #include "src/functors/costs/distance.h"
 #include "src/functors/costs/reference.h"
 #include "src/functors/costs/static_object.h"
+#include "src/functors/costs/sdf_object.h"
 #include "src/functors/costs/speed.h"
 #include "src/optimizer.h"
+#include "src/batch_optimizer.h"
 
 namespace py = pybind11;
 
@@ -30,7 +32,8 @@ void python_optimizer(py::module m) {
              BaseFunctor,
              SingleTrackFunctorPtr>(m, "SingleTrackFunctor")
     .def(py::init<Matrix_t<double>, const ParameterPtr&>())
-    .def("AddCost", &SingleTrackFunctor::AddCost);
+    .def("AddCost", &SingleTrackFunctor::AddCost)
+    .def("SetAnalyticJacobians", &SingleTrackFunctor::SetAnalyticJacobians);
 
   py::class_<BaseCost, BaseCostPtr>(m, "BaseCost")
     .def(py::init<const ParameterPtr&>());
@@ -51,7 +54,15 @@ void python_optimizer(py::module m) {
              StaticObjectCostPtr>(m, "StaticObjectCost")
     .def(py::init<const ParameterPtr&>())
     .def(py::init<const ParameterPtr&, double, double>())
-    .def("AddObjectOutline", &optimizer::StaticObjectCost::AddObjectOutline);
+    .def("AddObjectOutline", &optimizer::StaticObjectCost::AddObjectOutline)
+    .def("SetFootprint", &optimizer::StaticObjectCost::SetFootprint);
+
+  py::class_<SdfObjectCost,
+             BaseCost,
+             SdfObjectCostPtr>(m, "SdfObjectCost")
+    .def(py::init<const ParameterPtr&>())
+    .def(py::init<const ParameterPtr&, double, double>())
+    .def("AddObjectOutline", &optimizer::SdfObjectCost::AddObjectOutline);
 
   py::class_<ReferenceCost, BaseCost, ReferenceCostPtr>(m, "ReferenceCost")
     .def(py::init<const ParameterPtr&>())
@@ -69,6 +80,26 @@ void python_optimizer(py::module m) {
     .def("SetLowerBound", &optimizer::InputCost::SetLowerBound)
     .def("SetUpperBound", &optimizer::InputCost::SetUpperBound);
 
+  py::enum_<SolveStatus>(m, "SolveStatus")
+    .value("CONVERGED", SolveStatus::CONVERGED)
+    .value("NO_CONVERGENCE", SolveStatus::NO_CONVERGENCE)
+    .value("TIME_BUDGET_EXCEEDED", SolveStatus::TIME_BUDGET_EXCEEDED)
+    .value("FAILURE", SolveStatus::FAILURE);
+
+  py::class_<IterationRecord>(m, "IterationRecord")
+    .def_readonly("iteration", &IterationRecord::iteration)
+    .def_readonly("cost", &IterationRecord::cost)
+    .def_readonly("cost_change", &IterationRecord::cost_change)
+    .def_readonly("gradient_norm", &IterationRecord::gradient_norm)
+    .def_readonly("step_norm", &IterationRecord::step_norm)
+    .def_readonly("step_size", &IterationRecord::step_size)
+    .def_readonly("iteration_time", &IterationRecord::iteration_time)
+    .def_readonly("cumulative_time", &IterationRecord::cumulative_time)
+    .def_readonly("evaluation_time", &IterationRecord::evaluation_time)
+    .def_readonly("rollout_time", &IterationRecord::rollout_time)
+    .def_readonly("cost_time", &IterationRecord::cost_time)
+    .def_readonly("num_evaluations", &IterationRecord::num_evaluations);
+
   py::class_<Optimizer, std::shared_ptr<Optimizer>>(m, "Optimizer")
     .def(py::init<const ParameterPtr&>())
     // .def("AddResidualBlock",
@@ -77,11 +108,54 @@ void python_optimizer(py::module m) {
     .def("Result", &optimizer::Optimizer::Result)
     .def("FixOptimizationVector", &optimizer::Optimizer::FixOptimizationVector)
     .def("SetOptimizationVector", &optimizer::Optimizer::SetOptimizationVector)
+    .def("SetInitialStates", &optimizer::Optimizer::SetInitialStates)
+    .def("ShiftOptimizationVector",
+      &optimizer::Optimizer::ShiftOptimizationVector)
+    .def("WarmStart", &optimizer::Optimizer::WarmStart,
+      py::arg("initial_states"), py::arg("k") = 1)
     .def("AddSingleTrackFunctor",
       &optimizer::Optimizer::PythonAddSingleTrackFunctor<SingleTrackFunctor>)
     .def("AddTripleIntFunctor",
       &optimizer::Optimizer::PythonAddSingleTrackFunctor<TripleIntFunctor>)
     .def("AddFastSingleTrackFunctor",
       &optimizer::Optimizer::PythonAddSingleTrackFunctor<FastSingleTrackFunctor>)
+    .def("AddAdaptiveSingleTrackFunctor",
+      &optimizer::Optimizer::PythonAddSingleTrackFunctor<
+        AdaptiveSingleTrackFunctor>)
+    .def("AddMultipleShootingSingleTrack",
+      &optimizer::Optimizer::AddMultipleShootingFunctors<SingleTrackModel,
+                                                         IntegrationRK4>)
+    .def("AddMultipleShootingTripleInt",
+      &optimizer::Optimizer::AddMultipleShootingFunctors<TripleIntModel,
+                                                         IntegrationExact>)
+    .def("AddMultipleShootingFastSingleTrack",
+      &optimizer::Optimizer::AddMultipleShootingFunctors<SingleTrackModel,
+                                                         IntegrationEuler>)
+    .def("States", &optimizer::Optimizer::States)
+    .def("SetTimeBudget", &optimizer::Optimizer::SetTimeBudget)
+    .def("Status", &optimizer::Optimizer::Status)
+    .def("RecordIterations", &optimizer::Optimizer::RecordIterations,
+      py::arg("record"), py::arg("file") = "")
+    .def("IterationRecords", &optimizer::Optimizer::IterationRecords)
+    .def("IterationRecordsMatrix",
+      &optimizer::Optimizer::IterationRecordsMatrix)
+    .def("RolloutCacheHits", &optimizer::Optimizer::RolloutCacheHits)
+    .def("RolloutCacheMisses", &optimizer::Optimizer::RolloutCacheMisses)
     .def("Report", &optimizer::Optimizer::Report);
+
+  py::class_<BatchOptimizer, std::shared_ptr<BatchOptimizer>>(
+    m, "BatchOptimizer")
+    .def(py::init<const ParameterPtr&>())
+    .def("AddSingleTrackProblem",
+      &optimizer::BatchOptimizer::AddProblem<SingleTrackFunctor>)
+    .def("AddTripleIntProblem",
+      &optimizer::BatchOptimizer::AddProblem<TripleIntFunctor>)
+    .def("AddFastSingleTrackProblem",
+      &optimizer::BatchOptimizer::AddProblem<FastSingleTrackFunctor>)
+    .def("Solve", &optimizer::BatchOptimizer::Solve,
+      py::call_guard<py::gil_scoped_release>())
+    .def("Result", &optimizer::BatchOptimizer::Result)
+    .def("Report", &optimizer::BatchOptimizer::Report)
+    .def("NumProblems", &optimizer::BatchOptimizer::NumProblems)
+    .def("SetNumThreads", &optimizer::BatchOptimizer::SetNumThreads);
 }
\ No newline at end of file
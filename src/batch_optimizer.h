@@ -0,0 +1,121 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <ceres/ceres.h>
+#include "src/commons/parameters.h"
+#include "src/geometry/geometry.h"
+#include "src/functors/costs/base_cost.h"
+#include "src/optimizer.h"
+
+namespace optimizer {
+
+using commons::ParameterPtr;
+using geometry::Matrix_t;
+using std::vector;
+
+typedef std::shared_ptr<Optimizer> OptimizerPtr;
+
+/**
+ * @brief Solves many independent optimization problems (e.g. several
+ * maneuver candidates) in parallel
+ * 
+ * Every problem is solved single-threaded by its own Optimizer; the
+ * problems are distributed over a fixed amount of worker threads.
+ */
+class BatchOptimizer {
+ public:
+  explicit BatchOptimizer(const ParameterPtr& params) :
+    params_(params),
+    num_threads_(params->get<int>(
+      "batch_num_threads",
+      std::max(1, static_cast<int>(std::thread::hardware_concurrency())))) {}
+
+  /**
+   * @brief Adds a problem defined by its initial states, initial
+   * optimization vector and costs
+   * 
+   * @tclass F Type of functor (e.g. SingleTrackFunctor)
+   * @param initial_states Initial states of the trajectory
+   * @param opt_vec Initial optimization vector
+   * @param costs Cost terms of this problem
+   * @return int Index of the problem
+   */
+  template<class F>
+  int AddProblem(const Matrix_t<double>& initial_states,
+                 const Matrix_t<double>& opt_vec,
+                 const std::vector<BaseCostPtr>& costs) {
+    OptimizerPtr opt = std::make_shared<Optimizer>(params_);
+    opt->SetOptimizationVector(opt_vec);
+    opt->PythonAddSingleTrackFunctor<F>(initial_states, params_, costs);
+    return this->AddProblem(opt);
+  }
+
+  /**
+   * @brief Adds an already formulated problem
+   * 
+   * @param opt Optimizer that holds the problem
+   * @return int Index of the problem
+   */
+  int AddProblem(const OptimizerPtr& opt) {
+    // the parallelization happens across the problems
+    opt->SetNumThreads(1);
+    optimizers_.push_back(opt);
+    return optimizers_.size() - 1;
+  }
+
+  /**
+   * @brief Solves all problems using the worker threads
+   * 
+   */
+  void Solve() {
+    std::atomic<int> next_problem(0);
+    auto worker = [&]() {
+      for (int i = next_problem++; i < NumProblems(); i = next_problem++) {
+        optimizers_[i]->Solve();
+      }
+    };
+    const int num_workers = std::min(num_threads_, NumProblems());
+    vector<std::thread> workers;
+    for (int i = 1; i < num_workers; i++) {
+      workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers) {
+      thread.join();
+    }
+  }
+
+  Matrix_t<double> Result(int idx) const {
+    return optimizers_.at(idx)->Result();
+  }
+
+  const ceres::Solver::Summary& Summary(int idx) const {
+    return optimizers_.at(idx)->Summary();
+  }
+
+  void Report(int idx) const {
+    optimizers_.at(idx)->Report();
+  }
+
+  OptimizerPtr GetOptimizer(int idx) const { return optimizers_.at(idx); }
+
+  int NumProblems() const { return optimizers_.size(); }
+
+  int GetNumThreads() const { return num_threads_; }
+  void SetNumThreads(int num_threads) { num_threads_ = num_threads; }
+
+ private:
+  ParameterPtr params_;
+  int num_threads_;
+  vector<OptimizerPtr> optimizers_;
+};
+
+}  // namespace optimizer
@@ -0,0 +1,227 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <ceres/ceres.h>
+#include "src/geometry/geometry.h"
+#include "src/functors/base_functor.h"
+
+namespace optimizer {
+
+typedef std::chrono::steady_clock Clock;
+using geometry::Matrix_t;
+
+/**
+ * @brief Terminates the solver once a wall-clock deadline is reached
+ * 
+ * The minimizers of ceres are monotonic, so the parameters hold the best
+ * iterate found so far whenever the callback stops the solver. To not
+ * overshoot the deadline the solver is also stopped if the next iteration
+ * would presumably take longer than the remaining time. The callback
+ * does not allocate and can be used within real-time loops.
+ */
+class DeadlineCallback : public ceres::IterationCallback {
+ public:
+  DeadlineCallback() : time_budget_s_(0.), triggered_(false) {}
+  virtual ~DeadlineCallback() {}
+
+  //! starts the clock; a budget <= 0 disables the deadline
+  void Start(double time_budget_ms) {
+    time_budget_s_ = time_budget_ms / 1000.;
+    start_ = Clock::now();
+    triggered_ = false;
+  }
+
+  ceres::CallbackReturnType operator()(
+    const ceres::IterationSummary& summary) override {
+    if (time_budget_s_ <= 0.)
+      return ceres::SOLVER_CONTINUE;
+    double elapsed = std::chrono::duration<double>(
+      Clock::now() - start_).count();
+    if (elapsed + summary.iteration_time_in_seconds >= time_budget_s_) {
+      triggered_ = true;
+      return ceres::SOLVER_TERMINATE_SUCCESSFULLY;
+    }
+    return ceres::SOLVER_CONTINUE;
+  }
+
+  //! whether the solver has been stopped by the deadline
+  bool Triggered() const { return triggered_; }
+
+ private:
+  double time_budget_s_;
+  Clock::time_point start_;
+  bool triggered_;
+};
+
+/**
+ * @brief Structured record of one solver iteration
+ * 
+ */
+struct IterationRecord {
+  int iteration;
+  double cost;
+  double cost_change;
+  double gradient_norm;
+  double step_norm;
+  double step_size;
+  double iteration_time;
+  double cumulative_time;
+  //! time spent in the functors (rollout + costs) during this iteration
+  double evaluation_time;
+  double rollout_time;
+  double cost_time;
+  int num_evaluations;
+};
+
+/**
+ * @brief Records every iteration of the solver and optionally streams the
+ * records to a CSV (*.csv) or JSON-lines file
+ * 
+ * The rollout and cost times are taken from the functors and reported as
+ * the difference to the previous iteration.
+ */
+class IterationRecorder : public ceres::IterationCallback {
+ public:
+  IterationRecorder() : functors_(nullptr) {}
+  virtual ~IterationRecorder() {}
+
+  /**
+   * @brief Clears the records and starts a new recording
+   * 
+   * @param functors Functors whose evaluation times are tracked
+   * @param file Output file ("" for none)
+   */
+  void Start(const std::vector<BaseFunctor*>* functors,
+             const std::string& file = "") {
+    functors_ = functors;
+    records_.clear();
+    last_rollout_time_ = TotalRolloutTime();
+    last_cost_time_ = TotalCostTime();
+    last_num_evaluations_ = TotalNumEvaluations();
+    if (stream_.is_open())
+      stream_.close();
+    json_ = file.size() < 4 || file.substr(file.size() - 4) != ".csv";
+    if (!file.empty()) {
+      stream_.open(file);
+      if (!json_) {
+        stream_ << "iteration,cost,cost_change,gradient_norm,step_norm,"
+                << "step_size,iteration_time,cumulative_time,"
+                << "evaluation_time,rollout_time,cost_time,"
+                << "num_evaluations\n";
+      }
+    }
+  }
+
+  ceres::CallbackReturnType operator()(
+    const ceres::IterationSummary& summary) override {
+    IterationRecord record;
+    record.iteration = summary.iteration;
+    record.cost = summary.cost;
+    record.cost_change = summary.cost_change;
+    record.gradient_norm = summary.gradient_norm;
+    record.step_norm = summary.step_norm;
+    record.step_size = summary.step_size;
+    record.iteration_time = summary.iteration_time_in_seconds;
+    record.cumulative_time = summary.cumulative_time_in_seconds;
+    double rollout_time = TotalRolloutTime();
+    double cost_time = TotalCostTime();
+    int num_evaluations = TotalNumEvaluations();
+    record.rollout_time = rollout_time - last_rollout_time_;
+    record.cost_time = cost_time - last_cost_time_;
+    record.evaluation_time = record.rollout_time + record.cost_time;
+    record.num_evaluations = num_evaluations - last_num_evaluations_;
+    last_rollout_time_ = rollout_time;
+    last_cost_time_ = cost_time;
+    last_num_evaluations_ = num_evaluations;
+    records_.push_back(record);
+    if (stream_.is_open())
+      Write(record);
+    return ceres::SOLVER_CONTINUE;
+  }
+
+  //! finishes the file output
+  void Stop() {
+    if (stream_.is_open())
+      stream_.close();
+  }
+
+  const std::vector<IterationRecord>& Records() const { return records_; }
+
+  //! records as matrix with one row per iteration (columns as in the CSV)
+  Matrix_t<double> RecordsMatrix() const {
+    Matrix_t<double> ret(records_.size(), 12);
+    for (int i = 0; i < ret.rows(); i++) {
+      const IterationRecord& r = records_[i];
+      ret.row(i) << r.iteration, r.cost, r.cost_change, r.gradient_norm,
+        r.step_norm, r.step_size, r.iteration_time, r.cumulative_time,
+        r.evaluation_time, r.rollout_time, r.cost_time, r.num_evaluations;
+    }
+    return ret;
+  }
+
+ private:
+  void Write(const IterationRecord& r) {
+    if (json_) {
+      stream_ << "{\"iteration\": " << r.iteration
+              << ", \"cost\": " << r.cost
+              << ", \"cost_change\": " << r.cost_change
+              << ", \"gradient_norm\": " << r.gradient_norm
+              << ", \"step_norm\": " << r.step_norm
+              << ", \"step_size\": " << r.step_size
+              << ", \"iteration_time\": " << r.iteration_time
+              << ", \"cumulative_time\": " << r.cumulative_time
+              << ", \"evaluation_time\": " << r.evaluation_time
+              << ", \"rollout_time\": " << r.rollout_time
+              << ", \"cost_time\": " << r.cost_time
+              << ", \"num_evaluations\": " << r.num_evaluations << "}\n";
+    } else {
+      stream_ << r.iteration << "," << r.cost << "," << r.cost_change << ","
+              << r.gradient_norm << "," << r.step_norm << ","
+              << r.step_size << "," << r.iteration_time << ","
+              << r.cumulative_time << "," << r.evaluation_time << ","
+              << r.rollout_time << "," << r.cost_time << ","
+              << r.num_evaluations << "\n";
+    }
+  }
+
+  double TotalRolloutTime() const {
+    double time = 0.;
+    if (functors_)
+      for (const BaseFunctor* functor : *functors_)
+        time += functor->GetRolloutTime();
+    return time;
+  }
+
+  double TotalCostTime() const {
+    double time = 0.;
+    if (functors_)
+      for (const BaseFunctor* functor : *functors_)
+        time += functor->GetCostTime();
+    return time;
+  }
+
+  int TotalNumEvaluations() const {
+    int num = 0;
+    if (functors_)
+      for (const BaseFunctor* functor : *functors_)
+        num += functor->GetNumEvaluations();
+    return num;
+  }
+
+  const std::vector<BaseFunctor*>* functors_;
+  std::vector<IterationRecord> records_;
+  double last_rollout_time_;
+  double last_cost_time_;
+  int last_num_evaluations_;
+  bool json_;
+  std::ofstream stream_;
+};
+
+}  // namespace optimizer
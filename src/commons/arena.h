@@ -0,0 +1,177 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include "src/geometry/base.h"
+
+namespace commons {
+
+using geometry::MatrixMap_t;
+
+/**
+ * @brief Bump allocator for the scratch memory of an evaluation (e.g. the
+ * Jet matrices of DynamicFunctor::operator())
+ *
+ * Allocations only advance an offset and are released all at once when
+ * the enclosing Scope ends. If an evaluation needed more than one block,
+ * the blocks are merged once it is done, so that every following
+ * evaluation of the same size fits into a single block and does not
+ * allocate at all.
+ */
+class Arena {
+ public:
+  //! alignment of every allocation (a cache line)
+  static constexpr std::size_t kAlignment = 64;
+
+  explicit Arena(std::size_t block_size = 1 << 16) :
+    block_size_(block_size), block_(0), offset_(0) {}
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  /**
+   * @brief Rewinds the arena to its state at the construction; the
+   * outermost scope also merges the blocks (see Reset)
+   */
+  class Scope {
+   public:
+    explicit Scope(Arena* arena) :
+      arena_(arena), block_(arena->block_), offset_(arena->offset_),
+      num_finalizers_(arena->finalizers_.size()) {}
+    ~Scope() {
+      arena_->Finalize(num_finalizers_);
+      if (block_ == 0 && offset_ == 0) {
+        arena_->Reset();
+      } else {
+        arena_->block_ = block_;
+        arena_->offset_ = offset_;
+      }
+    }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+   private:
+    Arena* arena_;
+    std::size_t block_;
+    std::size_t offset_;
+    std::size_t num_finalizers_;
+  };
+
+  /**
+   * @brief Uninitialized memory for n values; valid until the enclosing
+   * Scope ends, which does not call their destructors
+   */
+  template<typename T>
+  T* Allocate(std::size_t n) {
+    static_assert(alignof(T) <= kAlignment, "Over-aligned type.");
+    return static_cast<T*>(AllocateBytes(n*sizeof(T)));
+  }
+
+  /**
+   * @brief Matrix in the arena; its coefficients are default constructed
+   * and destructed by the enclosing Scope (e.g. Jets with dynamically
+   * sized derivatives)
+   */
+  template<typename T>
+  MatrixMap_t<T> Matrix(int rows, int cols) {
+    T* data = Allocate<T>(rows*cols);
+    std::uninitialized_value_construct_n(data, rows*cols);
+    if constexpr (!std::is_trivially_destructible<T>::value) {
+      finalizers_.push_back({
+        [](void* values, std::size_t n) {
+          std::destroy_n(static_cast<T*>(values), n);
+        },
+        data,
+        static_cast<std::size_t>(rows*cols)});
+    }
+    return MatrixMap_t<T>(data, rows, cols);
+  }
+
+  //! releases all allocations and merges the blocks into one
+  void Reset() {
+    Finalize(0);
+    if (blocks_.size() > 1) {
+      std::size_t size = 0;
+      for (const Block& block : blocks_)
+        size += block.size;
+      blocks_.clear();
+      blocks_.emplace_back(size);
+    }
+    block_ = 0;
+    offset_ = 0;
+  }
+
+  int NumBlocks() const { return blocks_.size(); }
+
+  std::size_t Capacity() const {
+    std::size_t size = 0;
+    for (const Block& block : blocks_)
+      size += block.size;
+    return size;
+  }
+
+  //! arena of the calling thread (ceres evaluates residual blocks in
+  //  parallel)
+  static Arena& ThreadLocal() {
+    static thread_local Arena arena;
+    return arena;
+  }
+
+ private:
+  struct Block {
+    explicit Block(std::size_t bytes) :
+      memory(new char[bytes + kAlignment]), size(bytes) {
+      const std::uintptr_t address =
+        reinterpret_cast<std::uintptr_t>(memory.get());
+      data = memory.get() + (kAlignment - address % kAlignment) % kAlignment;
+    }
+    std::unique_ptr<char[]> memory;
+    char* data;
+    std::size_t size;
+  };
+
+  //! destructs the values registered after the first num_finalizers
+  struct Finalizer {
+    void (*destroy)(void*, std::size_t);
+    void* values;
+    std::size_t n;
+  };
+
+  void Finalize(std::size_t num_finalizers) {
+    while (finalizers_.size() > num_finalizers) {
+      const Finalizer& finalizer = finalizers_.back();
+      finalizer.destroy(finalizer.values, finalizer.n);
+      finalizers_.pop_back();
+    }
+  }
+
+  void* AllocateBytes(std::size_t bytes) {
+    bytes = (bytes + kAlignment - 1) / kAlignment * kAlignment;
+    while (block_ < blocks_.size() && offset_ + bytes > blocks_[block_].size) {
+      block_++;
+      offset_ = 0;
+    }
+    if (block_ == blocks_.size())
+      blocks_.emplace_back(std::max(block_size_, bytes));
+    void* data = blocks_[block_].data + offset_;
+    offset_ += bytes;
+    return data;
+  }
+
+  std::size_t block_size_;
+  std::vector<Block> blocks_;
+  std::vector<Finalizer> finalizers_;
+  //! current block and offset within it
+  std::size_t block_;
+  std::size_t offset_;
+};
+
+}  // namespace commons
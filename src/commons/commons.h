@@ -6,17 +6,22 @@
 #include <limits>
 #include <utility>
 #include <vector>
+#include <algorithm>
 #include <ceres/ceres.h>
+#include <boost/iterator/function_output_iterator.hpp>
 #include "src/geometry/geometry.h"
 #include "src/commons/parameters.h"
+#include "src/commons/arena.h"
 
 namespace commons {
 
 using geometry::Matrix_t;
-using geometry::Line;
-using geometry::Point;
-using geometry::Polygon;
-using geometry::Distance;
+using geometry::MatrixRef_t;
+using geometry::Point2;
+using geometry::ReferencePath;
+using geometry::ScalarValue;
+using geometry::OutlineDistance;
+namespace bg = boost::geometry;
 using commons::Parameter;
 using commons::ParameterPtr;
 
@@ -45,29 +50,154 @@ class ObjectOutline {
     this->Add(outline, timestamp);
   }
 
+  //! the outlines are kept sorted by their timestamps
   void Add(const Matrix_t<double>& outline, double timestamp = 0) {
     TimedPolygonOutline timed_outline = std::make_pair(timestamp, outline);
-    object_outlines_.push_back(timed_outline);
+    object_outlines_.insert(UpperBound(timestamp), timed_outline);
   }
 
+  //! outline interpolated at the time; the first and last outline are
+  //  held before and after
   Matrix_t<double> Query(double timestamp_query) const {
-    for (int i = 0; i < object_outlines_.size() - 1; i++) {
-      if (object_outlines_.at(i).first <= timestamp_query && \
-          object_outlines_.at(i+1).first > timestamp_query) {
-        return InterpolateTimedPolygon(object_outlines_.at(i),
-                                       object_outlines_.at(i+1),
-                                       timestamp_query);
-      }
-    }
-    if (timestamp_query >= object_outlines_.back().first)
+    auto next = UpperBound(timestamp_query);
+    if (next == object_outlines_.begin())
+      return object_outlines_.front().second;
+    if (next == object_outlines_.end())
       return object_outlines_.back().second;
-    return object_outlines_.front().second;
+    return InterpolateTimedPolygon(*(next - 1), *next, timestamp_query);
+  }
+
+  //! Query(..) into an existing outline, so that it is only resized if the
+  //  number of vertices changes
+  void Query(double timestamp_query, Matrix_t<double>* outline) const {
+    auto next = UpperBound(timestamp_query);
+    if (next == object_outlines_.begin()) {
+      *outline = object_outlines_.front().second;
+    } else if (next == object_outlines_.end()) {
+      *outline = object_outlines_.back().second;
+    } else {
+      const TimedPolygonOutline& p0 = *(next - 1);
+      const TimedPolygonOutline& p1 = *next;
+      const double lambda =
+        (timestamp_query - p0.first) / (p1.first - p0.first);
+      outline->resize(p0.second.rows(), p0.second.cols());
+      outline->noalias() = (1. - lambda)*p0.second + lambda*p1.second;
+    }
+  }
+
+  //! outlines with their timestamps
+  const std::vector<TimedPolygonOutline>& GetOutlines() const {
+    return object_outlines_;
   }
 
  private:
+  //! first outline after the timestamp
+  std::vector<TimedPolygonOutline>::const_iterator UpperBound(
+    double timestamp) const {
+    return std::upper_bound(
+      object_outlines_.begin(), object_outlines_.end(), timestamp,
+      [](double t, const TimedPolygonOutline& outline) {
+        return t < outline.first;
+      });
+  }
+
   std::vector<TimedPolygonOutline> object_outlines_;
 };
 
+/**
+ * @brief Spatio-temporal broadphase over object outlines
+ *
+ * Every interval between two outlines of an object is stored as an (x, y,
+ * t) box in an R-tree; the box bounds both outlines (and therefore their
+ * interpolation) and is inflated by epsilon. Points outside of all boxes
+ * of an object are farther than epsilon away from it.
+ */
+class ObjectIndex {
+ public:
+  typedef bg::model::point<double, 3, bg::cs::cartesian> Point3_t;
+  typedef bg::model::box<Point3_t> Box3_t;
+  typedef std::pair<Box3_t, int> Value_t;
+
+  ObjectIndex() : epsilon_(0.) {}
+  explicit ObjectIndex(double epsilon) : epsilon_(epsilon) {}
+
+  void Clear() { rtree_.clear(); }
+
+  /**
+   * @brief Inserts the boxes of an object
+   *
+   * @param obj_out Outlines of the object
+   * @param idx Index of the object reported by Query
+   */
+  void Insert(const ObjectOutline& obj_out, int idx) {
+    static constexpr double kInf = std::numeric_limits<double>::max();
+    const std::vector<TimedPolygonOutline>& outlines = obj_out.GetOutlines();
+    if (outlines.empty())
+      return;
+    // Query(..) holds the first and last outline before and after
+    InsertBox(outlines.front().second, outlines.front().second,
+              -kInf, outlines.front().first, idx);
+    for (size_t i = 0; i + 1 < outlines.size(); i++) {
+      InsertBox(outlines[i].second, outlines[i + 1].second,
+                outlines[i].first, outlines[i + 1].first, idx);
+    }
+    InsertBox(outlines.back().second, outlines.back().second,
+              outlines.back().first, kInf, idx);
+  }
+
+  /**
+   * @brief Objects that can be within epsilon of the point at the time t
+   *
+   * @param candidates Sorted indices of the objects (without duplicates)
+   */
+  void Query(double x, double y, double t, std::vector<int>* candidates) const {
+    candidates->resize(Size());
+    candidates->resize(Query(x, y, t, candidates->data()));
+  }
+
+  /**
+   * @brief Query(..) into existing memory; the tree is traversed
+   * recursively, as its query iterators allocate their stack
+   *
+   * @param candidates Memory for at least Size() indices
+   * @return int Number of candidates
+   */
+  int Query(double x, double y, double t, int* candidates) const {
+    int num_candidates = 0;
+    rtree_.query(bg::index::intersects(Point3_t(x, y, t)),
+                 boost::make_function_output_iterator(
+                   [&](const Value_t& value) {
+                     candidates[num_candidates++] = value.second;
+                   }));
+    std::sort(candidates, candidates + num_candidates);
+    return std::unique(candidates, candidates + num_candidates) - candidates;
+  }
+
+  int Size() const { return rtree_.size(); }
+
+ private:
+  void InsertBox(const Matrix_t<double>& outline0,
+                 const Matrix_t<double>& outline1,
+                 double t0,
+                 double t1,
+                 int idx) {
+    const double min_x = std::min(outline0.col(0).minCoeff(),
+                                  outline1.col(0).minCoeff()) - epsilon_;
+    const double min_y = std::min(outline0.col(1).minCoeff(),
+                                  outline1.col(1).minCoeff()) - epsilon_;
+    const double max_x = std::max(outline0.col(0).maxCoeff(),
+                                  outline1.col(0).maxCoeff()) + epsilon_;
+    const double max_y = std::max(outline0.col(1).maxCoeff(),
+                                  outline1.col(1).maxCoeff()) + epsilon_;
+    rtree_.insert(std::make_pair(Box3_t(Point3_t(min_x, min_y, t0),
+                                        Point3_t(max_x, max_y, t1)),
+                                 idx));
+  }
+
+  double epsilon_;
+  bg::index::rtree<Value_t, bg::index::rstar<16>> rtree_;
+};
+
 
 template<typename T>
 inline Matrix_t<T> CalculateDiff(const Matrix_t<T>& traj, const T& dt) {
@@ -78,67 +208,143 @@ inline Matrix_t<T> CalculateDiff(const Matrix_t<T>& traj, const T& dt) {
   return ret_traj;
 }
 
+/**
+ * @brief Writes the jerk of the trajectory row i >= 3 (X, Y and Z
+ *        component; zero if the model has no such state)
+ */
 template<typename T, class M>
-inline T CalculateSquaredJerk(const Matrix_t<T>& traj, const T& dt) {
-  // TODO(@hart): make more efficient
-  Matrix_t<T> reduced_traj(traj.rows(), 3);
-  reduced_traj.setZero();
-  reduced_traj.col(0) = traj.col(static_cast<int>(M::StateDefinition::X));
-  reduced_traj.col(1) = traj.col(static_cast<int>(M::StateDefinition::Y));
-  if (static_cast<int>(M::StateDefinition::Z) != -1)
-    reduced_traj.col(2) = traj.col(static_cast<int>(M::StateDefinition::Z));
-  // std::cout << static_cast<int>(M::StateDefinition::X) << ", " \
-  //           << static_cast<int>(M::StateDefinition::Y) << ", " \
-  //           << static_cast<int>(M::StateDefinition::Z) << std::endl;
-  Matrix_t<T> traj_v = CalculateDiff(reduced_traj, dt);
-  Matrix_t<T> traj_a = CalculateDiff(traj_v, dt);
-  Matrix_t<T> traj_j = CalculateDiff(traj_a, dt);
-  T jerk = T(0.);
-  for (int i = 0; i < traj_j.rows(); i++) {
-    for (int j = 0; j < traj_j.cols(); j++) {
-      jerk += traj_j(i, j)*traj_j(i, j);
+inline void CalculateJerkResidualsRow(const MatrixRef_t<T>& traj,
+                                      int i,
+                                      const T& dt_cubed,
+                                      T* residuals) {
+  const int idx[3] = {static_cast<int>(M::StateDefinition::X),
+                      static_cast<int>(M::StateDefinition::Y),
+                      static_cast<int>(M::StateDefinition::Z)};
+  for (int j = 0; j < 3; j++) {
+    if (idx[j] == -1) {
+      residuals[j] = T(0.);
+      continue;
     }
+    residuals[j] = (traj(i, idx[j]) - T(3.)*traj(i-1, idx[j]) +
+      T(3.)*traj(i-2, idx[j]) - traj(i-3, idx[j])) / dt_cubed;
+  }
+}
+
+//! squared jerk of the trajectory using the third order differences
+template<typename T, class M>
+inline T CalculateSquaredJerk(const MatrixRef_t<T>& traj, const T& dt) {
+  const T dt_cubed = dt*dt*dt;
+  T jerk = T(0.);
+  T residuals[3];
+  for (int i = 3; i < traj.rows(); i++) {
+    CalculateJerkResidualsRow<T, M>(traj, i, dt_cubed, residuals);
+    for (int j = 0; j < 3; j++)
+      jerk += residuals[j]*residuals[j];
   }
   return jerk;
 }
 
+/**
+ * @brief Writes the jerk of every timestep as residuals (X, Y and Z
+ *        component per row), so that their squared sum equals
+ *        CalculateSquaredJerk
+ */
 template<typename T, class M>
-inline T CalculateSquaredDistance(const Line<T, 2>& line,
-                                  const Matrix_t<T>& trajectory,
+inline void CalculateJerkResiduals(const MatrixRef_t<T>& traj,
+                                   const T& dt,
+                                   T* residuals) {
+  const T dt_cubed = dt*dt*dt;
+  for (int i = 3; i < traj.rows(); i++)
+    CalculateJerkResidualsRow<T, M>(traj, i, dt_cubed, residuals + 3*(i-3));
+}
+
+//! position (X, Y) of the trajectory row i without derivatives
+template<typename T, class M>
+inline Point2<double> PositionValue(const MatrixRef_t<T>& trajectory, int i) {
+  return {ScalarValue(trajectory(i, static_cast<int>(M::StateDefinition::X))),
+          ScalarValue(trajectory(i, static_cast<int>(M::StateDefinition::Y)))};
+}
+
+//! distance of the trajectory row i to the segment of the path
+template<typename T, class M>
+inline T CalculateDistanceResidual(const ReferencePath& path,
+                                   const MatrixRef_t<T>& trajectory,
+                                   int i,
+                                   int segment) {
+  return path.Distance<T>(
+    trajectory(i, static_cast<int>(M::StateDefinition::X)),
+    trajectory(i, static_cast<int>(M::StateDefinition::Y)),
+    segment);
+}
+
+//! closest segment of the path for the trajectory row i; rows have to be
+//  advanced in order (see ReferencePath::Advance)
+template<typename T, class M>
+inline int AdvanceTrajectory(const ReferencePath& path,
+                             const MatrixRef_t<T>& trajectory,
+                             int i,
+                             ReferencePath::Cursor* cursor) {
+  const Point2<double> position = PositionValue<T, M>(trajectory, i);
+  return path.Advance(position.x, position.y, cursor);
+}
+
+/**
+ * @brief Closest segment of the path for every trajectory row; the rows
+ * are projected in order, so that every row only tests the segments near
+ * the projection of the previous one
+ *
+ * @param segments Segments of size trajectory.rows()
+ */
+template<typename T, class M>
+inline void ProjectTrajectory(const ReferencePath& path,
+                              const MatrixRef_t<T>& trajectory,
+                              int* segments) {
+  ReferencePath::Cursor cursor;
+  for (int i = 0; i < trajectory.rows(); i++)
+    segments[i] = AdvanceTrajectory<T, M>(path, trajectory, i, &cursor);
+}
+
+template<typename T, class M>
+inline T CalculateSquaredDistance(const ReferencePath& path,
+                                  const MatrixRef_t<T>& trajectory,
                                   T dist = T(0.)) {
+  ReferencePath::Cursor cursor;
   T tmp_dist = T(0.);
-  Point<T, 2> pt;
   for ( int i = 0; i < trajectory.rows(); i++ ) {
-    // TODO(@hart): use state definitions
-    boost::geometry::set<0>(pt.obj_,
-      trajectory(i, static_cast<int>(M::StateDefinition::X)));
-    boost::geometry::set<1>(pt.obj_,
-      trajectory(i, static_cast<int>(M::StateDefinition::Y)));
-    tmp_dist = Distance<T, Line<T, 2>, Point<T, 2>>(line, pt);
+    tmp_dist = CalculateDistanceResidual<T, M>(
+      path, trajectory, i,
+      AdvanceTrajectory<T, M>(path, trajectory, i, &cursor));
     dist += tmp_dist*tmp_dist;
   }
   return dist;
 }
 
+//! distances of all trajectory rows to the path
+template<typename T, class M>
+inline void CalculateDistanceResiduals(const ReferencePath& path,
+                                       const MatrixRef_t<T>& trajectory,
+                                       T* residuals) {
+  ReferencePath::Cursor cursor;
+  for ( int i = 0; i < trajectory.rows(); i++ )
+    residuals[i] = CalculateDistanceResidual<T, M>(
+      path, trajectory, i,
+      AdvanceTrajectory<T, M>(path, trajectory, i, &cursor));
+}
+
 template<typename T, class M>
 inline T GetSquaredObjectCosts(const ObjectOutline& obj_out,
-                               const Matrix_t<T>& trajectory,
+                               const MatrixRef_t<T>& trajectory,
                                const T& epsilon,
                                double dt) {
   T tmp_dist = T(0.);
   T dist = T(0.);
-  Point<T, 2> pt;
-  Polygon<T, 2> poly;
+  Matrix_t<double> object_outline;
   for ( int i = 0; i < trajectory.rows(); i++ ) {
-    Matrix_t<double> object_outline =
-      obj_out.Query(i*dt);
-    // TODO(@hart): use state definitions
-    boost::geometry::set<0>(pt.obj_,
-      trajectory(i, static_cast<int>(M::StateDefinition::X)));
-    boost::geometry::set<1>(pt.obj_,
+    obj_out.Query(i*dt, &object_outline);
+    tmp_dist = OutlineDistance<T>(
+      object_outline,
+      trajectory(i, static_cast<int>(M::StateDefinition::X)),
       trajectory(i, static_cast<int>(M::StateDefinition::Y)));
-    poly = Polygon<T, 2>(object_outline.cast<T>());
-    tmp_dist = Distance<T, 2>(poly, pt);
     if (tmp_dist < epsilon) {
       dist += (epsilon - tmp_dist)*(epsilon - tmp_dist);
     }
@@ -146,9 +352,43 @@ inline T GetSquaredObjectCosts(const ObjectOutline& obj_out,
   return dist;
 }
 
+//! hinge residual of the trajectory row i at the time t: (epsilon -
+//  distance) if closer than epsilon and zero otherwise
 template<typename T, class M>
-inline T CalculateSquaredDistance(const Matrix_t<T>& traj0,
-                                  const Matrix_t<T>& traj1,
+inline T GetObjectResidual(const ObjectOutline& obj_out,
+                           const MatrixRef_t<T>& trajectory,
+                           int i,
+                           const T& epsilon,
+                           double t) {
+  T tmp_dist = OutlineDistance<T>(
+    obj_out.Query(t),
+    trajectory(i, static_cast<int>(M::StateDefinition::X)),
+    trajectory(i, static_cast<int>(M::StateDefinition::Y)));
+  return tmp_dist < epsilon ? epsilon - tmp_dist : T(0.);
+}
+
+//! one hinge residual per timestep (see GetObjectResidual)
+template<typename T, class M>
+inline void GetObjectResiduals(const ObjectOutline& obj_out,
+                               const MatrixRef_t<T>& trajectory,
+                               const T& epsilon,
+                               double dt,
+                               T* residuals,
+                               int row_offset = 0) {
+  Matrix_t<double> object_outline;
+  for ( int i = 0; i < trajectory.rows(); i++ ) {
+    obj_out.Query((row_offset + i)*dt, &object_outline);
+    const T tmp_dist = OutlineDistance<T>(
+      object_outline,
+      trajectory(i, static_cast<int>(M::StateDefinition::X)),
+      trajectory(i, static_cast<int>(M::StateDefinition::Y)));
+    residuals[i] = tmp_dist < epsilon ? epsilon - tmp_dist : T(0.);
+  }
+}
+
+template<typename T, class M>
+inline T CalculateSquaredDistance(const MatrixRef_t<T>& traj0,
+                                  const MatrixRef_t<T>& traj1,
                                   T dist = T(0.)) {
   T tmp_dist = T(0.);
   T loc = T(0.);
@@ -163,5 +403,19 @@ inline T CalculateSquaredDistance(const Matrix_t<T>& traj0,
   return dist;
 }
 
-}  // namespace commons
+//! squared point-wise distance of two trajectories as one residual per row
+template<typename T, class M>
+inline void CalculateDistanceResiduals(const MatrixRef_t<T>& traj0,
+                                       const MatrixRef_t<T>& traj1,
+                                       T* residuals) {
+  T loc = T(0.);
+  for (int i = 0; i < traj0.rows(); i++) {
+    loc = T(0.);
+    for (int j = 0; j < traj0.cols(); j++) {
+      loc += (traj0(i, j) - traj1(i, j))*(traj0(i, j) - traj1(i, j));
+    }
+    residuals[i] = loc;
+  }
+}
 
+}  // namespace commons
@@ -0,0 +1,60 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+#pragma once
+#include <Eigen/Dense>
+#include <cmath>
+#include "src/geometry/geometry.h"
+
+namespace dynamics {
+using geometry::Batch_t;
+
+/**
+ * @brief Sine and cosine of a batch of angles
+ *
+ * Eigen evaluates the trigonometric functions of doubles one by one; this
+ * branch-free version (Cody-Waite reduction to [-pi/4, pi/4] and the
+ * Cephes polynomials) is a plain loop the compiler vectorizes (e.g. with
+ * -mavx2). Accurate to a few ulp for |x| < 1e5.
+ *
+ * @param x Angles
+ * @param s Sine of the angles
+ * @param c Cosine of the angles
+ */
+template<class X, class S, class C>
+inline void BatchSinCos(const Eigen::DenseBase<X>& x,
+                        Eigen::DenseBase<S>* s,
+                        Eigen::DenseBase<C>* c) {
+  static constexpr double kTwoOverPi = 0.63661977236758134308;
+  // pi/2 split into three parts, so that q*kPio2a is exact
+  static constexpr double kPio2a = 1.5707963267341256e+00;
+  static constexpr double kPio2b = 6.0771005065061922e-11;
+  static constexpr double kPio2c = 2.0222662487959506e-21;
+  // adding and subtracting 1.5*2^52 rounds to the nearest integer
+  static constexpr double kRound = 6755399441055744.0;
+  const int n = x.size();
+  for (int i = 0; i < n; i++) {
+    const double xi = x.derived().coeff(i);
+    const double q = (xi*kTwoOverPi + kRound) - kRound;
+    const double r = ((xi - q*kPio2a) - q*kPio2b) - q*kPio2c;
+    const double z = r*r;
+    const double sin_r = r + r*z*(((((
+      1.58962301576546568060e-10*z - 2.50507477628578072866e-8)*z +
+      2.75573136213857245213e-6)*z - 1.98412698295895385996e-4)*z +
+      8.33333333332211858878e-3)*z - 1.66666666666666307295e-1);
+    const double cos_r = 1. - 0.5*z + z*z*(((((
+      -1.13585365213876817300e-11*z + 2.08757008419747316778e-9)*z -
+      2.75573141792967388112e-7)*z + 2.48015872888517045348e-5)*z -
+      1.38888888888730564116e-3)*z + 4.16666666666665929218e-2);
+    // quadrant of x
+    const int quadrant = static_cast<int>(q);
+    const bool swap = quadrant & 1;
+    const double s_i = swap ? cos_r : sin_r;
+    const double c_i = swap ? sin_r : cos_r;
+    s->derived().coeffRef(i) = (quadrant & 2) ? -s_i : s_i;
+    c->derived().coeffRef(i) = ((quadrant + 1) & 2) ? -c_i : c_i;
+  }
+}
+
+}  // namespace dynamics
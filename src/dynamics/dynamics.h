@@ -4,10 +4,15 @@
 // For a copy, see <https://opensource.org/licenses/MIT>.
 #pragma once
 #include <Eigen/Dense>
+#include <vector>
+#include <type_traits>
 
 //! available dynamic models
 #include "src/dynamics/integration/euler.h"
 #include "src/dynamics/integration/rk4.h"
+#include "src/dynamics/integration/exact.h"
+#include "src/dynamics/integration/rk45.h"
+#include "src/dynamics/models/linear_model.h"
 #include "src/dynamics/models/single_track.h"
 #include "src/dynamics/models/triple_int.h"
 #include "src/dynamics/models/robot_arm.h"
@@ -17,13 +22,115 @@ namespace dynamics {
   using commons::ParameterPtr;
   using commons::Parameter;
   using geometry::Matrix_t;
+  using geometry::MatrixRef_t;
+  using geometry::State_t;
+  using geometry::Input_t;
+  using geometry::Batch_t;
+
+  //! whether a model advertises static state and input dimensions
+  template<class M, class = void>
+  struct HasFixedDims : std::false_type {};
+
+  template<class M>
+  struct HasFixedDims<M, std::void_t<decltype(M::kStateDim),
+                                     decltype(M::kInputDim)>> :
+    std::true_type {};
+
+  //! whether a model provides the Jacobians of its dynamics
+  template<class M, class = void>
+  struct HasStepJacobian : std::false_type {};
+
+  template<class M>
+  struct HasStepJacobian<M, std::void_t<decltype(&M::fDotJacobian)>> :
+    std::true_type {};
+
+  //! whether an integrator can be linearized (adaptive ones opt out)
+  template<class I, class = void>
+  struct HasLinearize : std::true_type {};
+
+  template<class I>
+  struct HasLinearize<I, std::void_t<decltype(I::kHasLinearize)>> :
+    std::bool_constant<I::kHasLinearize> {};
 
   enum DynamicModels {
     SINGLE_TRACK = 0,
     COPY_MODEL = 1,
     TRIPLE_INT = 1,
   };
+
+  /**
+   * @brief Single step of a model; runs on fixed-size (stack) states and
+   * inputs if the model advertises its dimensions and falls back to
+   * dynamically sized matrices otherwise
+   * 
+   * @tparam T Type of data
+   * @tparam M Dynamic model used
+   * @tparam I Integration method (euler, rk4, ..)
+   * @param state State (row)
+   * @param u Input (row)
+   * @param params Compiled parameters of the model (see M::Compile)
+   * @return Next state (row)
+   */
+  template<typename T, class M, class I, class S, class U>
+  inline auto ModelStep(const Eigen::MatrixBase<S>& state,
+                        const Eigen::MatrixBase<U>& u,
+                        const typename M::Params& params) {
+    if constexpr (HasFixedDims<M>::value) {
+      return M::template Step<T, I>(State_t<T, M::kStateDim>(state),
+                                    Input_t<T, M::kInputDim>(u),
+                                    params);
+    } else {
+      return M::template Step<T, I>(Matrix_t<T>(state),
+                                    Matrix_t<T>(u),
+                                    params);
+    }
+  }
   
+  //! rows of the trajectory GenerateDynamicTrajectory generates
+  template<class M>
+  inline int TrajectoryRows(int initial_rows,
+                            int input_rows,
+                            const typename M::Params& params) {
+    return params.is_static ? input_rows : initial_rows + input_rows;
+  }
+
+  /**
+   * @brief Generates a dynamic trajectory into existing memory (e.g. of a
+   * commons::Arena)
+   * 
+   * @param trajectory Trajectory of size (TrajectoryRows, State)
+   */
+  template<typename T, class M, class I>
+  inline void GenerateDynamicTrajectory(
+    const MatrixRef_t<T>& initial_states,
+    const MatrixRef_t<T>& input_vector,
+    const typename M::Params& params,
+    Eigen::Ref<Matrix_t<T>> trajectory) {
+    // in case not a state space model
+    if (params.is_static) {
+      for (int i = 0; i < input_vector.rows(); i++) {
+        trajectory.row(i) = ModelStep<T, M, I>(initial_states,
+                                               input_vector.row(i),
+                                               params);
+      }
+      return;
+    }
+    // normal model
+    int total_rows = input_vector.rows() + initial_states.rows();
+    trajectory.block(0,
+                     0,
+                     initial_states.rows(),
+                     initial_states.cols()) = initial_states;
+    // assume its correct up to here
+    int count = 0;
+    for (int i = initial_states.rows(); i < total_rows; i++) {
+      trajectory.row(i) = ModelStep<T, M, I>(trajectory.row(i-1),
+                                             input_vector.row(count),
+                                             params);
+      count++;
+    }
+  }
+
   /**
    * @brief Function that generates a dynamic trajectory
    * 
@@ -32,41 +139,202 @@ namespace dynamics {
    * @tparam I Integration method (euler, rk4, ..)
    * @param initial_states Initial state(s) for trajectory 
    * @param input_vector Input vector of size (N, InputSize)
-   * @param params Parameters, such as delta time, wheel_base etc.
+   * @param params Compiled parameters of the model (see M::Compile)
    * @return Matrix_t<T> Trajectory of size (N, State)
    */
   template<typename T, class M, class I>
+  inline Matrix_t<T> GenerateDynamicTrajectory(
+    const MatrixRef_t<T>& initial_states,
+    const MatrixRef_t<T>& input_vector,
+    const typename M::Params& params) {
+    Matrix_t<T> trajectory(
+      TrajectoryRows<M>(initial_states.rows(), input_vector.rows(), params),
+      initial_states.cols());
+    GenerateDynamicTrajectory<T, M, I>(initial_states,
+                                       input_vector,
+                                       params,
+                                       trajectory);
+    return trajectory;
+  }
+
+  //! compiles the parameters of the model first
+  template<typename T, class M, class I>
   inline Matrix_t<T> GenerateDynamicTrajectory(
     const Matrix_t<T>& initial_states,
     const Matrix_t<T>& input_vector,
     Parameter* params) {
+    return GenerateDynamicTrajectory<T, M, I>(initial_states,
+                                              input_vector,
+                                              M::Compile(*params));
+  }
+
+  /**
+   * @brief Regenerates the part of a trajectory that depends on the inputs
+   * from first_input on; the rows before are kept as they are
+   * 
+   * @param first_input First input row that changed
+   * @param trajectory Trajectory of a previous GenerateDynamicTrajectory
+   * call with the same initial states and amount of inputs
+   */
+  template<typename T, class M, class I>
+  inline void RegenerateDynamicTrajectory(
+    const MatrixRef_t<T>& initial_states,
+    const MatrixRef_t<T>& input_vector,
+    const typename M::Params& params,
+    int first_input,
+    Matrix_t<T>* trajectory) {
+    if (params.is_static) {
+      for (int i = first_input; i < input_vector.rows(); i++) {
+        trajectory->row(i) = ModelStep<T, M, I>(initial_states,
+                                                input_vector.row(i),
+                                                params);
+      }
+      return;
+    }
+    const int offset = initial_states.rows();
+    for (int i = first_input; i < input_vector.rows(); i++) {
+      trajectory->row(offset + i) = ModelStep<T, M, I>(
+        trajectory->row(offset + i - 1),
+        input_vector.row(i),
+        params);
+    }
+  }
+
+  /**
+   * @brief Rolls out K input sequences from one initial state at once
+   *
+   * The states are stored as structure-of-arrays (see Batch_t), so every
+   * step of the model is vectorized across the K sequences.
+   *
+   * @tparam M Dynamic model used (needs to provide a BatchStep)
+   * @tparam I Integration method (needs to provide an IntegrateBatch)
+   * @param initial_state Initial state (row)
+   * @param inputs Inputs of all sequences per timestep, each of size
+   * (InputSize, K)
+   * @param params Parameters, such as delta time, wheel_base etc.
+   * @return std::vector<Batch_t<M::kStateDim>> States of all sequences per
+   * timestep starting with the initial state, each of size (State, K)
+   */
+  template<class M, class I>
+  inline std::vector<Batch_t<M::kStateDim>> GenerateBatchTrajectories(
+    const Matrix_t<double>& initial_state,
+    const std::vector<Batch_t<M::kInputDim>>& inputs,
+    Parameter* params) {
+    const typename M::Params model_params = M::Compile(*params);
+    const int num_sequences = inputs.empty() ? 0 : inputs[0].cols();
+    std::vector<Batch_t<M::kStateDim>> trajectories;
+    trajectories.reserve(inputs.size() + 1);
+    trajectories.emplace_back(
+      State_t<double, M::kStateDim>(initial_state.bottomRows(1))
+        .transpose().array().replicate(1, num_sequences));
+    for (const auto& u : inputs)
+      trajectories.push_back(
+        M::template BatchStep<I>(trajectories.back(), u, model_params));
+    return trajectories;
+  }
+
+  /**
+   * @brief Generates a trajectory with the adaptive RK45 integration and
+   * samples its dense output within every control interval
+   * 
+   * @tparam M Dynamic model used (needs fixed dimensions and a Derivative)
+   * @param initial_states Initial state(s) for trajectory
+   * @param input_vector Input vector of size (N, InputSize)
+   * @param params Parameters, such as delta time, wheel_base etc.
+   * @param num_samples Samples per control interval (the last one is the
+   * state at the end of the interval)
+   * @return Matrix_t<double> Trajectory of size (N*num_samples, State)
+   * following the initial states
+   */
+  template<class M>
+  inline Matrix_t<double> GenerateDenseTrajectory(
+    const Matrix_t<double>& initial_states,
+    const Matrix_t<double>& input_vector,
+    Parameter* params,
+    int num_samples) {
+    typedef State_t<double, M::kStateDim> S;
+    const typename M::Params model_params = M::Compile(*params);
+    const double dt = model_params.dt;
+    const int num_initial = initial_states.rows();
+    Matrix_t<double> trajectory(
+      num_initial + input_vector.rows()*num_samples, initial_states.cols());
+    trajectory.topRows(num_initial) = initial_states;
+    DenseOutput<S> dense;
+    S state = initial_states.row(num_initial - 1);
+    for (int i = 0; i < input_vector.rows(); i++) {
+      const Input_t<double, M::kInputDim> u = input_vector.row(i);
+      const S next_state = IntegrationRK45::IntegrateDense(
+        state, M::template Derivative<double>(u, model_params), dt,
+        model_params.tolerances, &dense);
+      const int row = num_initial + i*num_samples;
+      for (int j = 1; j < num_samples; j++)
+        trajectory.row(row + j - 1) = dense.Evaluate(dt*j / num_samples);
+      trajectory.row(row + num_samples - 1) = next_state;
+      state = next_state;
+    }
+    return trajectory;
+  }
+
+  /**
+   * @brief Generates a trajectory and the analytic sensitivities of every
+   * state w.r.t. the whole input vector by chaining the step Jacobians
+   * 
+   * @tparam M Dynamic model used (needs to provide a StepJacobian)
+   * @tparam I Integration method (needs to provide a Linearize)
+   * @param initial_states Initial state(s) for trajectory
+   * @param input_vector Input vector of size (N, InputSize)
+   * @param params Compiled parameters of the model (see M::Compile)
+   * @param sensitivities d state_k / d input for every trajectory row; of
+   * size (State, N*InputSize) with the input (i, j) in column j*N + i
+   * @return Matrix_t<double> Trajectory of size (N, State)
+   */
+  template<class M, class I>
+  inline Matrix_t<double> GenerateDynamicTrajectoryJacobian(
+    const Matrix_t<double>& initial_states,
+    const Matrix_t<double>& input_vector,
+    const typename M::Params& params,
+    std::vector<Matrix_t<double>>* sensitivities) {
+    const int num_inputs = input_vector.rows();
+    const int num_params = input_vector.rows()*input_vector.cols();
+    const int state_size = initial_states.cols();
+    Matrix_t<double> jac_state, jac_input;
     // in case not a state space model
-    if (params->get<bool>("static", false)) {
-      Matrix_t<T> trajectory(input_vector.rows(),
-                             initial_states.cols());
-      for (int i = 0; i < input_vector.rows(); i++) {
-        trajectory.row(i) = M::template Step<T, I>(
+    if (params.is_static) {
+      Matrix_t<double> trajectory(num_inputs, state_size);
+      sensitivities->assign(num_inputs,
+                            Matrix_t<double>::Zero(state_size, num_params));
+      for (int i = 0; i < num_inputs; i++) {
+        trajectory.row(i) = M::template StepJacobian<I>(
           initial_states,
           input_vector.row(i),
-          params);
+          params,
+          &jac_state,
+          &jac_input);
+        for (int j = 0; j < input_vector.cols(); j++)
+          sensitivities->at(i).col(j*num_inputs + i) = jac_input.col(j);
       }
       return trajectory;
     }
     // normal model
-    int total_rows = input_vector.rows() + initial_states.rows();
-    Matrix_t<T> trajectory(total_rows,
-                           initial_states.cols());
+    int total_rows = num_inputs + initial_states.rows();
+    Matrix_t<double> trajectory(total_rows, state_size);
     trajectory.block(0,
                      0,
                      initial_states.rows(),
                      initial_states.cols()) = initial_states;
-    // assume its correct up to here
+    sensitivities->assign(total_rows,
+                          Matrix_t<double>::Zero(state_size, num_params));
     int count = 0;
     for (int i = initial_states.rows(); i < total_rows; i++) {
-      trajectory.row(i) = M::template Step<T, I>(
+      trajectory.row(i) = M::template StepJacobian<I>(
         trajectory.row(i-1),
         input_vector.row(count),
-        params);
+        params,
+        &jac_state,
+        &jac_input);
+      sensitivities->at(i) = jac_state*sensitivities->at(i-1);
+      for (int j = 0; j < input_vector.cols(); j++)
+        sensitivities->at(i).col(j*num_inputs + count) += jac_input.col(j);
       count++;
     }
     return trajectory;
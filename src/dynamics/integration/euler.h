@@ -8,19 +8,68 @@
 
 namespace dynamics {
 using geometry::Matrix_t;
+using geometry::State_t;
+using geometry::Batch_t;
 
 class IntegrationEuler {
  public:
   IntegrationEuler() {}
   virtual ~IntegrationEuler() {}
 
-  template<typename T>
+  /**
+   * @brief Integrates one step
+   * 
+   * @tparam F Callable returning the time derivative of a state; being a
+   * template parameter the derivative can be inlined
+   */
+  template<typename T, class F>
   static Matrix_t<T> Integrate(
     const Matrix_t<T>& state,
-    std::function<Matrix_t<T>(const Matrix_t<T>&)> fDot,
+    const F& fDot,
     const T& dt) {
     return state + dt*fDot(state);
   }
+
+  //! fixed-size version that keeps all stages on the stack
+  template<typename T, int N, class F>
+  static State_t<T, N> Integrate(
+    const State_t<T, N>& state,
+    const F& fDot,
+    const T& dt) {
+    return state + dt*fDot(state);
+  }
+
+  //! integrates a batch of states (see Batch_t) in lockstep
+  template<int N, class F>
+  static Batch_t<N> IntegrateBatch(
+    const Batch_t<N>& state,
+    const F& fDot,
+    double dt) {
+    return state + dt*fDot(state);
+  }
+
+  /**
+   * @brief Integrates one step and returns the Jacobians of the next state
+   * w.r.t. the state and the input
+   * 
+   * @param fDotJacobian Writes the model Jacobians (df/dx, df/du)
+   * @param jac_state d next_state / d state
+   * @param jac_input d next_state / d input
+   */
+  template<class F, class J>
+  static Matrix_t<double> Linearize(
+    const Matrix_t<double>& state,
+    const F& fDot,
+    const J& fDotJacobian,
+    double dt,
+    Matrix_t<double>* jac_state,
+    Matrix_t<double>* jac_input) {
+    Matrix_t<double> A, B;
+    fDotJacobian(state, &A, &B);
+    *jac_state = Matrix_t<double>::Identity(A.rows(), A.cols()) + dt*A;
+    *jac_input = dt*B;
+    return state + dt*fDot(state);
+  }
 };
 
 }  // namespace dynamics
@@ -0,0 +1,23 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+#pragma once
+#include <Eigen/Dense>
+#include "src/geometry/geometry.h"
+
+namespace dynamics {
+
+/**
+ * @brief Exact (zero-order hold) discretization; only available for
+ * linear models, which step using their discrete transition matrices
+ * instead of integrating fDot
+ *
+ */
+class IntegrationExact {
+ public:
+  IntegrationExact() {}
+  virtual ~IntegrationExact() {}
+};
+
+}  // namespace dynamics
@@ -8,16 +8,24 @@
 
 namespace dynamics {
 using geometry::Matrix_t;
+using geometry::State_t;
+using geometry::Batch_t;
 
 class IntegrationRK4 {
  public:
   IntegrationRK4() {}
   virtual ~IntegrationRK4() {}
 
-  template<typename T>
+  /**
+   * @brief Integrates one step
+   * 
+   * @tparam F Callable returning the time derivative of a state; being a
+   * template parameter the derivative can be inlined into every stage
+   */
+  template<typename T, class F>
   static Matrix_t<T> Integrate(
     const Matrix_t<T>& state,
-    std::function<Matrix_t<T>(const Matrix_t<T>&)> fDot,
+    const F& fDot,
     const T& dt) {
     Matrix_t<T> k0 = dt*fDot(state);
     Matrix_t<T> k1 = dt*fDot(state + k0/T(2.0));
@@ -25,6 +33,80 @@ class IntegrationRK4 {
     Matrix_t<T> k3 = dt*fDot(state + k2);
     return state + T(1.0/6.0)*(k0 + T(2.0)*k1 + T(2.0)*k2 + k3);
   }
+
+  //! fixed-size version that keeps all stages on the stack
+  template<typename T, int N, class F>
+  static State_t<T, N> Integrate(
+    const State_t<T, N>& state,
+    const F& fDot,
+    const T& dt) {
+    State_t<T, N> k0 = dt*fDot(state);
+    State_t<T, N> k1 = dt*fDot(state + k0/T(2.0));
+    State_t<T, N> k2 = dt*fDot(state + k1/T(2.0));
+    State_t<T, N> k3 = dt*fDot(state + k2);
+    return state + T(1.0/6.0)*(k0 + T(2.0)*k1 + T(2.0)*k2 + k3);
+  }
+
+  //! integrates a batch of states (see Batch_t) in lockstep
+  template<int N, class F>
+  static Batch_t<N> IntegrateBatch(
+    const Batch_t<N>& state,
+    const F& fDot,
+    double dt) {
+    const Batch_t<N> k0 = dt*fDot(state);
+    const Batch_t<N> k1 = dt*fDot(state + 0.5*k0);
+    const Batch_t<N> k2 = dt*fDot(state + 0.5*k1);
+    const Batch_t<N> k3 = dt*fDot(state + k2);
+    return state + (1.0/6.0)*(k0 + 2.0*k1 + 2.0*k2 + k3);
+  }
+
+  /**
+   * @brief Integrates one step and propagates the model Jacobians through
+   * the four stages
+   * 
+   * @param fDotJacobian Writes the model Jacobians (df/dx, df/du)
+   * @param jac_state d next_state / d state
+   * @param jac_input d next_state / d input
+   */
+  template<class F, class J>
+  static Matrix_t<double> Linearize(
+    const Matrix_t<double>& state,
+    const F& fDot,
+    const J& fDotJacobian,
+    double dt,
+    Matrix_t<double>* jac_state,
+    Matrix_t<double>* jac_input) {
+    Matrix_t<double> A, B;
+    Matrix_t<double> I = Matrix_t<double>::Identity(state.cols(),
+                                                    state.cols());
+    // k0
+    fDotJacobian(state, &A, &B);
+    Matrix_t<double> k0 = dt*fDot(state);
+    Matrix_t<double> k0x = dt*A;
+    Matrix_t<double> k0u = dt*B;
+    // k1
+    Matrix_t<double> s1 = state + k0/2.0;
+    fDotJacobian(s1, &A, &B);
+    Matrix_t<double> k1 = dt*fDot(s1);
+    Matrix_t<double> k1x = dt*A*(I + k0x/2.0);
+    Matrix_t<double> k1u = dt*(A*k0u/2.0 + B);
+    // k2
+    Matrix_t<double> s2 = state + k1/2.0;
+    fDotJacobian(s2, &A, &B);
+    Matrix_t<double> k2 = dt*fDot(s2);
+    Matrix_t<double> k2x = dt*A*(I + k1x/2.0);
+    Matrix_t<double> k2u = dt*(A*k1u/2.0 + B);
+    // k3
+    Matrix_t<double> s3 = state + k2;
+    fDotJacobian(s3, &A, &B);
+    Matrix_t<double> k3 = dt*fDot(s3);
+    Matrix_t<double> k3x = dt*A*(I + k2x);
+    Matrix_t<double> k3u = dt*(A*k2u + B);
+
+    *jac_state = I + (k0x + 2.0*k1x + 2.0*k2x + k3x)/6.0;
+    *jac_input = (k0u + 2.0*k1u + 2.0*k2u + k3u)/6.0;
+    return state + (1.0/6.0)*(k0 + 2.0*k1 + 2.0*k2 + k3);
+  }
 };
 
 }  // namespace dynamics
@@ -0,0 +1,227 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+#pragma once
+#include <Eigen/Dense>
+#include <vector>
+#include <array>
+#include <cmath>
+#include <algorithm>
+#include "src/geometry/geometry.h"
+
+namespace dynamics {
+using geometry::Matrix_t;
+using geometry::State_t;
+using geometry::ScalarValue;
+
+//! error tolerances of the step size control of IntegrationRK45
+struct IntegrationTolerances {
+  double abs_tol = 1e-6;
+  double rel_tol = 1e-6;
+};
+
+/**
+ * @brief Dense output of an adaptive step; stores one quartic polynomial
+ * per accepted substep
+ *
+ * @tparam S State type (e.g. Matrix_t<double> or State_t<double, 4>)
+ */
+template<class S>
+class DenseOutput {
+ public:
+  void Clear() {
+    t0_.clear();
+    h_.clear();
+    y0_.clear();
+    coefficients_.clear();
+  }
+
+  void Add(double t0,
+           double h,
+           const S& y0,
+           const std::array<S, 4>& coefficients) {
+    t0_.push_back(t0);
+    h_.push_back(h);
+    y0_.push_back(y0);
+    coefficients_.push_back(coefficients);
+  }
+
+  /**
+   * @brief State at the time t within the integrated interval
+   *
+   * @param t Time since the start of the interval
+   * @return S Interpolated state
+   */
+  S Evaluate(double t) const {
+    const int idx = std::max(
+      0,
+      static_cast<int>(std::upper_bound(t0_.begin(), t0_.end(), t) -
+                       t0_.begin()) - 1);
+    const double theta = (t - t0_[idx]) / h_[idx];
+    const std::array<S, 4>& q = coefficients_[idx];
+    // Horner scheme of y0 + q0 theta + q1 theta^2 + q2 theta^3 + q3 theta^4
+    return y0_[idx] + theta*(q[0] + theta*(q[1] + theta*(q[2] + theta*q[3])));
+  }
+
+  int NumSubsteps() const { return t0_.size(); }
+
+ private:
+  std::vector<double> t0_;
+  std::vector<double> h_;
+  std::vector<S> y0_;
+  std::vector<std::array<S, 4>> coefficients_;
+};
+
+/**
+ * @brief Adaptive Dormand-Prince RK5(4) integration
+ *
+ * Every call of Integrate substeps the interval dt until the embedded
+ * error estimate is within the tolerances, so that coarse control
+ * intervals can be used without losing accuracy. The step size control
+ * uses the values of the states only (not the derivatives of Jets). The
+ * models pass the tolerances of their compiled parameters (ModelParams).
+ */
+class IntegrationRK45 {
+ public:
+  IntegrationRK45() {}
+  virtual ~IntegrationRK45() {}
+
+  //! adaptive steps are not linearized analytically
+  static constexpr bool kHasLinearize = false;
+
+  template<typename T, class F>
+  static Matrix_t<T> Integrate(
+    const Matrix_t<T>& state,
+    const F& fDot,
+    const T& dt,
+    const IntegrationTolerances& tolerances) {
+    return IntegrateImpl<T, Matrix_t<T>>(
+      state, fDot, dt, tolerances, nullptr);
+  }
+
+  template<typename T, int N, class F>
+  static State_t<T, N> Integrate(
+    const State_t<T, N>& state,
+    const F& fDot,
+    const T& dt,
+    const IntegrationTolerances& tolerances) {
+    return IntegrateImpl<T, State_t<T, N>>(
+      state, fDot, dt, tolerances, nullptr);
+  }
+
+  /**
+   * @brief Integrates one interval and records the dense output
+   *
+   * @param dense Polynomials to evaluate the state within the interval
+   */
+  template<typename T, class S, class F>
+  static S IntegrateDense(
+    const S& state,
+    const F& fDot,
+    const T& dt,
+    const IntegrationTolerances& tolerances,
+    DenseOutput<S>* dense) {
+    dense->Clear();
+    return IntegrateImpl<T, S>(state, fDot, dt, tolerances, dense);
+  }
+
+ private:
+  template<typename T, class S, class F>
+  static S IntegrateImpl(const S& state,
+                         const F& fDot,
+                         const T& dt,
+                         const IntegrationTolerances& tolerances,
+                         DenseOutput<S>* dense) {
+    // Butcher tableau (fDot is autonomous, so the nodes c are not needed)
+    static constexpr double a21 = 1./5.;
+    static constexpr double a31 = 3./40., a32 = 9./40.;
+    static constexpr double a41 = 44./45., a42 = -56./15., a43 = 32./9.;
+    static constexpr double a51 = 19372./6561., a52 = -25360./2187.,
+                            a53 = 64448./6561., a54 = -212./729.;
+    static constexpr double a61 = 9017./3168., a62 = -355./33.,
+                            a63 = 46732./5247., a64 = 49./176.,
+                            a65 = -5103./18656.;
+    static constexpr double b1 = 35./384., b3 = 500./1113., b4 = 125./192.,
+                            b5 = -2187./6784., b6 = 11./84.;
+    // difference of the 5th and the embedded 4th order solution
+    static constexpr double e1 = 71./57600., e3 = -71./16695.,
+                            e4 = 71./1920., e5 = -17253./339200.,
+                            e6 = 22./525., e7 = -1./40.;
+    // dense output (coefficients of theta, .., theta^4 per stage)
+    static constexpr double P[7][4] = {
+      {1., -8048581381./2820520608., 8663915743./2820520608.,
+       -12715105075./11282082432.},
+      {0., 0., 0., 0.},
+      {0., 131558114200./32700410799., -68118460800./10900136933.,
+       87487479700./32700410799.},
+      {0., -1754552775./470086768., 14199869525./1410260304.,
+       -10690763975./1880347072.},
+      {0., 127303824393./49829197408., -318862633887./49829197408.,
+       701980252875./199316789632.},
+      {0., -282668133./205662961., 2019193451./616988883.,
+       -1453857185./822651844.},
+      {0., 40617522./29380423., -110615467./29380423.,
+       69997945./29380423.}};
+    static constexpr int kMaxSubsteps = 1000;
+
+    const double duration = ScalarValue(dt);
+    double t = 0.;
+    double h = duration;
+    S y = state;
+    S k1 = fDot(y);
+    for (int substep = 0; substep < kMaxSubsteps && t < duration; substep++) {
+      // the last substep ends exactly at dt; once the substeps are used up
+      // the remainder is taken as one step regardless of its error
+      const bool last = t + h >= duration*(1. - 1e-12) ||
+        substep == kMaxSubsteps - 1;
+      if (last)
+        h = duration - t;
+      const T h_t = T(h);
+      const S k2 = fDot(S(y + h_t*(a21*k1)));
+      const S k3 = fDot(S(y + h_t*(a31*k1 + a32*k2)));
+      const S k4 = fDot(S(y + h_t*(a41*k1 + a42*k2 + a43*k3)));
+      const S k5 = fDot(S(y + h_t*(a51*k1 + a52*k2 + a53*k3 + a54*k4)));
+      const S k6 = fDot(S(y + h_t*(a61*k1 + a62*k2 + a63*k3 + a64*k4 +
+                                   a65*k5)));
+      const S y_next = y + h_t*(b1*k1 + b3*k3 + b4*k4 + b5*k5 + b6*k6);
+      const S k7 = fDot(y_next);
+      const S error = h_t*(e1*k1 + e3*k3 + e4*k4 + e5*k5 + e6*k6 + e7*k7);
+
+      double error_norm = 0.;
+      for (int i = 0; i < error.size(); i++) {
+        const double scale = tolerances.abs_tol +
+          tolerances.rel_tol*std::max(std::abs(ScalarValue(y(i))),
+                                      std::abs(ScalarValue(y_next(i))));
+        const double e = ScalarValue(error(i)) / scale;
+        error_norm += e*e;
+      }
+      error_norm = std::sqrt(error_norm / std::max<int>(1, error.size()));
+
+      if (error_norm <= 1. || substep == kMaxSubsteps - 1) {
+        if (dense) {
+          const std::array<const S*, 7> k = {
+            &k1, &k2, &k3, &k4, &k5, &k6, &k7};
+          std::array<S, 4> coefficients;
+          for (int j = 0; j < 4; j++) {
+            coefficients[j] = h_t*(P[0][j]*k1);
+            for (int s = 2; s < 7; s++)
+              coefficients[j] += h_t*(P[s][j]*(*k[s]));
+          }
+          dense->Add(t, h, y, coefficients);
+        }
+        t += h;
+        y = y_next;
+        k1 = k7;  // first same as last
+        if (last)
+          break;
+      }
+      const double factor = error_norm > 0. ?
+        0.9*std::pow(error_norm, -0.2) : 5.;
+      h *= std::min(5., std::max(0.2, factor));
+    }
+    return y;
+  }
+};
+
+}  // namespace dynamics
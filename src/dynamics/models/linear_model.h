@@ -0,0 +1,119 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+#pragma once
+#include <Eigen/Dense>
+#include <cmath>
+#include <limits>
+#include "src/geometry/geometry.h"
+
+namespace dynamics {
+
+using geometry::Matrix_t;
+using geometry::State_t;
+using geometry::Input_t;
+
+/**
+ * @brief Matrix exponential using scaling and squaring of a Taylor series
+ *
+ * @param M Square matrix
+ * @return exp(M)
+ */
+template<int N>
+inline Eigen::Matrix<double, N, N> MatrixExponential(
+  const Eigen::Matrix<double, N, N>& M) {
+  const double norm = M.cwiseAbs().rowwise().sum().maxCoeff();
+  int squarings = 0;
+  if (norm > 0.5)
+    squarings = static_cast<int>(std::ceil(std::log2(norm / 0.5)));
+  const Eigen::Matrix<double, N, N> scaled = M / std::pow(2., squarings);
+  Eigen::Matrix<double, N, N> ret = Eigen::Matrix<double, N, N>::Identity();
+  Eigen::Matrix<double, N, N> term = Eigen::Matrix<double, N, N>::Identity();
+  for (int k = 1; k <= 16; k++) {
+    term = term*scaled / static_cast<double>(k);
+    ret += term;
+  }
+  for (int i = 0; i < squarings; i++)
+    ret = ret*ret;
+  return ret;
+}
+
+/**
+ * @brief Linear time-invariant model dx/dt = A x + B u
+ *
+ * The exact discrete transition x_k+1 = Ad x_k + Bd u_k (zero-order hold)
+ * is computed once per dt and cached, so that a step is NX*(NX+NU)
+ * multiply-adds on fixed-size matrices. Instances are not thread-safe,
+ * use one per thread (e.g. thread_local).
+ *
+ * @tparam NX State dimension
+ * @tparam NU Input dimension
+ */
+template<int NX, int NU>
+class LinearModel {
+ public:
+  typedef Eigen::Matrix<double, NX, NX> StateMatrix_t;
+  typedef Eigen::Matrix<double, NX, NU> InputMatrix_t;
+
+  LinearModel(const StateMatrix_t& A, const InputMatrix_t& B) :
+    A_(A), B_(B), Ad_(), Bd_(),
+    dt_(std::numeric_limits<double>::quiet_NaN()) {}
+
+  /**
+   * @brief Computes the discrete transition for dt if not cached yet
+   *
+   * @param dt Delta time
+   */
+  void Discretize(double dt) {
+    if (dt == dt_)
+      return;
+    // exp([A B; 0 0]*dt) = [Ad Bd; 0 I]
+    Eigen::Matrix<double, NX + NU, NX + NU> M =
+      Eigen::Matrix<double, NX + NU, NX + NU>::Zero();
+    M.template topLeftCorner<NX, NX>() = A_*dt;
+    M.template topRightCorner<NX, NU>() = B_*dt;
+    Eigen::Matrix<double, NX + NU, NX + NU> M_exp = MatrixExponential(M);
+    Ad_ = M_exp.template topLeftCorner<NX, NX>();
+    Bd_ = M_exp.template topRightCorner<NX, NU>();
+    dt_ = dt;
+  }
+
+  /**
+   * @brief Exact step of the model
+   *
+   * @param state State (row)
+   * @param u Input (row)
+   * @param dt Delta time
+   * @return Next state (row)
+   */
+  template<typename T>
+  State_t<T, NX> Step(const State_t<T, NX>& state,
+                      const Input_t<T, NU>& u,
+                      double dt) {
+    Discretize(dt);
+    State_t<T, NX> next_state;
+    for (int i = 0; i < NX; i++) {
+      T x_i = T(0.);
+      for (int j = 0; j < NX; j++)
+        x_i += Ad_(i, j)*state(j);
+      for (int j = 0; j < NU; j++)
+        x_i += Bd_(i, j)*u(j);
+      next_state(i) = x_i;
+    }
+    return next_state;
+  }
+
+  //! discrete transition matrices for dt
+  const StateMatrix_t& Ad(double dt) { Discretize(dt); return Ad_; }
+  const InputMatrix_t& Bd(double dt) { Discretize(dt); return Bd_; }
+
+ private:
+  StateMatrix_t A_;
+  InputMatrix_t B_;
+  StateMatrix_t Ad_;
+  InputMatrix_t Bd_;
+  double dt_;
+};
+
+}  // namespace dynamics
@@ -0,0 +1,53 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+#pragma once
+#include <type_traits>
+#include "src/commons/parameters.h"
+#include "src/dynamics/integration/rk45.h"
+
+namespace dynamics {
+
+/**
+ * @brief Parameters every model uses
+ *
+ * Models extend it with their own fields (M::Params) and resolve it once
+ * from a Parameter using M::Compile, so that stepping the model does not
+ * look up any parameter by name.
+ */
+struct ModelParams {
+  //! delta time of a step
+  double dt;
+  //! maps every input to a state instead of integrating them
+  bool is_static;
+  //! tolerances of the adaptive integration (IntegrationRK45)
+  IntegrationTolerances tolerances;
+};
+
+//! tolerances of the adaptive integration ("rk45_abs_tol", "rk45_rel_tol")
+inline IntegrationTolerances CompileTolerances(
+  const commons::Parameter& params) {
+  IntegrationTolerances tolerances;
+  tolerances.abs_tol = params.get<double>("rk45_abs_tol", 1e-6);
+  tolerances.rel_tol = params.get<double>("rk45_rel_tol", 1e-6);
+  return tolerances;
+}
+
+/**
+ * @brief One step of the integration I over the compiled dt; the adaptive
+ * integration is passed the compiled tolerances, too
+ */
+template<typename T, class I, class S, class F>
+inline S IntegrateModel(const S& state,
+                        const F& fDot,
+                        const ModelParams& params) {
+  if constexpr (std::is_same<I, IntegrationRK45>::value) {
+    return I::template Integrate<T>(state, fDot, T(params.dt),
+                                    params.tolerances);
+  } else {
+    return I::template Integrate<T>(state, fDot, T(params.dt));
+  }
+}
+
+}  // namespace dynamics
@@ -9,6 +9,7 @@
 #include "src/dynamics/dynamics.h"
 #include "src/dynamics/integration/rk4.h"
 #include "src/dynamics/integration/euler.h"
+#include "src/dynamics/models/model_params.h"
 
 namespace dynamics {
 
@@ -38,15 +39,35 @@ class RobotArm {
     ACCELERATION = -1
   };
 
+  //! typed snapshot of the model parameters
+  struct Params : ModelParams {
+    double x0;
+    double x1;
+    double l0;
+    double l1;
+  };
+
+  static Params Compile(const Parameter& params) {
+    Params compiled;
+    compiled.dt = params.get<double>("dt", 0.1);
+    compiled.is_static = params.get<bool>("static", false);
+    compiled.tolerances = CompileTolerances(params);
+    compiled.x0 = params.get<double>("x0", .0);
+    compiled.x1 = params.get<double>("x1", .0);
+    compiled.l0 = params.get<double>("l0", .5);
+    compiled.l1 = params.get<double>("l1", .5);
+    return compiled;
+  }
+
   template<typename T>
   static Matrix_t<T> fDot(const Matrix_t<T>& state,
                           const Matrix_t<T>& u,
-                          Parameter* params) {
+                          const Params& params) {
     Matrix_t<T> ret_state(1, state.cols());
-    T x0 = T(params->get<double>("x0", .0));
-    T x1 = T(params->get<double>("x1", .0));
-    T l0 = T(params->get<double>("l0", .5));
-    T l1 = T(params->get<double>("l1", .5));
+    T x0 = T(params.x0);
+    T x1 = T(params.x1);
+    T l0 = T(params.l0);
+    T l1 = T(params.l1);
     ret_state << l0*cos(u(0)) + x0 + l1*cos(u(1)),
                  l0*sin(u(0)) + x1 + l1*sin(u(1));
     return ret_state;
@@ -55,7 +76,7 @@ class RobotArm {
   template<typename T, class I>
   static Matrix_t<T> Step(const Matrix_t<T>& state,
                           const Matrix_t<T>& u,
-                          Parameter* params) {
+                          const Params& params) {
     // std::function<Matrix_t<T> (const Matrix_t<T>&)> fDot_ =
     //   std::bind(fDot<T>,
     //             std::placeholders::_1,
@@ -63,7 +84,7 @@ class RobotArm {
     //             params);
     // return I::template Integrate<T>(state,
     //                                 fDot_,
-    //                                 T(params->get<double>("dt", 0.1)));
+    //                                 T(params.dt));
     return fDot<T>(state, u, params);
   }
 
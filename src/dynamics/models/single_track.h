@@ -4,15 +4,19 @@
 // For a copy, see <https://opensource.org/licenses/MIT>.
 #pragma once
 #include <Eigen/Dense>
-#include <functional>
 #include "src/geometry/geometry.h"
 #include "src/dynamics/dynamics.h"
 #include "src/dynamics/integration/rk4.h"
 #include "src/dynamics/integration/euler.h"
+#include "src/dynamics/batch_math.h"
+#include "src/dynamics/models/model_params.h"
 
 namespace dynamics {
 
 using geometry::Matrix_t;
+using geometry::State_t;
+using geometry::Input_t;
+using geometry::Batch_t;
 using commons::ParameterPtr;
 using commons::Parameter;
 
@@ -41,11 +45,28 @@ class SingleTrackModel {
     ACCELERATION = 1
   };
 
+  static constexpr int kStateDim = 4;
+  static constexpr int kInputDim = 2;
+
+  //! typed snapshot of the model parameters
+  struct Params : ModelParams {
+    double wheel_base;
+  };
+
+  static Params Compile(const Parameter& params) {
+    Params compiled;
+    compiled.dt = params.get<double>("dt", 0.1);
+    compiled.is_static = params.get<bool>("static", false);
+    compiled.tolerances = CompileTolerances(params);
+    compiled.wheel_base = params.get<double>("wheel_base", 2.7);
+    return compiled;
+  }
+
   template<typename T>
-  static Matrix_t<T> fDot(const Matrix_t<T>& state,
-                          const Matrix_t<T>& u,
-                          const T& wheel_base) {
-    Matrix_t<T> A(1, state.cols());
+  static State_t<T, kStateDim> fDot(const State_t<T, kStateDim>& state,
+                                    const Input_t<T, kInputDim>& u,
+                                    const T& wheel_base) {
+    State_t<T, kStateDim> A;
     A << state(static_cast<int>(StateDefinition::VELOCITY)) * \
          cos(state(static_cast<int>(StateDefinition::THETA))),
          state(static_cast<int>(StateDefinition::VELOCITY)) * \
@@ -56,18 +77,128 @@ class SingleTrackModel {
     return A;
   }
 
+  //! dynamically sized fallback
+  template<typename T>
+  static Matrix_t<T> fDot(const Matrix_t<T>& state,
+                          const Matrix_t<T>& u,
+                          const T& wheel_base) {
+    return fDot<T>(State_t<T, kStateDim>(state),
+                   Input_t<T, kInputDim>(u),
+                   wheel_base);
+  }
+
+  /**
+   * @brief Jacobians of fDot w.r.t. the state (A) and the input (B)
+   */
+  static void fDotJacobian(const Matrix_t<double>& state,
+                           const Matrix_t<double>& u,
+                           double wheel_base,
+                           Matrix_t<double>* A,
+                           Matrix_t<double>* B) {
+    const int theta = static_cast<int>(StateDefinition::THETA);
+    const int vel = static_cast<int>(StateDefinition::VELOCITY);
+    const int delta = static_cast<int>(InputDefinition::STEERING_ANGLE);
+    const int acc = static_cast<int>(InputDefinition::ACCELERATION);
+    double tan_delta = tan(u(delta));
+    A->setZero(state.cols(), state.cols());
+    B->setZero(state.cols(), u.cols());
+    (*A)(static_cast<int>(StateDefinition::X), theta) =
+      -state(vel)*sin(state(theta));
+    (*A)(static_cast<int>(StateDefinition::X), vel) = cos(state(theta));
+    (*A)(static_cast<int>(StateDefinition::Y), theta) =
+      state(vel)*cos(state(theta));
+    (*A)(static_cast<int>(StateDefinition::Y), vel) = sin(state(theta));
+    (*A)(theta, vel) = tan_delta / wheel_base;
+    (*B)(theta, delta) = state(vel)*(1. + tan_delta*tan_delta) / wheel_base;
+    (*B)(vel, acc) = 1.;
+  }
+
+  //! time derivative of the state while the input u is held constant
+  template<typename T>
+  static auto Derivative(const Input_t<T, kInputDim>& u,
+                         const Params& params) {
+    const T wheel_base = T(params.wheel_base);
+    return [u, wheel_base](const State_t<T, kStateDim>& x) {
+      return fDot<T>(x, u, wheel_base);
+    };
+  }
+
+  template<typename T, class I>
+  static State_t<T, kStateDim> Step(const State_t<T, kStateDim>& state,
+                                    const Input_t<T, kInputDim>& u,
+                                    const Params& params) {
+    return IntegrateModel<T, I>(state, Derivative<T>(u, params), params);
+  }
+
+  //! dynamically sized fallback
   template<typename T, class I>
   static Matrix_t<T> Step(const Matrix_t<T>& state,
                           const Matrix_t<T>& u,
-                          Parameter* params) {
-    std::function<Matrix_t<T> (const Matrix_t<T>&)> fDot_ =
-      std::bind(fDot<T>,
-                std::placeholders::_1,
-                u,
-                T(params->get<double>("wheel_base", 2.7)));
-    return I::template Integrate<T>(state,
-                                    fDot_,
-                                    T(params->get<double>("dt", 0.1)));
+                          const Params& params) {
+    return Step<T, I>(State_t<T, kStateDim>(state),
+                      Input_t<T, kInputDim>(u),
+                      params);
+  }
+
+  /**
+   * @brief Steps K states at once; the input is held over the step, so the
+   * curvature is shared by all integration stages
+   *
+   * @param state States (one row per component, one column per state)
+   * @param u Inputs (one row per component, one column per state)
+   */
+  template<class I>
+  static Batch_t<kStateDim> BatchStep(const Batch_t<kStateDim>& state,
+                                      const Batch_t<kInputDim>& u,
+                                      const Params& params) {
+    const int x = static_cast<int>(StateDefinition::X);
+    const int y = static_cast<int>(StateDefinition::Y);
+    const int theta = static_cast<int>(StateDefinition::THETA);
+    const int vel = static_cast<int>(StateDefinition::VELOCITY);
+    const double wheel_base = params.wheel_base;
+    const int num_states = state.cols();
+    Batch_t<1> sin_theta(1, num_states), cos_theta(1, num_states);
+    BatchSinCos(u.row(static_cast<int>(InputDefinition::STEERING_ANGLE)),
+                &sin_theta,
+                &cos_theta);
+    const Batch_t<1> curvature = sin_theta / (cos_theta*wheel_base);
+    auto fDot_ = [&](const Batch_t<kStateDim>& s) {
+      Batch_t<kStateDim> s_dot(kStateDim, num_states);
+      BatchSinCos(s.row(theta), &sin_theta, &cos_theta);
+      s_dot.row(x) = s.row(vel)*cos_theta;
+      s_dot.row(y) = s.row(vel)*sin_theta;
+      s_dot.row(theta) = s.row(vel)*curvature;
+      s_dot.row(vel) = u.row(static_cast<int>(InputDefinition::ACCELERATION));
+      return s_dot;
+    };
+    return I::IntegrateBatch(state, fDot_, params.dt);
+  }
+
+  /**
+   * @brief Step that additionally returns the Jacobians of the next state
+   * w.r.t. the state and the input
+   */
+  template<class I>
+  static Matrix_t<double> StepJacobian(const Matrix_t<double>& state,
+                                       const Matrix_t<double>& u,
+                                       const Params& params,
+                                       Matrix_t<double>* jac_state,
+                                       Matrix_t<double>* jac_input) {
+    const double wheel_base = params.wheel_base;
+    auto fDot_ = [&](const Matrix_t<double>& x) {
+      return fDot<double>(x, u, wheel_base);
+    };
+    auto fDotJacobian_ = [&](const Matrix_t<double>& x,
+                             Matrix_t<double>* A,
+                             Matrix_t<double>* B) {
+      fDotJacobian(x, u, wheel_base, A, B);
+    };
+    return I::Linearize(state,
+                        fDot_,
+                        fDotJacobian_,
+                        params.dt,
+                        jac_state,
+                        jac_input);
   }
 
 };
@@ -4,15 +4,20 @@
 // For a copy, see <https://opensource.org/licenses/MIT>.
 #pragma once
 #include <Eigen/Dense>
-#include <functional>
 #include "src/geometry/geometry.h"
 #include "src/dynamics/dynamics.h"
 #include "src/dynamics/integration/rk4.h"
 #include "src/dynamics/integration/euler.h"
+#include "src/dynamics/integration/exact.h"
+#include "src/dynamics/models/linear_model.h"
+#include "src/dynamics/models/model_params.h"
 
 namespace dynamics {
 
 using geometry::Matrix_t;
+using geometry::State_t;
+using geometry::Input_t;
+using geometry::Batch_t;
 using commons::ParameterPtr;
 using commons::Parameter;
 
@@ -35,6 +40,7 @@ class TripleIntModel {
     Z = 6,
     VZ = 7,
     AZ = 8,
+    THETA = -1,
     VELOCITY = -1
   };
 
@@ -44,43 +50,183 @@ class TripleIntModel {
     AZ = 2
   };
 
+  static constexpr int kStateDim = 9;
+  static constexpr int kInputDim = 3;
+
+  //! typed snapshot of the model parameters
+  struct Params : ModelParams {};
+
+  static Params Compile(const Parameter& params) {
+    Params compiled;
+    compiled.dt = params.get<double>("dt", 0.2);
+    compiled.is_static = params.get<bool>("static", false);
+    compiled.tolerances = CompileTolerances(params);
+    return compiled;
+  }
+
+  //! every axis integrates its acceleration, the input is the jerk
+  template<typename T>
+  static State_t<T, kStateDim> fDot(const State_t<T, kStateDim>& state,
+                                    const Input_t<T, kInputDim>& u) {
+    State_t<T, kStateDim> state_dot;
+    for (int i = 0; i < 3; i++) {
+      state_dot(3*i) = state(3*i + 1);
+      state_dot(3*i + 1) = state(3*i + 2);
+      state_dot(3*i + 2) = u(i);
+    }
+    return state_dot;
+  }
+
+  //! dynamically sized fallback
   template<typename T>
   static Matrix_t<T> fDot(const Matrix_t<T>& state,
                           const Matrix_t<T>& u) {
-    Matrix_t<T> A(9, 9);
-    Matrix_t<T> B(9, 3);
-    A << T(0.), T(1.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.),
-         T(0.), T(0.), T(1.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.),
-         T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.),
-         T(0.), T(0.), T(0.), T(0.), T(1.), T(0.), T(0.), T(0.), T(0.),
-         T(0.), T(0.), T(0.), T(0.), T(0.), T(1.), T(0.), T(0.), T(0.),
-         T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.),
-         T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(1.), T(0.),
-         T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(1.),
-         T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.), T(0.);
-    B << T(0.), T(0.), T(0.),
-         T(0.), T(0.), T(0.),
-         T(1.), T(0.), T(0.),
-         T(0.), T(0.), T(0.),
-         T(0.), T(0.), T(0.),
-         T(0.), T(1.), T(0.),
-         T(0.), T(0.), T(0.),
-         T(0.), T(0.), T(0.),
-         T(0.), T(0.), T(1.);
-    return (A*state.transpose() + B*u.transpose()).transpose();
+    return fDot<T>(State_t<T, kStateDim>(state), Input_t<T, kInputDim>(u));
   }
 
+  //! time derivative of the state while the input u is held constant
+  template<typename T>
+  static auto Derivative(const Input_t<T, kInputDim>& u,
+                         const Params& params) {
+    return [u](const State_t<T, kStateDim>& x) {
+      return fDot<T>(x, u);
+    };
+  }
+
+  /**
+   * @brief Jacobians of fDot w.r.t. the state (A) and the input (B)
+   */
+  static void fDotJacobian(const Matrix_t<double>& state,
+                           const Matrix_t<double>& u,
+                           Matrix_t<double>* A,
+                           Matrix_t<double>* B) {
+    A->setZero(9, 9);
+    B->setZero(9, 3);
+    for (int i = 0; i < 3; i++) {
+      (*A)(3*i, 3*i + 1) = 1.;
+      (*A)(3*i + 1, 3*i + 2) = 1.;
+      (*B)(3*i + 2, i) = 1.;
+    }
+  }
+
+  /**
+   * @brief Model of a single axis (position, velocity and acceleration);
+   * one per thread as it caches its discretization
+   */
+  static LinearModel<3, 1>& AxisModel() {
+    static thread_local LinearModel<3, 1> axis(
+      (Eigen::Matrix3d() << 0., 1., 0.,
+                            0., 0., 1.,
+                            0., 0., 0.).finished(),
+      Eigen::Vector3d(0., 0., 1.));
+    return axis;
+  }
+
+  template<typename T, class I>
+  static State_t<T, kStateDim> Step(const State_t<T, kStateDim>& state,
+                                    const Input_t<T, kInputDim>& u,
+                                    const Params& params) {
+    if constexpr (std::is_same<I, IntegrationExact>::value) {
+      const double dt = params.dt;
+      LinearModel<3, 1>& axis = AxisModel();
+      State_t<T, kStateDim> next_state;
+      for (int i = 0; i < 3; i++) {
+        next_state.template segment<3>(3*i) = axis.template Step<T>(
+          state.template segment<3>(3*i),
+          u.template segment<1>(i),
+          dt);
+      }
+      return next_state;
+    } else {
+      return IntegrateModel<T, I>(state, Derivative<T>(u, params), params);
+    }
+  }
+
+  //! dynamically sized fallback
   template<typename T, class I>
   static Matrix_t<T> Step(const Matrix_t<T>& state,
                           const Matrix_t<T>& u,
-                          Parameter* params) {
-    std::function<Matrix_t<T> (const Matrix_t<T>&)> fDot_ =
-      std::bind(fDot<T>,
-                std::placeholders::_1,
-                u);
-    return I::template Integrate<T>(state,
-                                    fDot_,
-                                    T(params->get<double>("dt", 0.2)));
+                          const Params& params) {
+    return Step<T, I>(State_t<T, kStateDim>(state),
+                      Input_t<T, kInputDim>(u),
+                      params);
+  }
+
+  /**
+   * @brief Steps K states at once
+   *
+   * @param state States (one row per component, one column per state)
+   * @param u Inputs (one row per component, one column per state)
+   */
+  template<class I>
+  static Batch_t<kStateDim> BatchStep(const Batch_t<kStateDim>& state,
+                                      const Batch_t<kInputDim>& u,
+                                      const Params& params) {
+    const double dt = params.dt;
+    if constexpr (std::is_same<I, IntegrationExact>::value) {
+      LinearModel<3, 1>& axis = AxisModel();
+      const Eigen::Matrix3d& Ad = axis.Ad(dt);
+      const Eigen::Vector3d& Bd = axis.Bd(dt);
+      Batch_t<kStateDim> next_state(kStateDim, state.cols());
+      for (int i = 0; i < 3; i++) {
+        for (int r = 0; r < 3; r++) {
+          next_state.row(3*i + r) = Ad(r, 0)*state.row(3*i) +
+                                    Ad(r, 1)*state.row(3*i + 1) +
+                                    Ad(r, 2)*state.row(3*i + 2) +
+                                    Bd(r)*u.row(i);
+        }
+      }
+      return next_state;
+    } else {
+      auto fDot_ = [&](const Batch_t<kStateDim>& s) {
+        Batch_t<kStateDim> s_dot(kStateDim, s.cols());
+        for (int i = 0; i < 3; i++) {
+          s_dot.row(3*i) = s.row(3*i + 1);
+          s_dot.row(3*i + 1) = s.row(3*i + 2);
+          s_dot.row(3*i + 2) = u.row(i);
+        }
+        return s_dot;
+      };
+      return I::IntegrateBatch(state, fDot_, dt);
+    }
+  }
+
+  /**
+   * @brief Step that additionally returns the Jacobians of the next state
+   * w.r.t. the state and the input
+   */
+  template<class I>
+  static Matrix_t<double> StepJacobian(const Matrix_t<double>& state,
+                                       const Matrix_t<double>& u,
+                                       const Params& params,
+                                       Matrix_t<double>* jac_state,
+                                       Matrix_t<double>* jac_input) {
+    if constexpr (std::is_same<I, IntegrationExact>::value) {
+      const double dt = params.dt;
+      LinearModel<3, 1>& axis = AxisModel();
+      jac_state->setZero(kStateDim, kStateDim);
+      jac_input->setZero(kStateDim, kInputDim);
+      for (int i = 0; i < 3; i++) {
+        jac_state->block<3, 3>(3*i, 3*i) = axis.Ad(dt);
+        jac_input->block<3, 1>(3*i, i) = axis.Bd(dt);
+      }
+      return Step<double, I>(state, u, params);
+    } else {
+      auto fDot_ = [&](const Matrix_t<double>& x) {
+        return fDot<double>(x, u);
+      };
+      auto fDotJacobian_ = [&](const Matrix_t<double>& x,
+                               Matrix_t<double>* A,
+                               Matrix_t<double>* B) {
+        fDotJacobian(x, u, A, B);
+      };
+      return I::Linearize(state,
+                          fDot_,
+                          fDotJacobian_,
+                          params.dt,
+                          jac_state,
+                          jac_input);
+    }
   }
 
 };
@@ -0,0 +1,109 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <ceres/ceres.h>
+#include "src/geometry/geometry.h"
+
+namespace optimizer {
+
+using geometry::Matrix_t;
+
+/**
+ * @brief Cost function that differentiates the rollout analytically
+ * 
+ * The trajectory and its sensitivities w.r.t. the optimization vector are
+ * obtained from the model Jacobians in a single pass with doubles. Only the
+ * costs are evaluated on Jets that are seeded with these sensitivities,
+ * N columns of the Jacobian at a time.
+ * 
+ * @tparam F Functor type (e.g. SingleTrackFunctor)
+ * @tparam N Stride of the Jets
+ */
+template<class F, int N = 60>
+class AnalyticDynamicCostFunction : public ceres::CostFunction {
+ public:
+  typedef ceres::Jet<double, N> JetT;
+
+  explicit AnalyticDynamicCostFunction(F* functor) : functor_(functor) {}
+  virtual ~AnalyticDynamicCostFunction() { delete functor_; }
+
+  void AddParameterBlock(int size) {
+    mutable_parameter_block_sizes()->push_back(size);
+  }
+
+  void SetNumResiduals(int num_residuals) {
+    set_num_residuals(num_residuals);
+  }
+
+  bool Evaluate(double const* const* parameters,
+                double* residuals,
+                double** jacobians) const override {
+    if (jacobians == nullptr)
+      return (*functor_)(parameters, residuals);
+
+    auto start = functor_->Now();
+    const int opt_vec_len = functor_->GetOptVecLen();
+    const int param_count = functor_->GetParamCount();
+    const int num_params = opt_vec_len*param_count;
+    Matrix_t<double> opt_vec = functor_->template ParamsToEigen<double>(
+      parameters);
+    std::vector<Matrix_t<double>> sensitivities;
+    Matrix_t<double> trajectory = functor_->GenerateTrajectoryJacobian(
+      opt_vec, &sensitivities);
+    auto rollout_end = functor_->Now();
+
+    Matrix_t<JetT> trajectory_t(trajectory.rows(), trajectory.cols());
+    Matrix_t<JetT> opt_vec_t(opt_vec.rows(), opt_vec.cols());
+    std::vector<JetT> residuals_t(num_residuals());
+    for (int start = 0; start < num_params; start += N) {
+      const int len = std::min(N, num_params - start);
+      // seed the trajectory with the analytic sensitivities
+      for (int i = 0; i < trajectory.rows(); i++) {
+        for (int j = 0; j < trajectory.cols(); j++) {
+          trajectory_t(i, j) = JetT(trajectory(i, j));
+          trajectory_t(i, j).v.head(len) =
+            sensitivities[i].row(j).segment(start, len).transpose();
+        }
+      }
+      for (int i = 0; i < opt_vec.rows(); i++) {
+        for (int j = 0; j < opt_vec.cols(); j++) {
+          const int idx = j*opt_vec_len + i;
+          opt_vec_t(i, j) = JetT(opt_vec(i, j));
+          if (idx >= start && idx < start + len)
+            opt_vec_t(i, j).v[idx - start] = 1.;
+        }
+      }
+      if (!functor_->template EvaluateCosts<JetT>(trajectory_t,
+                                                  opt_vec_t,
+                                                  residuals_t.data()))
+        return false;
+      for (int k = 0; k < len; k++) {
+        const int block = (start + k) / opt_vec_len;
+        const int idx = (start + k) % opt_vec_len;
+        if (jacobians[block] == nullptr)
+          continue;
+        for (int r = 0; r < num_residuals(); r++)
+          jacobians[block][r*opt_vec_len + idx] = residuals_t[r].v[k];
+      }
+    }
+    if (residuals != nullptr) {
+      for (int r = 0; r < num_residuals(); r++)
+        residuals[r] = residuals_t[r].a;
+    }
+    functor_->AddEvaluationTime(start,
+                                rollout_end,
+                                functor_->Now());
+    return true;
+  }
+
+ private:
+  F* functor_;
+};
+
+}  // namespace optimizer
@@ -6,6 +6,8 @@
 
 #pragma once
 #include <vector>
+#include <chrono>
+#include <stdexcept>
 #include "src/geometry/geometry.h"
 #include "src/commons/parameters.h"
 #include "src/functors/costs/base_cost.h"
@@ -22,21 +24,39 @@ using commons::ParameterPtr;
  */
 class BaseFunctor {
  public:
-  BaseFunctor() : opt_vec_len_(0), param_count_(0) {}
+  BaseFunctor() :
+    opt_vec_len_(0), param_count_(0), analytic_jacobians_(false),
+    record_times_(false), rollout_time_(0.), cost_time_(0.),
+    num_evaluations_(0), rollout_cache_hits_(0), rollout_cache_misses_(0) {}
   explicit BaseFunctor(const ParameterPtr& params) :
-    params_(params), opt_vec_len_(0), param_count_(0) {}
+    params_(params), opt_vec_len_(0), param_count_(0),
+    analytic_jacobians_(
+      params ? params->get<bool>("analytic_jacobians", false) : false),
+    record_times_(false), rollout_time_(0.), cost_time_(0.),
+    num_evaluations_(0), rollout_cache_hits_(0), rollout_cache_misses_(0) {}
   virtual ~BaseFunctor() = default;
 
+  //! functors that can be differentiated analytically override this
+  static constexpr bool kHasAnalyticJacobians = false;
+
   template<typename T>
   Matrix_t<T> ParamsToEigen(T const* const* parameters) {
     Matrix_t<T> eigen_params(this->GetOptVecLen(),
                              this->GetParamCount());
+    ParamsToEigen<T>(parameters, eigen_params);
+    return eigen_params;
+  }
+
+  //! writes the parameters into existing memory of size (OptVecLen,
+  //  ParamCount), e.g. of a commons::Arena
+  template<typename T>
+  void ParamsToEigen(T const* const* parameters,
+                     Eigen::Ref<Matrix_t<T>> eigen_params) {
     for (int j = 0; j < this->GetParamCount(); j++) {
       for (int i = 0; i < this->GetOptVecLen(); i++) {
         eigen_params(i, j) = parameters[j][i];
       }
     }
-    return eigen_params;
   }
 
   /**
@@ -44,12 +64,74 @@ class BaseFunctor {
    * 
    * @param cost BaseCostPtr to cost term
    */
-  void AddCost(const BaseCostPtr& cost) {
+  virtual void AddCost(const BaseCostPtr& cost) {
     costs_.push_back(cost);
   }
 
   std::vector<BaseCostPtr>& GetSquaredObjectCosts() { return costs_; }
 
+  /**
+   * @brief Resolves the parameters of the functor and its costs once; the
+   * evaluation does not look up parameters afterwards. Called by the
+   * Optimizer when the functor is added.
+   *
+   * Also freezes the residual layout (see CheckLayout): ceres sizes the
+   * residual block once, so e.g. objects added to a cost later need a new
+   * residual block.
+   */
+  virtual void Compile() {
+    for (auto& cost : costs_)
+      cost->Compile(this->GetTrajectoryLen());
+    FreezeLayout();
+  }
+
+  //! registers the current amount of residuals of every cost
+  void FreezeLayout() {
+    layout_.clear();
+    for (const auto& cost : costs_)
+      layout_.push_back(CostResiduals(cost));
+    layout_frozen_ = true;
+  }
+
+  //! throws if the costs no longer match the frozen layout
+  void CheckLayout() const {
+    if (!layout_frozen_)
+      return;
+    bool changed = layout_.size() != costs_.size();
+    for (size_t i = 0; i < costs_.size() && !changed; i++)
+      changed = CostResiduals(costs_[i]) != layout_[i];
+    if (changed)
+      throw std::logic_error(
+        "The amount of residuals of a cost changed after its functor was "
+        "compiled (e.g. by AddObjectOutline or SetReference); add the "
+        "functor to a new Optimizer.");
+  }
+
+  //! replaces the initial states (e.g. for a receding horizon)
+  virtual void SetInitialStates(const Matrix_t<double>& initial_states) {}
+
+  //! rows of the trajectory the costs are evaluated on
+  virtual int GetTrajectoryLen() const { return opt_vec_len_; }
+
+  /**
+   * @brief Total amount of residuals of all cost terms
+   * 
+   * @return int Number of residuals
+   */
+  int NumResiduals() const {
+    int num_residuals = 0;
+    for (const auto& cost : costs_)
+      num_residuals += CostResiduals(cost);
+    return num_residuals;
+  }
+
+  //! amount of residuals of one cost of the functor
+  virtual int CostResiduals(const BaseCostPtr& cost) const {
+    return cost->NumResiduals(this->GetTrajectoryLen(),
+                              this->GetOptVecLen(),
+                              this->GetParamCount());
+  }
+
   //! Optimization length is the row length of the optimization vector
   int GetOptVecLen() const { return opt_vec_len_; }
   void SetOptVecLen(int len) { opt_vec_len_ = len; }
@@ -59,10 +141,57 @@ class BaseFunctor {
   int GetParamCount() const { return param_count_; }
   void SetParamCount(int len) { param_count_ = len; }
 
+  //! Whether the rollout is differentiated analytically using the model
+  //  Jacobians instead of automatic differentiation
+  bool GetAnalyticJacobians() const { return analytic_jacobians_; }
+  void SetAnalyticJacobians(bool analytic) { analytic_jacobians_ = analytic; }
+
+  //! Whether the evaluations are timed (set by the Optimizer when the
+  //  iterations are recorded); otherwise the clock is not read at all
+  bool GetRecordTimes() const { return record_times_; }
+  void SetRecordTimes(bool record) { record_times_ = record; }
+
+  //! accumulated time spent in the rollout and in the costs [s]
+  double GetRolloutTime() const { return rollout_time_; }
+  double GetCostTime() const { return cost_time_; }
+  int GetNumEvaluations() const { return num_evaluations_; }
+
+  //! double evaluations that reused a cached trajectory prefix (hits) or
+  //  had to roll out from the initial states (misses)
+  int GetRolloutCacheHits() const { return rollout_cache_hits_; }
+  int GetRolloutCacheMisses() const { return rollout_cache_misses_; }
+
+  //! timestamp of an evaluation; empty unless the times are recorded
+  std::chrono::steady_clock::time_point Now() const {
+    return record_times_ ? std::chrono::steady_clock::now() :
+                           std::chrono::steady_clock::time_point();
+  }
+
+  //! called by the functors with the timestamps (see Now) of an evaluation
+  void AddEvaluationTime(
+    const std::chrono::steady_clock::time_point& start,
+    const std::chrono::steady_clock::time_point& rollout_end,
+    const std::chrono::steady_clock::time_point& end) {
+    rollout_time_ +=
+      std::chrono::duration<double>(rollout_end - start).count();
+    cost_time_ += std::chrono::duration<double>(end - rollout_end).count();
+    num_evaluations_++;
+  }
+
   ParameterPtr params_;
   std::vector<BaseCostPtr> costs_;
   int opt_vec_len_;
   int param_count_;
+  bool analytic_jacobians_;
+  bool record_times_;
+  double rollout_time_;
+  double cost_time_;
+  int num_evaluations_;
+  int rollout_cache_hits_;
+  int rollout_cache_misses_;
+  //! residuals per cost when compiled (see FreezeLayout)
+  std::vector<int> layout_;
+  bool layout_frozen_ = false;
 };
 
 typedef std::shared_ptr<BaseFunctor> BaseFunctorPtr;
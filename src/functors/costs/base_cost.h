@@ -6,12 +6,14 @@
 
 #pragma once
 #include <memory>
+#include <cmath>
 #include "src/geometry/geometry.h"
 #include "src/commons/parameters.h"
 
 namespace optimizer {
 
 using geometry::Matrix_t;
+using geometry::MatrixRef_t;
 using commons::Parameter;
 using commons::ParameterPtr;
 
@@ -24,14 +26,52 @@ class BaseCost {
   virtual ~BaseCost() = default;
 
   template<typename T>
-  T Evaluate(const Matrix_t<T>& trajectory,
-             const Matrix_t<T>& inputs) const { return T(0.); }
+  T Evaluate(const MatrixRef_t<T>& trajectory,
+             const MatrixRef_t<T>& inputs) const { return T(0.); }
+
+  /**
+   * @brief Amount of residuals the cost writes in Residuals(..)
+   * 
+   * @param trajectory_rows Rows of the generated trajectory
+   * @param input_rows Rows of the optimization vector
+   * @param input_cols Columns of the optimization vector
+   * @return int Number of residuals
+   */
+  virtual int NumResiduals(int trajectory_rows,
+                           int input_rows,
+                           int input_cols) const { return 0; }
+
+  /**
+   * @brief Consecutive trajectory rows one row of residuals depends on
+   * (e.g. four for the jerk); used to split the costs into stages
+   * 
+   * Residuals(..) additionally receives the row_offset of the first passed
+   * trajectory row within the whole trajectory.
+   */
+  virtual int StageWindow() const { return 1; }
+
+  /**
+   * @brief Resolves the parameters the evaluation depends on (e.g. dt), so
+   * that Residuals(..) does not look them up; called again by the
+   * Optimizer when the functor of the cost is added
+   * 
+   * @param num_timesteps Trajectory rows the cost will be evaluated on
+   * (e.g. to precompute time dependent data); zero if unknown
+   */
+  virtual void Compile(int num_timesteps) {}
 
   template<typename T>
   T Weight() const {
     return T(weight_);
   }
 
+  //! residuals are scaled by sqrt(weight) so that their squared sum
+  //  equals the weighted cost
+  template<typename T>
+  T SqrtWeight() const {
+    return T(std::sqrt(weight_));
+  }
+
   ParameterPtr params_;
   double weight_;
 };
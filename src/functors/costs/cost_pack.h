@@ -0,0 +1,207 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+#include <memory>
+#include <variant>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <typeinfo>
+#include <stdexcept>
+#include "src/geometry/geometry.h"
+#include "src/functors/costs/base_cost.h"
+#include "src/functors/costs/jerk.h"
+#include "src/functors/costs/distance.h"
+#include "src/functors/costs/reference.h"
+#include "src/functors/costs/static_object.h"
+#include "src/functors/costs/sdf_object.h"
+#include "src/functors/costs/speed.h"
+#include "src/functors/costs/inputs.h"
+
+namespace optimizer {
+
+using geometry::Matrix_t;
+
+/**
+ * @brief Row kernel of costs that only implement Residuals(..); evaluates
+ * all rows when called for the first one
+ */
+template<class C, typename T, class M>
+class WholeCostKernel {
+ public:
+  WholeCostKernel(const C& cost,
+                  const MatrixRef_t<T>& trajectory,
+                  const MatrixRef_t<T>& inputs,
+                  int row_offset) :
+    cost_(cost), trajectory_(trajectory), inputs_(inputs),
+    row_offset_(row_offset) {}
+
+  void operator()(int i, T* residuals) const {
+    if (i == 0)
+      cost_.template Residuals<T, M>(trajectory_,
+                                     inputs_,
+                                     residuals,
+                                     row_offset_);
+  }
+
+ private:
+  const C& cost_;
+  const MatrixRef_t<T>& trajectory_;
+  const MatrixRef_t<T>& inputs_;
+  int row_offset_;
+};
+
+//! C::RowKernel<T, M> if the cost evaluates single rows; a kernel
+//  inherited from a base cost (RowKernel::Cost is not C) is not used, as
+//  C may evaluate its residuals differently
+template<class C, typename T, class M, class = void>
+struct RowKernelOf {
+  typedef WholeCostKernel<C, T, M> type;
+};
+
+template<class C, typename T, class M>
+struct RowKernelOf<C, T, M,
+                   std::enable_if_t<std::is_same<
+                     typename C::template RowKernel<T, M>::Cost, C>::value>> {
+  typedef typename C::template RowKernel<T, M> type;
+};
+
+template<class C, typename T, class M>
+using RowKernel_t = typename RowKernelOf<C, T, M>::type;
+
+/**
+ * @brief Cost types a functor can evaluate
+ *
+ * The concrete type of a cost is resolved once when it is added to a
+ * functor; the evaluation then dispatches through a std::variant, so the
+ * templated Residuals<T, M>(..) of every cost can be inlined.
+ *
+ * New cost types are added by extending the pack, e.g.
+ * DynamicFunctor<M, I, DefaultCostPack::Extend<MyCost>>. A cost type needs
+ *
+ *   template<typename T, class M>
+ *   void Residuals(const MatrixRef_t<T>& trajectory,
+ *                  const MatrixRef_t<T>& inputs,
+ *                  T* residuals,
+ *                  int row_offset = 0) const;
+ *
+ * (other parameter types, e.g. const Matrix_t<T>&, compile as well but
+ * copy the trajectory on every evaluation) and may provide a RowKernel.
+ *
+ * @tparam Costs Cost types (derived from BaseCost); a cost is resolved to
+ * its exact type or else to the first type it can be cast to, so that a
+ * cost derived from another cost of the pack keeps its own Residuals
+ */
+template<class... Costs>
+class CostPack {
+ public:
+  typedef std::variant<std::shared_ptr<Costs>...> CostVariant;
+
+  //! the extra types come first, as they may derive from the costs
+  template<class... Extra>
+  using Extend = CostPack<Extra..., Costs...>;
+
+  //! row kernel of any cost of the pack for one evaluation
+  template<typename T, class M>
+  using RowKernelVariant = std::variant<RowKernel_t<Costs, T, M>...>;
+
+  /**
+   * @brief Resolves the concrete type of a cost
+   *
+   * @param cost Cost term
+   * @return CostVariant Cost with its type
+   * @throws std::invalid_argument if the cost is not part of the pack
+   */
+  static CostVariant Resolve(const BaseCostPtr& cost) {
+    CostVariant resolved;
+    if (ResolveExact<Costs...>(cost, &resolved))
+      return resolved;
+    return ResolveAs<Costs...>(cost);
+  }
+
+  //! the cost as its base (e.g. for NumResiduals)
+  static const BaseCost* AsBase(const CostVariant& cost) {
+    return std::visit(
+      [](const auto& c) -> const BaseCost* { return c.get(); }, cost);
+  }
+
+  /**
+   * @brief Evaluates the residuals of a single cost on a trajectory
+   *
+   * @tparam T Type of data
+   * @tparam M Used model (for the state definitions)
+   * @param cost Cost term
+   * @param trajectory Trajectory (or a part of it)
+   * @param inputs Inputs belonging to the trajectory
+   * @param residuals Residuals that will be optimized
+   * @param row_offset Row of the first passed trajectory row
+   */
+  template<typename T, class M>
+  static void Residuals(const CostVariant& cost,
+                        const MatrixRef_t<T>& trajectory,
+                        const MatrixRef_t<T>& inputs,
+                        T* residuals,
+                        int row_offset = 0) {
+    std::visit([&](const auto& c) {
+      c->template Residuals<T, M>(trajectory, inputs, residuals, row_offset);
+    }, cost);
+  }
+
+  /**
+   * @brief Row kernel of a cost; it references the trajectory and the
+   * inputs, which need to outlive it
+   */
+  template<typename T, class M>
+  static RowKernelVariant<T, M> MakeRowKernel(const CostVariant& cost,
+                                              const MatrixRef_t<T>& trajectory,
+                                              const MatrixRef_t<T>& inputs,
+                                              int row_offset = 0) {
+    return std::visit([&](const auto& c) {
+      typedef typename std::decay_t<decltype(c)>::element_type C;
+      return RowKernelVariant<T, M>(std::in_place_type<RowKernel_t<C, T, M>>,
+                                    *c,
+                                    trajectory,
+                                    inputs,
+                                    row_offset);
+    }, cost);
+  }
+
+ private:
+  template<class C, class... Rest>
+  static bool ResolveExact(const BaseCostPtr& cost, CostVariant* resolved) {
+    if (cost && typeid(*cost) == typeid(C)) {
+      *resolved = CostVariant(std::in_place_type<std::shared_ptr<C>>,
+                              std::static_pointer_cast<C>(cost));
+      return true;
+    }
+    if constexpr (sizeof...(Rest) > 0)
+      return ResolveExact<Rest...>(cost, resolved);
+    return false;
+  }
+
+  template<class C, class... Rest>
+  static CostVariant ResolveAs(const BaseCostPtr& cost) {
+    if (std::shared_ptr<C> c = std::dynamic_pointer_cast<C>(cost))
+      return CostVariant(std::in_place_type<std::shared_ptr<C>>, c);
+    if constexpr (sizeof...(Rest) > 0) {
+      return ResolveAs<Rest...>(cost);
+    } else {
+      throw std::invalid_argument(
+        "The cost type is not part of the functor's CostPack.");
+    }
+  }
+};
+
+//! costs of this library
+typedef CostPack<JerkCost,
+                 ReferenceLineCost,
+                 InputCost,
+                 ReferenceCost,
+                 SpeedCost,
+                 StaticObjectCost,
+                 SdfObjectCost> DefaultCostPack;
+
+}  // namespace optimizer
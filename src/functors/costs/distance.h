@@ -15,8 +15,7 @@
 namespace optimizer {
 
 using geometry::Matrix_t;
-using geometry::BaseGeometry;
-using geometry::Line;
+using geometry::ReferencePath;
 using commons::ParameterPtr;
 using commons::Parameter;
 using commons::CalculateSquaredDistance;
@@ -32,19 +31,76 @@ class ReferenceLineCost : public BaseCost {
   virtual ~ReferenceLineCost() {}
 
   template<typename T, class M>
-  T Evaluate(const Matrix_t<T>& trajectory,
-             const Matrix_t<T>& inputs,
+  T Evaluate(const MatrixRef_t<T>& trajectory,
+             const MatrixRef_t<T>& inputs,
              T dist = T(0.)) const {
-    Line<T, 2> ref_line(reference_line_.cast<T>());
-    dist = CalculateSquaredDistance<T, M>(ref_line, trajectory);
+    dist = CalculateSquaredDistance<T, M>(reference_path_, trajectory);
     return Weight<T>() * dist;
   }
 
+  int NumResiduals(int trajectory_rows,
+                   int input_rows,
+                   int input_cols) const override {
+    return trajectory_rows;
+  }
+
+  template<typename T, class M>
+  void Residuals(const MatrixRef_t<T>& trajectory,
+                 const MatrixRef_t<T>& inputs,
+                 T* residuals,
+                 int row_offset = 0) const {
+    commons::CalculateDistanceResiduals<T, M>(reference_path_,
+                                              trajectory,
+                                              residuals);
+    for (int i = 0; i < trajectory.rows(); i++)
+      residuals[i] *= SqrtWeight<T>();
+  }
+
+  //! residuals of a single trajectory row (see EvaluateCostResidualsFused)
+  template<typename T, class M>
+  class RowKernel {
+   public:
+    typedef ReferenceLineCost Cost;
+
+    RowKernel(const ReferenceLineCost& cost,
+              const MatrixRef_t<T>& trajectory,
+              const MatrixRef_t<T>& inputs,
+              int row_offset) :
+      path_(cost.reference_path_),
+      trajectory_(trajectory),
+      sqrt_weight_(cost.SqrtWeight<T>()) {}
+
+    //! the rows are called in order, so that they are projected like by
+    //  commons::ProjectTrajectory
+    void operator()(int i, T* residuals) const {
+      if (i >= trajectory_.rows())
+        return;
+      const int segment = commons::AdvanceTrajectory<T, M>(path_,
+                                                           trajectory_,
+                                                           i,
+                                                           &cursor_);
+      residuals[i] = commons::CalculateDistanceResidual<T, M>(path_,
+                                                              trajectory_,
+                                                              i,
+                                                              segment);
+      residuals[i] *= sqrt_weight_;
+    }
+
+   private:
+    const ReferencePath& path_;
+    const MatrixRef_t<T>& trajectory_;
+    mutable ReferencePath::Cursor cursor_;
+    T sqrt_weight_;
+  };
+
+  //! builds the reference path once; the line needs at least one point
   void SetReferenceLine(const Matrix_t<double>& ref_line) {
     reference_line_ = ref_line;
+    reference_path_ = ReferencePath(ref_line);
   }
 
   Matrix_t<double> reference_line_;
+  ReferencePath reference_path_;
 };
 
 typedef std::shared_ptr<ReferenceLineCost> ReferenceLineCostPtr;
@@ -30,8 +30,8 @@ class InputCost : public BaseCost {
   virtual ~InputCost() {}
 
   template<typename T, class M>
-  T Evaluate(const Matrix_t<T>& trajectory,
-             const Matrix_t<T>& inputs,
+  T Evaluate(const MatrixRef_t<T>& trajectory,
+             const MatrixRef_t<T>& inputs,
              T cost = T(0.)) const {
     for (int i = 0; i < inputs.cols(); i++) {
       // check if within bounds
@@ -45,6 +45,66 @@ class InputCost : public BaseCost {
     return Weight<T>() * cost;
   }
 
+  int NumResiduals(int trajectory_rows,
+                   int input_rows,
+                   int input_cols) const override {
+    return input_rows*input_cols;
+  }
+
+  //! one residual per input and component; non-zero only if the input
+  //  violates its bounds
+  template<typename T, class M>
+  void Residuals(const MatrixRef_t<T>& trajectory,
+                 const MatrixRef_t<T>& inputs,
+                 T* residuals,
+                 int row_offset = 0) const {
+    int count = 0;
+    for (int i = 0; i < inputs.cols(); i++) {
+      for (int j = 0; j < inputs.rows(); j++) {
+        residuals[count++] = Residual(inputs, j, i, SqrtWeight<T>());
+      }
+    }
+  }
+
+  //! residuals of a single input row (see EvaluateCostResidualsFused)
+  template<typename T, class M>
+  class RowKernel {
+   public:
+    typedef InputCost Cost;
+
+    RowKernel(const InputCost& cost,
+              const MatrixRef_t<T>& trajectory,
+              const MatrixRef_t<T>& inputs,
+              int row_offset) :
+      cost_(cost), inputs_(inputs), sqrt_weight_(cost.SqrtWeight<T>()) {}
+
+    void operator()(int j, T* residuals) const {
+      if (j >= inputs_.rows())
+        return;
+      for (int i = 0; i < inputs_.cols(); i++)
+        residuals[i*inputs_.rows() + j] =
+          cost_.Residual(inputs_, j, i, sqrt_weight_);
+    }
+
+   private:
+    const InputCost& cost_;
+    const MatrixRef_t<T>& inputs_;
+    T sqrt_weight_;
+  };
+
+  template<typename T>
+  T Residual(const MatrixRef_t<T>& inputs,
+             int j,
+             int i,
+             const T& sqrt_weight) const {
+    T res = T(0.);
+    if (inputs(j, i) < lower_bounds_(0, i))
+      res = inputs(j, i) - lower_bounds_(0, i);
+    if (inputs(j, i) > upper_bounds_(0, i))
+      res = inputs(j, i) - upper_bounds_(0, i);
+    return sqrt_weight*res;
+  }
+
   void SetLowerBound(const Matrix_t<double>& lb) {
     lower_bounds_ = lb;
   }
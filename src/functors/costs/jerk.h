@@ -23,23 +23,81 @@ using commons::ParameterPtr;
 
 class JerkCost : public BaseCost {
  public:
-  JerkCost() : BaseCost() {}
+  JerkCost() : BaseCost(), dt_(0.2) {}
   explicit JerkCost(const ParameterPtr& params,
                     double cost = 10.) :
     BaseCost(params) {
       weight_ = params_->set<double>("weight_jerk", cost);
+      Compile(0);
   }
   virtual ~JerkCost() {}
 
   template<typename T, class M>
-  T Evaluate(const Matrix_t<T>& trajectory,
-             const Matrix_t<T>& inputs) const {
-    T jerk = CalculateSquaredJerk<T, M>(
-      trajectory,
-      T(params_->get<double>("dt", 0.2)));
+  T Evaluate(const MatrixRef_t<T>& trajectory,
+             const MatrixRef_t<T>& inputs) const {
+    T jerk = CalculateSquaredJerk<T, M>(trajectory, T(dt_));
     return Weight<T>() * jerk;
   }
 
+  int NumResiduals(int trajectory_rows,
+                   int input_rows,
+                   int input_cols) const override {
+    return trajectory_rows > 3 ? 3*(trajectory_rows - 3) : 0;
+  }
+
+  int StageWindow() const override { return 4; }
+
+  void Compile(int num_timesteps) override {
+    dt_ = params_->get<double>("dt", 0.2);
+  }
+
+  template<typename T, class M>
+  void Residuals(const MatrixRef_t<T>& trajectory,
+                 const MatrixRef_t<T>& inputs,
+                 T* residuals,
+                 int row_offset = 0) const {
+    commons::CalculateJerkResiduals<T, M>(trajectory, T(dt_), residuals);
+    int n = NumResiduals(trajectory.rows(), inputs.rows(), inputs.cols());
+    for (int i = 0; i < n; i++)
+      residuals[i] *= SqrtWeight<T>();
+  }
+
+  //! residuals of a single trajectory row (see EvaluateCostResidualsFused)
+  template<typename T, class M>
+  class RowKernel {
+   public:
+    typedef JerkCost Cost;
+
+    RowKernel(const JerkCost& cost,
+              const MatrixRef_t<T>& trajectory,
+              const MatrixRef_t<T>& inputs,
+              int row_offset) :
+      trajectory_(trajectory),
+      sqrt_weight_(cost.SqrtWeight<T>()) {
+      const T dt = T(cost.dt_);
+      dt_cubed_ = dt*dt*dt;
+    }
+
+    void operator()(int i, T* residuals) const {
+      if (i < 3 || i >= trajectory_.rows())
+        return;
+      T* row_residuals = residuals + 3*(i - 3);
+      commons::CalculateJerkResidualsRow<T, M>(trajectory_,
+                                               i,
+                                               dt_cubed_,
+                                               row_residuals);
+      for (int j = 0; j < 3; j++)
+        row_residuals[j] *= sqrt_weight_;
+    }
+
+   private:
+    const MatrixRef_t<T>& trajectory_;
+    T sqrt_weight_;
+    T dt_cubed_;
+  };
+
+ private:
+  double dt_;
 };
 
 typedef std::shared_ptr<JerkCost> JerkCostPtr;
@@ -7,6 +7,7 @@
 #include <vector>
 #include <functional>
 #include <memory>
+#include <algorithm>
 #include "src/geometry/geometry.h"
 #include "src/commons/parameters.h"
 #include "src/commons/commons.h"
@@ -15,8 +16,6 @@
 namespace optimizer {
 
 using geometry::Matrix_t;
-using geometry::BaseGeometry;
-using geometry::Line;
 using commons::ParameterPtr;
 using commons::Parameter;
 using commons::CalculateSquaredDistance;
@@ -32,13 +31,83 @@ class ReferenceCost : public BaseCost {
   virtual ~ReferenceCost() {}
 
   template<typename T, class M>
-  T Evaluate(const Matrix_t<T>& trajectory,
-             const Matrix_t<T>& inputs,
+  T Evaluate(const MatrixRef_t<T>& trajectory,
+             const MatrixRef_t<T>& inputs,
              T dist = T(0.)) const {
     dist = CalculateSquaredDistance<T, M>(reference_.cast<T>(), trajectory);
     return Weight<T>() * dist;
   }
 
+  int NumResiduals(int trajectory_rows,
+                   int input_rows,
+                   int input_cols) const override {
+    return std::min(trajectory_rows, static_cast<int>(reference_.rows()));
+  }
+
+  template<typename T, class M>
+  void Residuals(const MatrixRef_t<T>& trajectory,
+                 const MatrixRef_t<T>& inputs,
+                 T* residuals,
+                 int row_offset = 0) const {
+    int n = NumResiduals(trajectory.rows(), inputs.rows(), inputs.cols());
+    int available = std::max(
+      0, std::min(n, static_cast<int>(reference_.rows()) - row_offset));
+    commons::Arena& arena = commons::Arena::ThreadLocal();
+    commons::Arena::Scope scope(&arena);
+    geometry::MatrixMap_t<T> reference =
+      arena.Matrix<T>(available, reference_.cols());
+    reference = reference_.middleRows(row_offset, available).template cast<T>();
+    commons::CalculateDistanceResiduals<T, M>(reference,
+                                              trajectory,
+                                              residuals);
+    for (int i = 0; i < n; i++)
+      residuals[i] = i < available ? SqrtWeight<T>()*residuals[i] : T(0.);
+  }
+
+  //! residuals of a single trajectory row (see EvaluateCostResidualsFused)
+  template<typename T, class M>
+  class RowKernel {
+   public:
+    typedef ReferenceCost Cost;
+
+    RowKernel(const ReferenceCost& cost,
+              const MatrixRef_t<T>& trajectory,
+              const MatrixRef_t<T>& inputs,
+              int row_offset) :
+      cost_(cost),
+      trajectory_(trajectory),
+      row_offset_(row_offset),
+      num_residuals_(cost.NumResiduals(trajectory.rows(),
+                                       inputs.rows(),
+                                       inputs.cols())),
+      sqrt_weight_(cost.SqrtWeight<T>()) {}
+
+    void operator()(int i, T* residuals) const {
+      if (i >= num_residuals_)
+        return;
+      const Matrix_t<double>& reference = cost_.reference_;
+      if (row_offset_ + i >= reference.rows()) {
+        residuals[i] = T(0.);
+        return;
+      }
+      T loc = T(0.);
+      for (int j = 0; j < reference.cols(); j++) {
+        const T diff = T(reference(row_offset_ + i, j)) - trajectory_(i, j);
+        loc += diff*diff;
+      }
+      residuals[i] = sqrt_weight_*loc;
+    }
+
+   private:
+    const ReferenceCost& cost_;
+    const MatrixRef_t<T>& trajectory_;
+    int row_offset_;
+    int num_residuals_;
+    T sqrt_weight_;
+  };
+
+  //! the rows of the reference are the residual rows; a reference of
+  //  another length needs to be set before the functor is compiled
   void SetReference(const Matrix_t<double>& ref) {
     reference_ = ref;
   }
@@ -0,0 +1,160 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "src/geometry/geometry.h"
+#include "src/commons/parameters.h"
+#include "src/commons/commons.h"
+#include "src/dynamics/dynamics.h"
+
+namespace optimizer {
+
+using geometry::Matrix_t;
+using geometry::SignedDistanceField;
+using commons::ParameterPtr;
+using commons::Parameter;
+using commons::ObjectOutline;
+
+/**
+ * @brief Object cost for static environments: the objects are rasterized
+ * into a signed distance field once, so that every timestep costs a single
+ * interpolation instead of one polygon distance per object
+ *
+ * Uses the hinge of the StaticObjectCost (epsilon - distance) with one
+ * residual per timestep; as the distance is signed, it keeps increasing
+ * within the objects. Only the outlines at the time zero are rasterized.
+ * The grid is configured by the parameters "sdf_resolution" and
+ * "sdf_extent" ([min_x, min_y, max_x, max_y]; defaults to the bounds of
+ * the objects) and built by Compile(..).
+ */
+class SdfObjectCost : public BaseCost {
+ public:
+  SdfObjectCost() : BaseCost(), epsilon_(2.0) {}
+  explicit SdfObjectCost(const ParameterPtr& params,
+                         double eps = 2.0,
+                         double cost = 200.) :
+    BaseCost(params) {
+      weight_ = params_->set<double>("weight_object", cost);
+      epsilon_ = params_->set<double>("epsilon", eps);
+      Compile(0);
+  }
+  virtual ~SdfObjectCost() {}
+
+  template<typename T, class M>
+  T Evaluate(const MatrixRef_t<T>& trajectory,
+             const MatrixRef_t<T>& inputs,
+             T cost = T(0.)) const {
+    for (int i = 0; i < trajectory.rows(); i++) {
+      const T residual = Hinge<T, M>(trajectory, i);
+      cost += residual*residual;
+    }
+    return Weight<T>() * cost;
+  }
+
+  int NumResiduals(int trajectory_rows,
+                   int input_rows,
+                   int input_cols) const override {
+    return object_outlines_.empty() ? 0 : trajectory_rows;
+  }
+
+  //! rasterizes the objects
+  void Compile(int num_timesteps) override {
+    if (object_outlines_.empty()) {
+      sdf_ = SignedDistanceField();
+      return;
+    }
+    const double resolution = params_->get<double>("sdf_resolution", 0.2);
+    // exact up to epsilon (and the support of the interpolation)
+    const double band = epsilon_ + 2.*resolution;
+    std::vector<Matrix_t<double>> outlines;
+    for (const auto& obj_out : object_outlines_)
+      outlines.push_back(obj_out.Query(0.));
+    std::vector<double> extent =
+      params_->get<std::vector<double>>("sdf_extent", {});
+    if (extent.size() != 4) {
+      extent = {outlines[0].col(0).minCoeff(), outlines[0].col(1).minCoeff(),
+                outlines[0].col(0).maxCoeff(), outlines[0].col(1).maxCoeff()};
+      for (const auto& outline : outlines) {
+        extent[0] = std::min(extent[0], outline.col(0).minCoeff());
+        extent[1] = std::min(extent[1], outline.col(1).minCoeff());
+        extent[2] = std::max(extent[2], outline.col(0).maxCoeff());
+        extent[3] = std::max(extent[3], outline.col(1).maxCoeff());
+      }
+      extent = {extent[0] - band, extent[1] - band,
+                extent[2] + band, extent[3] + band};
+    }
+    sdf_.Build(outlines,
+               extent[0],
+               extent[1],
+               extent[2],
+               extent[3],
+               resolution,
+               band);
+  }
+
+  template<typename T, class M>
+  void Residuals(const MatrixRef_t<T>& trajectory,
+                 const MatrixRef_t<T>& inputs,
+                 T* residuals,
+                 int row_offset = 0) const {
+    if (object_outlines_.empty())
+      return;
+    for (int i = 0; i < trajectory.rows(); i++)
+      residuals[i] = SqrtWeight<T>()*Hinge<T, M>(trajectory, i);
+  }
+
+  //! residuals of a single trajectory row (see EvaluateCostResidualsFused)
+  template<typename T, class M>
+  class RowKernel {
+   public:
+    typedef SdfObjectCost Cost;
+
+    RowKernel(const SdfObjectCost& cost,
+              const MatrixRef_t<T>& trajectory,
+              const MatrixRef_t<T>& inputs,
+              int row_offset) :
+      cost_(cost), trajectory_(trajectory),
+      sqrt_weight_(cost.SqrtWeight<T>()) {}
+
+    void operator()(int i, T* residuals) const {
+      if (i < trajectory_.rows() && !cost_.object_outlines_.empty())
+        residuals[i] = sqrt_weight_*cost_.Hinge<T, M>(trajectory_, i);
+    }
+
+   private:
+    const SdfObjectCost& cost_;
+    const MatrixRef_t<T>& trajectory_;
+    T sqrt_weight_;
+  };
+
+  //! (epsilon - signed distance) of the trajectory row i if closer than
+  //  epsilon and zero otherwise
+  template<typename T, class M>
+  T Hinge(const MatrixRef_t<T>& trajectory, int i) const {
+    const T dist = sdf_.Evaluate<T>(
+      trajectory(i, static_cast<int>(M::StateDefinition::X)),
+      trajectory(i, static_cast<int>(M::StateDefinition::Y)));
+    return dist < T(epsilon_) ? T(epsilon_) - dist : T(0.);
+  }
+
+  //! the object is rasterized by the next Compile(..); the first object
+  //  adds residuals, so it needs to be added before the functor is compiled
+  void AddObjectOutline(const ObjectOutline& object_outline) {
+    object_outlines_.push_back(object_outline);
+  }
+
+  const SignedDistanceField& GetField() const { return sdf_; }
+
+  std::vector<ObjectOutline> object_outlines_;
+  double epsilon_;
+  SignedDistanceField sdf_;
+};
+
+typedef std::shared_ptr<SdfObjectCost> SdfObjectCostPtr;
+
+}  // namespace optimizer
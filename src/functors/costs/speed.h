@@ -15,8 +15,6 @@
 namespace optimizer {
 
 using geometry::Matrix_t;
-using geometry::BaseGeometry;
-using geometry::Line;
 using commons::ParameterPtr;
 using commons::Parameter;
 using commons::CalculateSquaredDistance;
@@ -36,8 +34,8 @@ class SpeedCost : public BaseCost {
   virtual ~SpeedCost() {}
 
   template<typename T, class M>
-  T Evaluate(const Matrix_t<T>& trajectory,
-             const Matrix_t<T>& inputs,
+  T Evaluate(const MatrixRef_t<T>& trajectory,
+             const MatrixRef_t<T>& inputs,
              T cost = T(0.)) const {
     for (int i = 0; i < trajectory.rows(); i++) {
       T v_total = T(0.);
@@ -55,7 +53,62 @@ class SpeedCost : public BaseCost {
       }
       cost += (v_total - v_des_)*(v_total - v_des_);
     }
-    return cost;
+    return Weight<T>() * cost;
+  }
+
+  int NumResiduals(int trajectory_rows,
+                   int input_rows,
+                   int input_cols) const override {
+    return trajectory_rows;
+  }
+
+  template<typename T, class M>
+  void Residuals(const MatrixRef_t<T>& trajectory,
+                 const MatrixRef_t<T>& inputs,
+                 T* residuals,
+                 int row_offset = 0) const {
+    for (int i = 0; i < trajectory.rows(); i++)
+      residuals[i] = RowResidual<T, M>(trajectory, i);
+  }
+
+  //! residuals of a single trajectory row (see EvaluateCostResidualsFused)
+  template<typename T, class M>
+  class RowKernel {
+   public:
+    typedef SpeedCost Cost;
+
+    RowKernel(const SpeedCost& cost,
+              const MatrixRef_t<T>& trajectory,
+              const MatrixRef_t<T>& inputs,
+              int row_offset) :
+      cost_(cost), trajectory_(trajectory) {}
+
+    void operator()(int i, T* residuals) const {
+      if (i < trajectory_.rows())
+        residuals[i] = cost_.RowResidual<T, M>(trajectory_, i);
+    }
+
+   private:
+    const SpeedCost& cost_;
+    const MatrixRef_t<T>& trajectory_;
+  };
+
+  template<typename T, class M>
+  T RowResidual(const MatrixRef_t<T>& trajectory, int i) const {
+    T v_total = T(0.);
+    if (static_cast<int>(M::StateDefinition::VELOCITY) != -1) {
+      int vel_idx = static_cast<int>(M::StateDefinition::VELOCITY);
+      v_total = trajectory(i, vel_idx);
+    } else {
+      int vel_idx_x = static_cast<int>(M::StateDefinition::VX);
+      int vel_idx_y = static_cast<int>(M::StateDefinition::VY);
+      int vel_idx_z = static_cast<int>(M::StateDefinition::VZ);
+      v_total = ceres::sqrt(
+        trajectory(i, vel_idx_x)*trajectory(i, vel_idx_x) + \
+        trajectory(i, vel_idx_y)*trajectory(i, vel_idx_y) + \
+        trajectory(i, vel_idx_z)*trajectory(i, vel_idx_z));
+    }
+    return SqrtWeight<T>()*(v_total - T(v_des_));
   }
 
   void SetDesiredSpeed(double speed) {
@@ -9,6 +9,9 @@
 #include <memory>
 #include <map>
 #include <utility>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
 #include "src/geometry/geometry.h"
 #include "src/commons/parameters.h"
 #include "src/commons/commons.h"
@@ -17,48 +20,288 @@
 namespace optimizer {
 
 using geometry::Matrix_t;
-using geometry::Polygon;
-using geometry::BaseGeometry;
-using geometry::Line;
-using geometry::Point;
-using geometry::Distance;
+using geometry::Point2;
 using commons::ParameterPtr;
 using commons::Parameter;
 using commons::GetSquaredObjectCosts;
 using commons::ObjectOutline;
+using commons::ObjectIndex;
+using commons::PositionValue;
+using geometry::ScalarValue;
+using geometry::OutlineEdges;
 
 
 class StaticObjectCost : public BaseCost {
  public:
-  StaticObjectCost() : BaseCost() {}
+  //! circles of the footprint are evaluated in fixed-size arrays
+  static constexpr int kMaxFootprintCircles = 16;
+  typedef Eigen::Array<double, Eigen::Dynamic, 1, 0,
+                       kMaxFootprintCircles, 1> CircleArray_t;
+
+  StaticObjectCost() : BaseCost(), epsilon_(2.0), dt_(0.1),
+    footprint_(Matrix_t<double>::Zero(1, 3)), index_(epsilon_) {}
   explicit StaticObjectCost(const ParameterPtr& params,
                             double eps = 2.0,
                             double cost = 200.) :
-    BaseCost(params) {
+    BaseCost(params), footprint_(Matrix_t<double>::Zero(1, 3)) {
       weight_ = params_->set<double>("weight_object", cost);
       epsilon_ = params_->set<double>("epsilon", eps);
+      Compile(0);
   }
   virtual ~StaticObjectCost() {}
 
   template<typename T, class M>
-  T Evaluate(const Matrix_t<T>& trajectory,
-             const Matrix_t<T>& inputs,
+  T Evaluate(const MatrixRef_t<T>& trajectory,
+             const MatrixRef_t<T>& inputs,
              T cost = T(0.)) const {
-    for (const auto& obj_out : object_outlines_) {
-      cost += GetSquaredObjectCosts<T, M>(obj_out,
-                                          trajectory,
-                                          T(epsilon_),
-                                          params_->get<double>("dt", 0.1));
+    commons::Arena& arena = commons::Arena::ThreadLocal();
+    commons::Arena::Scope scope(&arena);
+    int* candidates = arena.Allocate<int>(MaxCandidates());
+    for (int i = 0; i < trajectory.rows(); i++) {
+      const int num_candidates =
+        Candidates<T, M>(trajectory, i, i*dt_, candidates);
+      for (int c = 0; c < num_candidates; c++) {
+        const T residual =
+          ObjectResidual<T, M>(candidates[c], trajectory, i, i);
+        cost += residual*residual;
+      }
     }
     return Weight<T>() * cost;
   }
 
+  int NumResiduals(int trajectory_rows,
+                   int input_rows,
+                   int input_cols) const override {
+    return trajectory_rows*static_cast<int>(object_outlines_.size());
+  }
+
+  /**
+   * @brief Also rebuilds the broadphase (e.g. for a changed epsilon_) and
+   * samples the outline of every object at the timesteps of the horizon,
+   * as they do not depend on the optimized trajectory
+   */
+  void Compile(int num_timesteps) override {
+    dt_ = params_->get<double>("dt", 0.1);
+    BuildIndex();
+    sampled_outlines_.assign(object_outlines_.size(), {});
+    for (size_t k = 0; k < object_outlines_.size(); k++) {
+      sampled_outlines_[k].reserve(num_timesteps);
+      for (int n = 0; n < num_timesteps; n++)
+        sampled_outlines_[k].emplace_back(object_outlines_[k].Query(n*dt_));
+    }
+  }
+
+  /**
+   * @brief Approximates the ego footprint by circles placed relative to
+   * the state (X, Y) and rotated by its heading (THETA; zero if the model
+   * has none)
+   *
+   * @param circles Circles of size (N, 3) with the longitudinal offset,
+   * the lateral offset and the radius; defaults to the point (0, 0, 0)
+   * @throws std::invalid_argument for more than kMaxFootprintCircles
+   */
+  void SetFootprint(const Matrix_t<double>& circles) {
+    if (circles.rows() < 1 || circles.rows() > kMaxFootprintCircles ||
+        circles.cols() != 3)
+      throw std::invalid_argument(
+        "The footprint needs between one and kMaxFootprintCircles circles "
+        "of the form (offset_x, offset_y, radius).");
+    footprint_ = circles;
+    BuildIndex();
+  }
+
+  const Matrix_t<double>& GetFootprint() const { return footprint_; }
+
+  /**
+   * @brief Hinge residual of the object k for the trajectory row i (see
+   * commons::GetObjectResidual) using the closest circle of the footprint;
+   * uses the sampled outline if the timestep is within the compiled
+   * horizon
+   *
+   * @param timestep Timestep of the row (row_offset + i)
+   */
+  template<typename T, class M>
+  T ObjectResidual(int k,
+                   const MatrixRef_t<T>& trajectory,
+                   int i,
+                   int timestep) const {
+    const std::vector<OutlineEdges>& sampled = sampled_outlines_[k];
+    if (timestep >= static_cast<int>(sampled.size())) {
+      const OutlineEdges edges(object_outlines_[k].Query(timestep*dt_));
+      return FootprintResidual<T, M>(edges, trajectory, i);
+    }
+    return FootprintResidual<T, M>(sampled[timestep], trajectory, i);
+  }
+
+  /**
+   * @brief Hinge residual of the footprint; the distances of all circles
+   * are computed on the values at once and only the closest circle is
+   * evaluated in T
+   */
+  template<typename T, class M>
+  T FootprintResidual(const OutlineEdges& edges,
+                      const MatrixRef_t<T>& trajectory,
+                      int i) const {
+    static constexpr int kTheta = static_cast<int>(M::StateDefinition::THETA);
+    const T& x = trajectory(i, static_cast<int>(M::StateDefinition::X));
+    const T& y = trajectory(i, static_cast<int>(M::StateDefinition::Y));
+    const Point2<double> position = PositionValue<T, M>(trajectory, i);
+    // models without a heading (THETA == -1) keep the footprint unrotated
+    double theta = 0.;
+    if constexpr (kTheta != -1)
+      theta = ScalarValue(trajectory(i, kTheta));
+    const double cos_theta = std::cos(theta);
+    const double sin_theta = std::sin(theta);
+    const int num_circles = footprint_.rows();
+    const CircleArray_t cx = position.x +
+      cos_theta*footprint_.col(0).array() - sin_theta*footprint_.col(1).array();
+    const CircleArray_t cy = position.y +
+      sin_theta*footprint_.col(0).array() + cos_theta*footprint_.col(1).array();
+    CircleArray_t dist(num_circles);
+    edges.Distances(cx, cy, &dist);
+    dist -= footprint_.col(2).array();
+    int closest = 0;
+    if (dist.minCoeff(&closest) >= epsilon_)
+      return T(0.);
+
+    const double offset_x = footprint_(closest, 0);
+    const double offset_y = footprint_(closest, 1);
+    T dx = T(offset_x);
+    T dy = T(offset_y);
+    if constexpr (kTheta != -1) {
+      if (offset_x != 0. || offset_y != 0.) {
+        using std::cos;
+        using std::sin;
+        const T& heading = trajectory(i, kTheta);
+        const T c = cos(heading);
+        const T s = sin(heading);
+        dx = c*offset_x - s*offset_y;
+        dy = s*offset_x + c*offset_y;
+      }
+    }
+    const T dist_closest = edges.Distance<T>(x + dx, y + dy) -
+      T(footprint_(closest, 2));
+    return dist_closest < T(epsilon_) ? T(epsilon_) - dist_closest : T(0.);
+  }
+
+  /**
+   * @brief Objects that can be within epsilon of the trajectory row i; the
+   * residuals of all other objects are zero
+   *
+   * @param t Time of the row
+   * @param candidates Memory for MaxCandidates() indices of the objects
+   * @return int Number of candidates
+   */
+  template<typename T, class M>
+  int Candidates(const MatrixRef_t<T>& trajectory,
+                 int i,
+                 double t,
+                 int* candidates) const {
+    const Point2<double> position = PositionValue<T, M>(trajectory, i);
+    return index_.Query(position.x, position.y, t, candidates);
+  }
+
+  int MaxCandidates() const { return index_.Size(); }
+
+  template<typename T, class M>
+  void Residuals(const MatrixRef_t<T>& trajectory,
+                 const MatrixRef_t<T>& inputs,
+                 T* residuals,
+                 int row_offset = 0) const {
+    const int rows = trajectory.rows();
+    std::fill(residuals, residuals + rows*object_outlines_.size(), T(0.));
+    commons::Arena& arena = commons::Arena::ThreadLocal();
+    commons::Arena::Scope scope(&arena);
+    int* candidates = arena.Allocate<int>(MaxCandidates());
+    for (int i = 0; i < rows; i++) {
+      const int num_candidates = Candidates<T, M>(
+        trajectory, i, (row_offset + i)*dt_, candidates);
+      for (int c = 0; c < num_candidates; c++) {
+        const int k = candidates[c];
+        T& residual = residuals[k*rows + i];
+        residual = ObjectResidual<T, M>(k, trajectory, i, row_offset + i);
+        residual *= SqrtWeight<T>();
+      }
+    }
+  }
+
+  //! residuals of a single trajectory row (see EvaluateCostResidualsFused)
+  template<typename T, class M>
+  class RowKernel {
+   public:
+    typedef StaticObjectCost Cost;
+
+    RowKernel(const StaticObjectCost& cost,
+              const MatrixRef_t<T>& trajectory,
+              const MatrixRef_t<T>& inputs,
+              int row_offset) :
+      cost_(cost),
+      trajectory_(trajectory),
+      row_offset_(row_offset),
+      dt_(cost.dt_),
+      sqrt_weight_(cost.SqrtWeight<T>()),
+      // released with the arena scope of the evaluation
+      candidates_(commons::Arena::ThreadLocal().Allocate<int>(
+        cost.MaxCandidates())) {}
+
+    void operator()(int i, T* residuals) const {
+      if (i >= trajectory_.rows())
+        return;
+      const int rows = trajectory_.rows();
+      for (size_t k = 0; k < cost_.object_outlines_.size(); k++)
+        residuals[k*rows + i] = T(0.);
+      const int timestep = row_offset_ + i;
+      const int num_candidates =
+        cost_.Candidates<T, M>(trajectory_, i, timestep*dt_, candidates_);
+      for (int c = 0; c < num_candidates; c++) {
+        const int k = candidates_[c];
+        T& residual = residuals[k*rows + i];
+        residual = cost_.ObjectResidual<T, M>(k, trajectory_, i, timestep);
+        residual *= sqrt_weight_;
+      }
+    }
+
+   private:
+    const StaticObjectCost& cost_;
+    const MatrixRef_t<T>& trajectory_;
+    int row_offset_;
+    double dt_;
+    T sqrt_weight_;
+    int* candidates_;
+  };
+
+  //! adds residuals; call it before the functor of the cost is compiled
   void AddObjectOutline(const ObjectOutline& object_outline) {
     object_outlines_.push_back(object_outline);
+    // not sampled until the next Compile(..)
+    sampled_outlines_.emplace_back();
+    index_.Insert(object_outline, object_outlines_.size() - 1);
+  }
+
+  //! distance of the farthest point of the footprint to (X, Y)
+  double FootprintReach() const {
+    return (footprint_.leftCols(2).rowwise().norm() +
+            footprint_.col(2)).maxCoeff();
   }
 
   std::vector<ObjectOutline> object_outlines_;
   double epsilon_;
+  //! resolved by Compile()
+  double dt_;
+  //! circles (offset_x, offset_y, radius) of the ego footprint
+  Matrix_t<double> footprint_;
+  //! broadphase over the object outlines inflated by epsilon_ and the
+  //  reach of the footprint
+  ObjectIndex index_;
+  //! outline of every object per timestep of the compiled horizon
+  std::vector<std::vector<OutlineEdges>> sampled_outlines_;
+
+ private:
+  void BuildIndex() {
+    index_ = ObjectIndex(epsilon_ + FootprintReach());
+    for (size_t k = 0; k < object_outlines_.size(); k++)
+      index_.Insert(object_outlines_[k], k);
+  }
 };
 
 typedef std::shared_ptr<StaticObjectCost> StaticObjectCostPtr;
@@ -6,8 +6,14 @@
 
 #pragma once
 #include <vector>
+#include <variant>
+#include <memory>
+#include <new>
+#include <algorithm>
 #include <ceres/ceres.h>
 #include <functional>
+#include <type_traits>
+#include <stdexcept>
 #include "src/geometry/geometry.h"
 #include "src/commons/parameters.h"
 #include "src/commons/commons.h"
@@ -18,16 +24,16 @@
 #include "src/functors/costs/distance.h"
 #include "src/functors/costs/reference.h"
 #include "src/functors/costs/static_object.h"
+#include "src/functors/costs/sdf_object.h"
 #include "src/functors/costs/speed.h"
 #include "src/functors/costs/inputs.h"
+#include "src/functors/costs/cost_pack.h"
 
 namespace optimizer {
 
 using geometry::Matrix_t;
-using geometry::Distance;
-using geometry::Line;
-using geometry::Point;
-using geometry::Polygon;
+using geometry::MatrixRef_t;
+using geometry::MatrixMap_t;
 using commons::Parameter;
 using commons::ParameterPtr;
 using commons::CalculateSquaredJerk;
@@ -36,112 +42,335 @@ using dynamics::SingleTrackModel;
 using dynamics::TripleIntModel;
 using dynamics::IntegrationRK4;
 using dynamics::IntegrationEuler;
+using dynamics::IntegrationExact;
+using dynamics::IntegrationRK45;
 using std::vector;
 
 
+/**
+ * @brief Evaluates the residuals of all costs on a trajectory; every cost
+ * writes its residuals consecutively
+ * 
+ * @tparam T Type of data
+ * @tparam M Used model (for the state definitions)
+ * @tparam P Cost pack the costs have been resolved with
+ * @param costs Cost terms
+ * @param trajectory Trajectory (or a part of it)
+ * @param inputs Inputs belonging to the trajectory
+ * @param residuals Residuals that will be optimized
+ * @param row_offset Row of the first passed trajectory row
+ * @return true Whether the evaluation was successful
+ */
+template<typename T, class M, class P>
+inline bool EvaluateCostResiduals(
+  const vector<typename P::CostVariant>& costs,
+  const MatrixRef_t<T>& trajectory,
+  const MatrixRef_t<T>& inputs,
+  T* residuals,
+  int row_offset = 0) {
+  int offset = 0;
+  for (const auto& cost : costs) {
+    P::template Residuals<T, M>(cost,
+                                trajectory,
+                                inputs,
+                                residuals + offset,
+                                row_offset);
+    offset += P::AsBase(cost)->NumResiduals(trajectory.rows(),
+                                            inputs.rows(),
+                                            inputs.cols());
+  }
+  return true;
+}
+
+/**
+ * @brief Same residuals as EvaluateCostResiduals, but all costs are
+ * evaluated in a single pass over the rows of the trajectory, so that
+ * every row is loaded once for all costs
+ * 
+ * @tparam T Type of data
+ * @tparam M Used model (for the state definitions)
+ * @tparam P Cost pack the costs have been resolved with
+ * @param costs Cost terms
+ * @param trajectory Trajectory (or a part of it)
+ * @param inputs Inputs belonging to the trajectory
+ * @param residuals Residuals that will be optimized
+ * @param row_offset Row of the first passed trajectory row
+ * @return true Whether the evaluation was successful
+ */
+template<typename T, class M, class P>
+inline bool EvaluateCostResidualsFused(
+  const vector<typename P::CostVariant>& costs,
+  const MatrixRef_t<T>& trajectory,
+  const MatrixRef_t<T>& inputs,
+  T* residuals,
+  int row_offset = 0) {
+  typedef typename P::template RowKernelVariant<T, M> Kernel;
+  // the kernels and their scratch memory live in the arena
+  commons::Arena& arena = commons::Arena::ThreadLocal();
+  commons::Arena::Scope scope(&arena);
+  const int num_costs = costs.size();
+  Kernel* kernels = arena.Allocate<Kernel>(num_costs);
+  T** cost_residuals = arena.Allocate<T*>(num_costs);
+  int offset = 0;
+  for (int k = 0; k < num_costs; k++) {
+    new (kernels + k) Kernel(P::template MakeRowKernel<T, M>(costs[k],
+                                                             trajectory,
+                                                             inputs,
+                                                             row_offset));
+    cost_residuals[k] = residuals + offset;
+    offset += P::AsBase(costs[k])->NumResiduals(trajectory.rows(),
+                                                inputs.rows(),
+                                                inputs.cols());
+  }
+  const int rows = std::max(trajectory.rows(), inputs.rows());
+  for (int i = 0; i < rows; i++) {
+    for (int k = 0; k < num_costs; k++) {
+      std::visit([&](const auto& kernel) { kernel(i, cost_residuals[k]); },
+                 kernels[k]);
+    }
+  }
+  std::destroy_n(kernels, num_costs);
+  return true;
+}
+
 /**
  * @brief A functor for dynamic optimization
  * 
  * @tparam M Used model (e.g. SingleTrackModel)
  * @tparam I Used integration method (e.g. Explicit Euler)
+ * @tparam P Cost types the functor can evaluate
  */
-template<class M, class I>
+template<class M, class I, class P = DefaultCostPack>
 class DynamicFunctor : public BaseFunctor {
  public:
   explicit DynamicFunctor(Matrix_t<double> initial_states) :
     BaseFunctor(nullptr),
-    initial_states_(initial_states) {}
+    initial_states_(initial_states),
+    model_params_(M::Compile(Parameter())),
+    rollout_cache_(true),
+    fused_costs_(false) {}
 
   explicit DynamicFunctor(Matrix_t<double> initial_states,
                           ParameterPtr params) :
     BaseFunctor(params),
-    initial_states_(initial_states) {}
+    initial_states_(initial_states),
+    model_params_(M::Compile(*params)),
+    rollout_cache_(params->get<bool>("rollout_cache", true)),
+    fused_costs_(params->get<bool>("fused_costs", false)) {}
+
+  typedef M Model;
+  typedef I Integrator;
+  typedef P Costs;
+
+  static constexpr bool kHasAnalyticJacobians =
+    dynamics::HasStepJacobian<M>::value && dynamics::HasLinearize<I>::value;
+
+  /**
+   * @brief Replaces the initial states; the shape has to stay the same as
+   * the residual layout depends on it
+   * 
+   * @param initial_states New initial states
+   */
+  void SetInitialStates(const Matrix_t<double>& initial_states) override {
+    if (initial_states.rows() != initial_states_.rows() ||
+        initial_states.cols() != initial_states_.cols())
+      throw std::invalid_argument(
+        "The initial states need the shape of the ones the functor was "
+        "constructed with.");
+    initial_states_ = initial_states;
+    cached_inputs_.resize(0, 0);
+  }
+
+  const Matrix_t<double>& GetInitialStates() const { return initial_states_; }
+
+  //! resolves the type of the cost once (see CostPack)
+  void AddCost(const BaseCostPtr& cost) override {
+    cost_variants_.push_back(P::Resolve(cost));
+    BaseFunctor::AddCost(cost);
+  }
+
+  //! compiles the model parameters (see M::Compile) and the costs
+  void Compile() override {
+    if (params_)
+      model_params_ = M::Compile(*params_);
+    cached_inputs_.resize(0, 0);
+    BaseFunctor::Compile();
+  }
+
+  const typename M::Params& GetModelParams() const { return model_params_; }
+
+  //! static models map every input to one state
+  int GetTrajectoryLen() const override {
+    if (model_params_.is_static)
+      return this->GetOptVecLen();
+    return this->GetOptVecLen() + initial_states_.rows();
+  }
 
   /**
    * @brief Function that is called by the ceres-solver
    * 
+   * Every cost writes its residuals (one per timestep and component)
+   * consecutively into residuals; the layout is sized by NumResiduals().
+   * 
    * @tparam T Type of data
    * @param parameters Parameter class
    * @param residuals Residuals that will be optimized
-   * @param costs Calculated costs
-   * @param weights Calculated weights
    * @return true Whether the optimization was successful
    */
   template<typename T>
   bool operator()(T const* const* parameters,
-                  T* residuals,
-                  T costs = T(0.),
-                  T weights = T(0.)) {
+                  T* residuals) {
+    this->CheckLayout();
+    auto start = this->Now();
+    // all scratch matrices of the evaluation live in the arena
+    commons::Arena& arena = commons::Arena::ThreadLocal();
+    commons::Arena::Scope scope(&arena);
     // conversion
-    Matrix_t<T> opt_vec = this->ParamsToEigen<T>(parameters);
-    Matrix_t<T> initial_states_t = initial_states_.cast<T>();
-    // generation
-    Matrix_t<T> trajectory = GenerateDynamicTrajectory<T, M, I>(
-      initial_states_t,
-      opt_vec,
-      params_.get());
-
-
-    for ( int i = 0; i < costs_.size(); i++ ) {
-      if (std::dynamic_pointer_cast<JerkCost>(costs_[i])) {
-        // would need state def
-        JerkCostPtr cost = std::dynamic_pointer_cast<JerkCost>(costs_[i]);
-        costs += cost->Evaluate<T, M>(trajectory, opt_vec);
-        weights += cost->Weight<T>();
-        continue;
-      }
-      if (std::dynamic_pointer_cast<ReferenceLineCost>(costs_[i])) {
-        // would need state def
-        ReferenceLineCostPtr cost =
-          std::dynamic_pointer_cast<ReferenceLineCost>(costs_[i]);
-        costs += cost->Evaluate<T, M>(trajectory, opt_vec);
-        weights += cost->Weight<T>();
-        continue;
-      }
-      if (std::dynamic_pointer_cast<InputCost>(costs_[i])) {
-        InputCostPtr cost = std::dynamic_pointer_cast<InputCost>(costs_[i]);
-        costs += cost->Evaluate<T, M>(trajectory, opt_vec);
-        weights += cost->Weight<T>();
-        continue;
-      }
-      if (std::dynamic_pointer_cast<ReferenceCost>(costs_[i])) {
-        ReferenceCostPtr cost =
-          std::dynamic_pointer_cast<ReferenceCost>(costs_[i]);
-        costs += cost->Evaluate<T, M>(trajectory, opt_vec);
-        weights += cost->Weight<T>();
-        continue;
-      }
-      if (std::dynamic_pointer_cast<SpeedCost>(costs_[i])) {
-        // would need state def
-        SpeedCostPtr cost =
-          std::dynamic_pointer_cast<SpeedCost>(costs_[i]);
-        costs += cost->Evaluate<T, M>(trajectory, opt_vec);
-        weights += cost->Weight<T>();
-        continue;
-      }
-      if (std::dynamic_pointer_cast<StaticObjectCost>(costs_[i])) {
-        StaticObjectCostPtr cost =
-          std::dynamic_pointer_cast<StaticObjectCost>(costs_[i]);
-        costs += cost->Evaluate<T, M>(trajectory, opt_vec);
-        weights += cost->Weight<T>();
-        continue;
+    MatrixMap_t<T> opt_vec = arena.Matrix<T>(this->GetOptVecLen(),
+                                             this->GetParamCount());
+    this->template ParamsToEigen<T>(parameters, opt_vec);
+    if constexpr (std::is_same<T, double>::value) {
+      if (rollout_cache_) {
+        const Matrix_t<double>& trajectory = CachedTrajectory(opt_vec);
+        auto rollout_end = this->Now();
+        bool success = EvaluateCosts<T>(trajectory, opt_vec, residuals);
+        this->AddEvaluationTime(start,
+                                rollout_end,
+                                this->Now());
+        return success;
       }
     }
+    MatrixMap_t<T> initial_states_t = arena.Matrix<T>(initial_states_.rows(),
+                                                      initial_states_.cols());
+    initial_states_t = initial_states_.cast<T>();
+    // generation
+    MatrixMap_t<T> trajectory = arena.Matrix<T>(
+      dynamics::TrajectoryRows<M>(initial_states_.rows(),
+                                  opt_vec.rows(),
+                                  model_params_),
+      initial_states_.cols());
+    GenerateDynamicTrajectory<T, M, I>(initial_states_t,
+                                       opt_vec,
+                                       model_params_,
+                                       trajectory);
+    auto rollout_end = this->Now();
+    bool success = EvaluateCosts<T>(trajectory, opt_vec, residuals);
+    this->AddEvaluationTime(start,
+                            rollout_end,
+                            this->Now());
+    return success;
+  }
+
+  /**
+   * @brief Generates the trajectory together with its analytic
+   * sensitivities w.r.t. the optimization vector
+   * 
+   * @param opt_vec Optimization vector
+   * @param sensitivities d state / d opt_vec per trajectory row
+   * @return Matrix_t<double> Trajectory
+   */
+  Matrix_t<double> GenerateTrajectoryJacobian(
+    const Matrix_t<double>& opt_vec,
+    std::vector<Matrix_t<double>>* sensitivities) {
+    Matrix_t<double> trajectory =
+      dynamics::GenerateDynamicTrajectoryJacobian<M, I>(initial_states_,
+                                                        opt_vec,
+                                                        model_params_,
+                                                        sensitivities);
+    // the line search evaluates around this point next
+    if (rollout_cache_) {
+      cached_inputs_ = opt_vec;
+      cached_trajectory_ = trajectory;
+    }
+    return trajectory;
+  }
+
+  /**
+   * @brief Trajectory for the inputs; only the part after the first input
+   * row that differs from the previous call is integrated again
+   * 
+   * @param opt_vec Optimization vector
+   * @return const Matrix_t<double>& Trajectory
+   */
+  const Matrix_t<double>& CachedTrajectory(
+    const MatrixRef_t<double>& opt_vec) {
+    if (cached_inputs_.rows() != opt_vec.rows() ||
+        cached_inputs_.cols() != opt_vec.cols()) {
+      cached_inputs_ = opt_vec;
+      cached_trajectory_ = GenerateDynamicTrajectory<double, M, I>(
+        initial_states_, opt_vec, model_params_);
+      rollout_cache_misses_++;
+      return cached_trajectory_;
+    }
+    int first_changed = 0;
+    while (first_changed < opt_vec.rows() &&
+           cached_inputs_.row(first_changed) == opt_vec.row(first_changed))
+      first_changed++;
+    if (first_changed == 0)
+      rollout_cache_misses_++;
+    else
+      rollout_cache_hits_++;
+    if (first_changed < opt_vec.rows()) {
+      cached_inputs_.bottomRows(opt_vec.rows() - first_changed) =
+        opt_vec.bottomRows(opt_vec.rows() - first_changed);
+      dynamics::RegenerateDynamicTrajectory<double, M, I>(initial_states_,
+                                                          opt_vec,
+                                                          model_params_,
+                                                          first_changed,
+                                                          &cached_trajectory_);
+    }
+    return cached_trajectory_;
+  }
 
-    residuals[0] = costs / weights;
-    return true;
+  /**
+   * @brief Evaluates all costs on a given trajectory
+   * 
+   * @tparam T Type of data
+   * @param trajectory Generated trajectory
+   * @param opt_vec Optimization vector
+   * @param residuals Residuals that will be optimized
+   * @return true Whether the evaluation was successful
+   */
+  template<typename T>
+  bool EvaluateCosts(const MatrixRef_t<T>& trajectory,
+                     const MatrixRef_t<T>& opt_vec,
+                     T* residuals) {
+    if (fused_costs_) {
+      return EvaluateCostResidualsFused<T, M, P>(cost_variants_,
+                                                 trajectory,
+                                                 opt_vec,
+                                                 residuals);
+    }
+    return EvaluateCostResiduals<T, M, P>(cost_variants_,
+                                          trajectory,
+                                          opt_vec,
+                                          residuals);
   }
 
  private:
   Matrix_t<double> initial_states_;
+  //! parameters of the model resolved by Compile()
+  typename M::Params model_params_;
+  //! last double evaluation; not shared between threads as ceres
+  //  evaluates a residual block by one thread at a time
+  bool rollout_cache_;
+  Matrix_t<double> cached_inputs_;
+  Matrix_t<double> cached_trajectory_;
+  //! evaluate all costs in one pass over the trajectory rows
+  bool fused_costs_;
+  vector<typename P::CostVariant> cost_variants_;
 };
 
 typedef DynamicFunctor<SingleTrackModel, IntegrationRK4> SingleTrackFunctor;
-typedef DynamicFunctor<TripleIntModel, IntegrationRK4> TripleIntFunctor;
+typedef DynamicFunctor<TripleIntModel, IntegrationExact> TripleIntFunctor;
 typedef DynamicFunctor<SingleTrackModel,
                        IntegrationEuler> FastSingleTrackFunctor;
+typedef DynamicFunctor<SingleTrackModel,
+                       IntegrationRK45> AdaptiveSingleTrackFunctor;
 
 typedef std::shared_ptr<SingleTrackFunctor> SingleTrackFunctorPtr;
 typedef std::shared_ptr<TripleIntFunctor> TripleIntFunctorPtr;
 typedef std::shared_ptr<FastSingleTrackFunctor> FastSingleTrackFunctorPtr;
+typedef std::shared_ptr<AdaptiveSingleTrackFunctor>
+  AdaptiveSingleTrackFunctorPtr;
 }  // namespace optimizer
@@ -0,0 +1,146 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <ceres/ceres.h>
+#include "src/geometry/geometry.h"
+#include "src/commons/parameters.h"
+#include "src/dynamics/dynamics.h"
+#include "src/functors/base_functor.h"
+#include "src/functors/dynamic_functor.h"
+
+namespace optimizer {
+
+using geometry::Matrix_t;
+using commons::Parameter;
+using commons::ParameterPtr;
+
+/**
+ * @brief Links two consecutive states of the multiple shooting formulation
+ *
+ * Parameter blocks: state k-1, input k-1 and state k. The residuals are
+ * the weighted defects x_k - Step(x_{k-1}, u_{k-1}).
+ *
+ * @tparam M Used model (e.g. SingleTrackModel)
+ * @tparam I Used integration method (e.g. Explicit Euler)
+ */
+template<class M, class I>
+class ContinuityFunctor {
+ public:
+  ContinuityFunctor(const ParameterPtr& params,
+                    int state_size,
+                    int input_size) :
+    model_params_(M::Compile(*params)),
+    state_size_(state_size),
+    input_size_(input_size),
+    sqrt_weight_(std::sqrt(params->get<double>("weight_continuity", 1e3))) {}
+
+  template<typename T>
+  bool operator()(T const* const* parameters,
+                  T* residuals) const {
+    Eigen::Map<const Eigen::Matrix<T, 1, Eigen::Dynamic>> state(
+      parameters[0], state_size_);
+    Eigen::Map<const Eigen::Matrix<T, 1, Eigen::Dynamic>> input(
+      parameters[1], input_size_);
+    auto next_state = dynamics::ModelStep<T, M, I>(state,
+                                                   input,
+                                                   model_params_);
+    for (int i = 0; i < state_size_; i++)
+      residuals[i] = T(sqrt_weight_)*(parameters[2][i] - next_state(i));
+    return true;
+  }
+
+ private:
+  typename M::Params model_params_;
+  int state_size_;
+  int input_size_;
+  double sqrt_weight_;
+};
+
+/**
+ * @brief Evaluates the costs of a single stage (trajectory row) of the
+ * multiple shooting formulation
+ *
+ * Parameter blocks: the window_rows states up to and including the stage
+ * (oldest first) followed by the input that leads to the stage, if any.
+ * Every cost is evaluated on the last StageWindow() rows of the window, so
+ * that the stages partition the residuals of the single shooting functor.
+ *
+ * @tparam M Used model (e.g. SingleTrackModel)
+ * @tparam P Cost types the functor can evaluate
+ */
+template<class M, class P = DefaultCostPack>
+class StageFunctor : public BaseFunctor {
+ public:
+  StageFunctor(const ParameterPtr& params,
+               int stage,
+               int window_rows,
+               int state_size,
+               int input_size) :
+    BaseFunctor(params),
+    stage_(stage),
+    window_rows_(window_rows),
+    state_size_(state_size),
+    input_size_(input_size) {}
+
+  //! resolves the type of the cost once (see CostPack)
+  void AddCost(const BaseCostPtr& cost) override {
+    cost_variants_.push_back(P::Resolve(cost));
+    BaseFunctor::AddCost(cost);
+  }
+
+  int CostResiduals(const BaseCostPtr& cost) const override {
+    return cost->NumResiduals(CostRows(cost),
+                              input_size_ > 0 ? 1 : 0,
+                              input_size_);
+  }
+
+  template<typename T>
+  bool operator()(T const* const* parameters,
+                  T* residuals) const {
+    this->CheckLayout();
+    commons::Arena& arena = commons::Arena::ThreadLocal();
+    commons::Arena::Scope scope(&arena);
+    geometry::MatrixMap_t<T> window = arena.Matrix<T>(window_rows_,
+                                                      state_size_);
+    for (int i = 0; i < window_rows_; i++) {
+      for (int j = 0; j < state_size_; j++) {
+        window(i, j) = parameters[i][j];
+      }
+    }
+    geometry::MatrixMap_t<T> input = arena.Matrix<T>(input_size_ > 0 ? 1 : 0,
+                                                     input_size_);
+    for (int j = 0; j < input_size_; j++)
+      input(0, j) = parameters[window_rows_][j];
+
+    int offset = 0;
+    for (size_t i = 0; i < costs_.size(); i++) {
+      const int rows = CostRows(costs_[i]);
+      P::template Residuals<T, M>(cost_variants_[i],
+                                  window.bottomRows(rows),
+                                  input,
+                                  residuals + offset,
+                                  stage_ - rows + 1);
+      offset += costs_[i]->NumResiduals(rows, input.rows(), input_size_);
+    }
+    return true;
+  }
+
+ private:
+  int CostRows(const BaseCostPtr& cost) const {
+    return std::min(cost->StageWindow(), window_rows_);
+  }
+
+  int stage_;
+  int window_rows_;
+  int state_size_;
+  int input_size_;
+  std::vector<typename P::CostVariant> cost_variants_;
+};
+
+}  // namespace optimizer
@@ -5,6 +5,7 @@
 #pragma once
 #include <Eigen/Dense>
 #include <string>
+#include <type_traits>
 #include <boost/geometry.hpp>
 #include <boost/geometry/geometries/point.hpp>
 #include <boost/geometry/geometries/box.hpp>
@@ -34,10 +35,55 @@ using Polygon_t = bg::model::polygon<Point_t<T, N>>;
 template <typename T, int N>
 using State_t = Eigen::Matrix<T, 1, N>;
 
+//! Input
+template <typename T, int N>
+using Input_t = Eigen::Matrix<T, 1, N>;
+
+//! K states (or inputs) as structure-of-arrays; row i holds component i
+//! of all K so that element-wise operations vectorize across the batch
+template <int N>
+using Batch_t = Eigen::Array<double, N, Eigen::Dynamic, Eigen::RowMajor>;
+
 //! Trajectory
 template <typename T>
 using Matrix_t = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
 
+//! read-only view of a trajectory; binds to a Matrix_t, a MatrixMap_t or
+//! a block of them without copying
+template <typename T>
+using MatrixRef_t = Eigen::Ref<const Matrix_t<T>>;
+
+//! trajectory in external memory (e.g. of a commons::Arena)
+template <typename T>
+using MatrixMap_t = Eigen::Map<Matrix_t<T>>;
+
+//! value of a scalar without its derivatives (e.g. of a ceres::Jet)
+inline double ScalarValue(double x) { return x; }
+
+template<typename T>
+inline double ScalarValue(const T& x) { return x.a; }
+
+/**
+ * @brief Plain position for computations (e.g. of a trajectory row)
+ *
+ * Unlike Point it has no styling, so that it is trivially copyable and
+ * the cost functions never construct a std::string.
+ */
+template <typename T>
+struct Point2 {
+  T x;
+  T y;
+};
+
+static_assert(std::is_trivially_copyable<Point2<double>>::value &&
+              std::is_standard_layout<Point2<double>>::value,
+              "Point2 has to stay a plain value type.");
+
+/**
+ * @brief Styled boost geometry (color, style, visibility) for the
+ * visualization and the bindings; computations use Point2 and the kernels
+ * of polygon_distance.h instead
+ */
 template<class Geometry>
 struct BaseGeometry {
   BaseGeometry() :
@@ -68,8 +114,8 @@ struct BaseGeometry {
   bool getBoundary() const { return boundary_; }
   string color_;
   string style_;
-  bool visibility_;
-  bool boundary_;
+  bool visibility_ = true;
+  bool boundary_ = false;
   Geometry obj_;
 };
 
@@ -11,6 +11,10 @@
 #include "src/geometry/point.h"
 #include "src/geometry/line.h"
 #include "src/geometry/polygon.h"
+#include "src/geometry/reference_path.h"
+#include "src/geometry/polygon_distance.h"
+#include "src/geometry/outline_edges.h"
+#include "src/geometry/signed_distance_field.h"
 
 namespace geometry {
 
@@ -33,13 +37,17 @@ bool Disjoint(const A& a, const B& b) {
   return bg::disjoint(a.obj_, b.obj_);
 }
 
-//! hacky solution for distance calc. for polygon
+//! distance of a point to a polygon (zero within it; see RingDistance)
 template <typename T, int N>
 T Distance(const Polygon<T, N>& a, const Point<T, N>& b) {
-  if ( Collides<Polygon<T, N>, Point<T, N>>(a, b) ) {
-    return T(0.0);
-  }
-  return bg::distance(a.ToLine().obj_, b.obj_);
+  const auto& ring = exterior_ring(a.obj_);
+  return RingDistance<T>(
+    ring.size(),
+    [&ring](int k, int d) {
+      return d == 0 ? bg::get<0>(ring[k]) : bg::get<1>(ring[k]);
+    },
+    bg::get<0>(b.obj_),
+    bg::get<1>(b.obj_));
 }
 
 //! translate geometry
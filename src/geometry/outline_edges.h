@@ -0,0 +1,87 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+#pragma once
+#include <Eigen/Dense>
+#include <limits>
+#include "src/geometry/base.h"
+#include "src/geometry/polygon_distance.h"
+
+namespace geometry {
+
+/**
+ * @brief Closed outline of a polygon, so that the distance of a point can
+ * be evaluated without building a boost polygon (see OutlineDistance)
+ *
+ * Like Distance(Polygon, Point), the distance is zero within the polygon.
+ */
+class OutlineEdges {
+ public:
+  OutlineEdges() {}
+
+  //! @param outline Vertices of size (N, 2); the ring is closed if needed
+  explicit OutlineEdges(const Matrix_t<double>& outline) {
+    Matrix_t<double> ring = outline.leftCols(2);
+    if (ring.rows() > 1 && ring.row(0) != ring.row(ring.rows() - 1)) {
+      ring.conservativeResize(ring.rows() + 1, Eigen::NoChange);
+      ring.row(ring.rows() - 1) = ring.row(0);
+    }
+    ring_ = ring;
+  }
+
+  //! crossing number test (the boundary has a distance of zero anyway)
+  bool Contains(double x, double y) const {
+    bool inside = false;
+    for (int k = 0; k + 1 < ring_.rows(); k++) {
+      const double x0 = ring_(k, 0), y0 = ring_(k, 1);
+      const double x1 = ring_(k + 1, 0), y1 = ring_(k + 1, 1);
+      if ((y0 > y) != (y1 > y) &&
+          x < x0 + (y - y0)*(x1 - x0)/(y1 - y0))
+        inside = !inside;
+    }
+    return inside;
+  }
+
+  //! distance to the boundary; negative within the polygon
+  double SignedDistance(double x, double y) const {
+    return SignedOutlineDistance(ring_, x, y);
+  }
+
+  /**
+   * @brief Distances of several points at once (zero within the polygon);
+   * every edge is tested against all points with array operations
+   *
+   * @tparam A Eigen array (e.g. with a fixed maximum size to stay on the
+   * stack)
+   */
+  template<class A>
+  void Distances(const A& x, const A& y, A* dist) const {
+    A squared = A::Constant(x.size(), std::numeric_limits<double>::max());
+    for (int k = 0; k + 1 < ring_.rows(); k++) {
+      const double ux = ring_(k + 1, 0) - ring_(k, 0);
+      const double uy = ring_(k + 1, 1) - ring_(k, 1);
+      const double squared_length = ux*ux + uy*uy;
+      const double inv = squared_length > 0. ? 1. / squared_length : 0.;
+      const A dx = x - ring_(k, 0);
+      const A dy = y - ring_(k, 1);
+      const A t = ((dx*ux + dy*uy)*inv).max(0.).min(1.);
+      squared = squared.min((dx - t*ux).square() + (dy - t*uy).square());
+    }
+    *dist = squared.sqrt();
+    for (int j = 0; j < x.size(); j++) {
+      if (Contains(x(j), y(j)))
+        (*dist)(j) = 0.;
+    }
+  }
+
+  template<typename T>
+  T Distance(const T& x, const T& y) const {
+    return OutlineDistance<T>(ring_, x, y);
+  }
+
+ private:
+  Matrix_t<double> ring_;
+};
+
+}  // namespace geometry
@@ -0,0 +1,128 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+#pragma once
+#include <Eigen/Dense>
+#include <cmath>
+#include <limits>
+#include "src/geometry/base.h"
+
+namespace geometry {
+
+//! closest edge of a ring to a point (see ProjectOntoRing)
+struct RingProjection {
+  int edge = -1;
+  double squared_distance = std::numeric_limits<double>::max();
+  bool inside = false;
+};
+
+/**
+ * @brief Closest edge and even-odd inside test of a point in one pass over
+ * the edges of a ring; works on the values only and does not allocate
+ *
+ * @param num_vertices Number of vertices; the ring may be closed or open
+ * @param vertex Returns the coordinate d (0 or 1) of the vertex k
+ */
+template<class V>
+inline RingProjection ProjectOntoRing(int num_vertices,
+                                      const V& vertex,
+                                      double x,
+                                      double y) {
+  RingProjection projection;
+  for (int k = 0; k < num_vertices; k++) {
+    const int l = k + 1 < num_vertices ? k + 1 : 0;
+    const double x0 = ScalarValue(vertex(k, 0));
+    const double y0 = ScalarValue(vertex(k, 1));
+    const double ux = ScalarValue(vertex(l, 0)) - x0;
+    const double uy = ScalarValue(vertex(l, 1)) - y0;
+    if ((y0 > y) != (y0 + uy > y) && x < x0 + (y - y0)*ux/uy)
+      projection.inside = !projection.inside;
+    const double dx = x - x0;
+    const double dy = y - y0;
+    const double squared_length = ux*ux + uy*uy;
+    double t = squared_length > 0. ? (dx*ux + dy*uy) / squared_length : 0.;
+    t = t < 0. ? 0. : (t > 1. ? 1. : t);
+    const double ex = dx - t*ux;
+    const double ey = dy - t*uy;
+    const double squared_distance = ex*ex + ey*ey;
+    if (squared_distance < projection.squared_distance) {
+      projection.squared_distance = squared_distance;
+      projection.edge = k;
+    }
+  }
+  return projection;
+}
+
+/**
+ * @brief Distance of a point to a polygon ring (zero within it)
+ *
+ * The closest edge is selected on the values; only that edge is evaluated
+ * in T, so that e.g. a ceres::Jet is differentiated through the segment
+ * projection without any temporary geometry.
+ *
+ * @tparam T Type of the point (e.g. a ceres::Jet)
+ * @param vertex Returns the coordinate d of the vertex k (double or T)
+ */
+template<typename T, class V>
+inline T RingDistance(int num_vertices,
+                      const V& vertex,
+                      const T& x,
+                      const T& y) {
+  using std::sqrt;
+  const RingProjection projection = ProjectOntoRing(
+    num_vertices, vertex, ScalarValue(x), ScalarValue(y));
+  if (projection.edge < 0)
+    return T(std::numeric_limits<double>::max());
+  if (projection.inside)
+    return T(0.);
+  const int k = projection.edge;
+  const int l = k + 1 < num_vertices ? k + 1 : 0;
+  const T x0 = T(vertex(k, 0));
+  const T y0 = T(vertex(k, 1));
+  const T ux = T(vertex(l, 0)) - x0;
+  const T uy = T(vertex(l, 1)) - y0;
+  const T dx = x - x0;
+  const T dy = y - y0;
+  const T squared_length = ux*ux + uy*uy;
+  T t = T(0.);
+  if (squared_length > T(0.))
+    t = (dx*ux + dy*uy) / squared_length;
+  if (t < T(0.))
+    t = T(0.);
+  else if (t > T(1.))
+    t = T(1.);
+  const T ex = dx - t*ux;
+  const T ey = dy - t*uy;
+  return sqrt(ex*ex + ey*ey);
+}
+
+/**
+ * @brief Distance of a point to an outline (zero within it)
+ *
+ * @param outline Vertices of size (N, 2) (e.g. an ObjectOutline)
+ */
+template<typename T, class D>
+inline T OutlineDistance(const Eigen::MatrixBase<D>& outline,
+                         const T& x,
+                         const T& y) {
+  return RingDistance<T>(
+    outline.rows(),
+    [&outline](int k, int d) { return outline(k, d); },
+    x, y);
+}
+
+//! distance of a point to an outline; negative within it
+template<class D>
+inline double SignedOutlineDistance(const Eigen::MatrixBase<D>& outline,
+                                    double x,
+                                    double y) {
+  const RingProjection projection = ProjectOntoRing(
+    outline.rows(),
+    [&outline](int k, int d) { return outline(k, d); },
+    x, y);
+  const double dist = std::sqrt(projection.squared_distance);
+  return projection.inside ? -dist : dist;
+}
+
+}  // namespace geometry
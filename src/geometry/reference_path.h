@@ -0,0 +1,171 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+#pragma once
+#include <Eigen/Dense>
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include "src/geometry/base.h"
+
+namespace geometry {
+
+/**
+ * @brief Polyline with precomputed segments and arc-lengths, e.g. a
+ * reference line of a map with thousands of vertices
+ *
+ * Consecutive points of a trajectory are close to each other along the
+ * path; after the first point, every point is therefore only tested
+ * against the segments within an arc-length window around the projection
+ * of its predecessor (see Cursor). The projection thus follows the
+ * branch of the path the trajectory is on: where the path comes back
+ * close to itself, e.g. at a hairpin, a point is not assigned to the
+ * other leg even if that one is closer.
+ */
+class ReferencePath {
+ public:
+  //! projection of the previous point of a trajectory
+  struct Cursor {
+    int segment = -1;
+    double x = 0.;
+    double y = 0.;
+    double distance = 0.;
+    double s = 0.;
+  };
+
+  ReferencePath() {}
+
+  //! @param points Vertices of the path of size (N, 2) with N > 0
+  explicit ReferencePath(const Matrix_t<double>& points) :
+    points_(points.leftCols(2)) {
+    const int num_segments = std::max<int>(0, points_.rows() - 1);
+    direction_.resize(num_segments, 2);
+    inv_squared_length_.resize(num_segments);
+    s_.resize(num_segments + 1);
+    s_[0] = 0.;
+    for (int k = 0; k < num_segments; k++) {
+      direction_.row(k) = points_.row(k + 1) - points_.row(k);
+      const double squared_length = direction_.row(k).squaredNorm();
+      inv_squared_length_[k] = squared_length > 0. ? 1. / squared_length : 0.;
+      s_[k + 1] = s_[k] + std::sqrt(squared_length);
+    }
+  }
+
+  int NumSegments() const { return direction_.rows(); }
+  bool Empty() const { return points_.rows() == 0; }
+
+  //! arc-length of the start of the segment k (k = NumSegments() is the end)
+  double ArcLength(int k) const { return s_[k]; }
+
+  /**
+   * @brief Distance of a point to the segment k; a path of a single vertex
+   * has one (degenerate) segment 0
+   *
+   * @tparam T Type of data (e.g. a ceres::Jet)
+   */
+  template<typename T>
+  T Distance(const T& x, const T& y, int k) const {
+    using std::sqrt;
+    const T dx = x - T(points_(k, 0));
+    const T dy = y - T(points_(k, 1));
+    if (NumSegments() == 0)
+      return sqrt(dx*dx + dy*dy);
+    const double ux = direction_(k, 0);
+    const double uy = direction_(k, 1);
+    T t = (dx*ux + dy*uy)*inv_squared_length_[k];
+    if (t < T(0.))
+      t = T(0.);
+    else if (t > T(1.))
+      t = T(1.);
+    const T ex = dx - t*ux;
+    const T ey = dy - t*uy;
+    return sqrt(ex*ex + ey*ey);
+  }
+
+  /**
+   * @brief Closest segment of the next point of a trajectory
+   *
+   * The first point (cursor->segment < 0) is projected onto the whole
+   * path. Afterwards, only segments that lie within the arc-length window
+   * [s - r, s + r] around the previous projection s are tested, where r is
+   * the distance the point moved plus both distances to the path.
+   * Segments of other branches of the path outside of this window are not
+   * tested (see ReferencePath).
+   *
+   * @param x X-coordinate of the point
+   * @param y Y-coordinate of the point
+   * @param cursor Projection of the previous point; updated
+   * @return int Closest segment
+   */
+  int Advance(double x, double y, Cursor* cursor) const {
+    if (Empty())
+      throw std::invalid_argument(
+        "The reference path is empty; set a reference line first.");
+    int best = 0;
+    double best_sq = std::numeric_limits<double>::infinity();
+    auto test = [&](int k) {
+      const double sq = SquaredDistance(x, y, k);
+      if (sq < best_sq) {
+        best_sq = sq;
+        best = k;
+      }
+    };
+    const int num_segments = std::max(NumSegments(), 1);
+    if (cursor->segment < 0 || NumSegments() == 0) {
+      for (int k = 0; k < num_segments; k++)
+        test(k);
+    } else {
+      const double moved = std::hypot(x - cursor->x, y - cursor->y);
+      test(cursor->segment);
+      auto radius = [&]() {
+        return moved + cursor->distance + std::sqrt(best_sq);
+      };
+      for (int k = cursor->segment + 1;
+           k < num_segments && s_[k] <= cursor->s + radius(); k++)
+        test(k);
+      for (int k = cursor->segment - 1;
+           k >= 0 && s_[k + 1] >= cursor->s - radius(); k--)
+        test(k);
+    }
+    cursor->segment = best;
+    cursor->x = x;
+    cursor->y = y;
+    cursor->distance = std::sqrt(best_sq);
+    cursor->s = NumSegments() == 0 ? 0. :
+      s_[best] + Projection(x, y, best)*(s_[best + 1] - s_[best]);
+    return best;
+  }
+
+ private:
+  //! position of the projection on the segment k in [0, 1]
+  double Projection(double x, double y, int k) const {
+    if (NumSegments() == 0)
+      return 0.;
+    const double t = ((x - points_(k, 0))*direction_(k, 0) +
+                      (y - points_(k, 1))*direction_(k, 1)) *
+                     inv_squared_length_[k];
+    return std::min(1., std::max(0., t));
+  }
+
+  double SquaredDistance(double x, double y, int k) const {
+    double ex = x - points_(k, 0);
+    double ey = y - points_(k, 1);
+    if (NumSegments() > 0) {
+      const double t = Projection(x, y, k);
+      ex -= t*direction_(k, 0);
+      ey -= t*direction_(k, 1);
+    }
+    return ex*ex + ey*ey;
+  }
+
+  Eigen::Matrix<double, Eigen::Dynamic, 2> points_;
+  Eigen::Matrix<double, Eigen::Dynamic, 2> direction_;
+  std::vector<double> inv_squared_length_;
+  //! arc-length at every vertex
+  std::vector<double> s_;
+};
+
+}  // namespace geometry
@@ -0,0 +1,140 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+#pragma once
+#include <Eigen/Dense>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "src/geometry/base.h"
+#include "src/geometry/outline_edges.h"
+
+namespace geometry {
+
+/**
+ * @brief Signed distance to a set of polygons sampled on a regular grid
+ *
+ * The distances are only computed exactly within a band around the
+ * polygons and clamped to the band width elsewhere, so that building the
+ * field scales with the area close to the polygons. Evaluate interpolates
+ * the grid with Catmull-Rom splines, which is continuously differentiable
+ * and works on Jets.
+ */
+class SignedDistanceField {
+ public:
+  SignedDistanceField() : min_x_(0.), min_y_(0.), resolution_(1.), band_(0.) {}
+
+  /**
+   * @brief Rasterizes the polygons
+   *
+   * @param outlines Polygons of size (N, 2) each
+   * @param min_x Lower x-bound of the grid
+   * @param min_y Lower y-bound of the grid
+   * @param max_x Upper x-bound of the grid
+   * @param max_y Upper y-bound of the grid
+   * @param resolution Distance of the grid points
+   * @param band Distances are exact up to the band and clamped beyond
+   */
+  void Build(const std::vector<Matrix_t<double>>& outlines,
+             double min_x,
+             double min_y,
+             double max_x,
+             double max_y,
+             double resolution,
+             double band) {
+    min_x_ = min_x;
+    min_y_ = min_y;
+    resolution_ = resolution;
+    band_ = band;
+    const int nx = std::max(2, static_cast<int>(
+      std::ceil((max_x - min_x) / resolution)) + 1);
+    const int ny = std::max(2, static_cast<int>(
+      std::ceil((max_y - min_y) / resolution)) + 1);
+    field_.setConstant(nx, ny, band);
+    // the interpolation also reads the neighbouring grid points
+    const double reach = band + 2.*resolution;
+    for (const Matrix_t<double>& outline : outlines) {
+      const OutlineEdges edges(outline);
+      const int x0 = std::max(0, Index(outline.col(0).minCoeff() - reach,
+                                       min_x_));
+      const int y0 = std::max(0, Index(outline.col(1).minCoeff() - reach,
+                                       min_y_));
+      const int x1 = std::min(nx - 1, Index(outline.col(0).maxCoeff() + reach,
+                                            min_x_) + 1);
+      const int y1 = std::min(ny - 1, Index(outline.col(1).maxCoeff() + reach,
+                                            min_y_) + 1);
+      for (int ix = x0; ix <= x1; ix++) {
+        for (int iy = y0; iy <= y1; iy++) {
+          const double dist = edges.SignedDistance(min_x_ + ix*resolution_,
+                                                   min_y_ + iy*resolution_);
+          field_(ix, iy) = std::min(field_(ix, iy), std::min(dist, band_));
+        }
+      }
+    }
+  }
+
+  bool Empty() const { return field_.size() == 0; }
+  double Band() const { return band_; }
+  const Matrix_t<double>& Field() const { return field_; }
+
+  /**
+   * @brief Interpolated signed distance; points outside of the grid are
+   * treated as being at least the band width away
+   *
+   * @tparam T Type of data (e.g. a ceres::Jet)
+   */
+  template<typename T>
+  T Evaluate(const T& x, const T& y) const {
+    const T u = (x - T(min_x_)) / resolution_;
+    const T v = (y - T(min_y_)) / resolution_;
+    const double u_value = ScalarValue(u);
+    const double v_value = ScalarValue(v);
+    const int nx = field_.rows();
+    const int ny = field_.cols();
+    if (Empty() || !(u_value >= 0. && v_value >= 0. &&
+                     u_value <= nx - 1 && v_value <= ny - 1))
+      return T(band_);
+    const int ix = std::min(static_cast<int>(u_value), nx - 2);
+    const int iy = std::min(static_cast<int>(v_value), ny - 2);
+    T wx[4], wy[4];
+    CatmullRom<T>(u - T(ix), wx);
+    CatmullRom<T>(v - T(iy), wy);
+    T value = T(0.);
+    for (int i = 0; i < 4; i++) {
+      const int gx = std::min(std::max(ix + i - 1, 0), nx - 1);
+      T column = T(0.);
+      for (int j = 0; j < 4; j++) {
+        const int gy = std::min(std::max(iy + j - 1, 0), ny - 1);
+        column += wy[j]*field_(gx, gy);
+      }
+      value += wx[i]*column;
+    }
+    return value;
+  }
+
+ private:
+  int Index(double coordinate, double min) const {
+    return static_cast<int>(std::floor((coordinate - min) / resolution_));
+  }
+
+  //! weights of the points -1, 0, 1 and 2 at the position t in [0, 1]
+  template<typename T>
+  static void CatmullRom(const T& t, T* w) {
+    const T t2 = t*t;
+    const T t3 = t2*t;
+    w[0] = T(0.5)*(-t3 + T(2.)*t2 - t);
+    w[1] = T(0.5)*(T(3.)*t3 - T(5.)*t2 + T(2.));
+    w[2] = T(0.5)*(T(-3.)*t3 + T(4.)*t2 + t);
+    w[3] = T(0.5)*(t3 - t2);
+  }
+
+  double min_x_;
+  double min_y_;
+  double resolution_;
+  double band_;
+  //! signed distance at (min_x + ix*resolution, min_y + iy*resolution)
+  Matrix_t<double> field_;
+};
+
+}  // namespace geometry
@@ -0,0 +1,556 @@
+// Copyright (c) 2019 Patrick Hart
+//
+// This work is licensed under the terms of the MIT license.
+// For a copy, see <https://opensource.org/licenses/MIT>.
+
+#pragma once
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <ceres/ceres.h>
+#include <Eigen/Dense>
+#include "src/commons/parameters.h"
+#include "src/geometry/geometry.h"
+#include "src/dynamics/dynamics.h"
+#include "src/functors/dynamic_functor.h"
+#include "src/functors/multiple_shooting_functor.h"
+
+namespace optimizer {
+
+using commons::Parameter;
+using commons::ParameterPtr;
+using geometry::Matrix_t;
+using ceres::DynamicAutoDiffCostFunction;
+using std::vector;
+
+typedef Eigen::Matrix<double,
+                      Eigen::Dynamic,
+                      Eigen::Dynamic,
+                      Eigen::RowMajor> RowMatrix_t;
+
+/**
+ * @brief Base class of the solvers that exploit the stage-wise structure
+ * of the single shooting problem instead of using ceres
+ *
+ */
+class BaseStagewiseSolver {
+ public:
+  virtual ~BaseStagewiseSolver() {}
+
+  /**
+   * @brief Optimizes the inputs; the relevant settings (iterations,
+   * tolerances and callbacks) are taken from the ceres options
+   *
+   * @param options Solver options
+   * @param inputs Initial guess and result
+   * @param summary Filled like by ceres::Solve
+   */
+  virtual void Solve(const ceres::Solver::Options& options,
+                     Matrix_t<double>* inputs,
+                     ceres::Solver::Summary* summary) = 0;
+
+  //! keeps the inputs in [start, end) at their current values
+  virtual void FixInputs(int start, int end) = 0;
+};
+
+/**
+ * @brief Next state of the model as residual; used to linearize models
+ * that do not provide analytic Jacobians
+ *
+ * @tparam M Used model (e.g. SingleTrackModel)
+ * @tparam I Used integration method (e.g. Explicit Euler)
+ */
+template<class M, class I>
+class StepFunctor {
+ public:
+  StepFunctor(const ParameterPtr& params, int state_size, int input_size) :
+    model_params_(M::Compile(*params)),
+    state_size_(state_size),
+    input_size_(input_size) {}
+
+  template<typename T>
+  bool operator()(T const* const* parameters,
+                  T* residuals) const {
+    Eigen::Map<const Eigen::Matrix<T, 1, Eigen::Dynamic>> state(
+      parameters[0], state_size_);
+    Eigen::Map<const Eigen::Matrix<T, 1, Eigen::Dynamic>> input(
+      parameters[1], input_size_);
+    auto next_state = dynamics::ModelStep<T, M, I>(state,
+                                                   input,
+                                                   model_params_);
+    for (int i = 0; i < state_size_; i++)
+      residuals[i] = next_state(i);
+    return true;
+  }
+
+ private:
+  typename M::Params model_params_;
+  int state_size_;
+  int input_size_;
+};
+
+/**
+ * @brief Iterative LQR (Gauss-Newton DDP) solver for the single shooting
+ * problem of a DynamicFunctor
+ *
+ * The residuals are split into stages like in the multiple shooting
+ * formulation (StageFunctor) and linearized per stage. A backward Riccati
+ * pass and a forward rollout with line search then cost O(N) per
+ * iteration instead of the dense O(N^3) steps of the ceres path. Costs
+ * that couple consecutive states (e.g. the JerkCost) are handled by
+ * lifting the state with the previous StageWindow() - 1 states, so that
+ * every stage only depends on the lifted state and the input.
+ *
+ * @tparam M Used model (e.g. SingleTrackModel)
+ * @tparam I Used integration method (e.g. Explicit Euler)
+ * @tparam N Stride used for the AutoDiff
+ * @tparam P Cost types the functor can evaluate
+ */
+template<class M, class I, int N = 10, class P = DefaultCostPack>
+class IterativeLQR : public BaseStagewiseSolver {
+ public:
+  //! takes the ownership of the functor
+  explicit IterativeLQR(DynamicFunctor<M, I, P>* functor) :
+    functor_(functor),
+    params_(functor->params_ ? functor->params_
+                             : std::make_shared<Parameter>()),
+    mu_init_(params_->get<double>("ilqr_regularization", 1e-6)),
+    mu_max_(params_->get<double>("ilqr_max_regularization", 1e10)) {}
+
+  void FixInputs(int start, int end) override {
+    if (static_cast<int>(fixed_.size()) < end)
+      fixed_.resize(end, false);
+    for (int i = start; i < end; i++)
+      fixed_[i] = true;
+  }
+
+  void Solve(const ceres::Solver::Options& options,
+             Matrix_t<double>* inputs,
+             ceres::Solver::Summary* summary) override {
+    auto start = std::chrono::steady_clock::now();
+    Setup(inputs->rows(), inputs->cols());
+    u_ = *inputs;
+    double cost = Rollout(u_, &x_);
+    summary->iterations.clear();
+    summary->initial_cost = cost;
+    summary->num_successful_steps = 0;
+    summary->num_unsuccessful_steps = 0;
+    summary->termination_type = ceres::NO_CONVERGENCE;
+    summary->message = "Maximum number of iterations reached.";
+    double mu = mu_init_;
+    auto iteration_start = start;
+    for (int iteration = 0; iteration < options.max_num_iterations;
+         iteration++) {
+      Linearize();
+      double gradient_norm = 0., expected_1 = 0., expected_2 = 0.;
+      bool valid = BackwardPass(mu, &gradient_norm, &expected_1,
+                                &expected_2);
+      while (!valid && mu < mu_max_) {
+        mu *= 10.;
+        valid = BackwardPass(mu, &gradient_norm, &expected_1, &expected_2);
+      }
+      if (!valid) {
+        summary->termination_type = ceres::FAILURE;
+        summary->message = "Q_uu is not positive definite.";
+        break;
+      }
+
+      ceres::IterationSummary iteration_summary;
+      iteration_summary.iteration = iteration + 1;
+      iteration_summary.gradient_norm = gradient_norm;
+      iteration_summary.gradient_max_norm = gradient_norm;
+      if (gradient_norm <= options.gradient_tolerance) {
+        summary->termination_type = ceres::CONVERGENCE;
+        summary->message = "Gradient tolerance reached.";
+        break;
+      }
+
+      // forward pass with backtracking line search
+      double alpha = 1.;
+      bool accepted = false;
+      double new_cost = cost;
+      int line_search_evaluations = 0;
+      for (int i = 0; i < 10 && !accepted; i++, alpha *= 0.5) {
+        new_cost = ForwardPass(alpha);
+        line_search_evaluations++;
+        const double expected = -alpha*(expected_1 + alpha*expected_2);
+        accepted = new_cost < cost &&
+                   (expected <= 0. || (cost - new_cost) > 1e-4*expected);
+      }
+      alpha *= 2.;
+
+      iteration_summary.line_search_function_evaluations =
+        line_search_evaluations;
+      if (accepted) {
+        iteration_summary.step_is_successful = true;
+        iteration_summary.cost_change = cost - new_cost;
+        iteration_summary.step_size = alpha;
+        iteration_summary.step_norm = (u_new_ - u_).norm();
+        u_ = u_new_;
+        x_ = x_new_;
+        summary->num_successful_steps++;
+        mu = std::max(mu / 10., mu_init_);
+      } else {
+        summary->num_unsuccessful_steps++;
+        mu *= 10.;
+      }
+      const double previous_cost = cost;
+      cost = accepted ? new_cost : cost;
+      iteration_summary.cost = cost;
+      auto now = std::chrono::steady_clock::now();
+      iteration_summary.iteration_time_in_seconds =
+        std::chrono::duration<double>(now - iteration_start).count();
+      iteration_summary.cumulative_time_in_seconds =
+        std::chrono::duration<double>(now - start).count();
+      iteration_start = now;
+      summary->iterations.push_back(iteration_summary);
+
+      // like ceres, the first callback that stops the solver skips the rest
+      bool terminate = false;
+      for (ceres::IterationCallback* callback : options.callbacks) {
+        if (terminate)
+          break;
+        ceres::CallbackReturnType ret = (*callback)(iteration_summary);
+        if (ret == ceres::SOLVER_TERMINATE_SUCCESSFULLY) {
+          summary->termination_type = ceres::USER_SUCCESS;
+          summary->message = "User callback returned SOLVER_TERMINATE_SUCCESSFULLY.";  // NOLINT
+          terminate = true;
+        } else if (ret == ceres::SOLVER_ABORT) {
+          summary->termination_type = ceres::USER_FAILURE;
+          summary->message = "User callback returned SOLVER_ABORT.";
+          terminate = true;
+        }
+      }
+      if (terminate)
+        break;
+      if (accepted && previous_cost - cost <=
+          options.function_tolerance*previous_cost) {
+        summary->termination_type = ceres::CONVERGENCE;
+        summary->message = "Function tolerance reached.";
+        break;
+      }
+      if (mu >= mu_max_) {
+        summary->termination_type = ceres::FAILURE;
+        summary->message = "Regularization exceeded its maximum.";
+        break;
+      }
+    }
+    summary->final_cost = cost;
+    summary->total_time_in_seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+    *inputs = u_;
+  }
+
+ private:
+  //! creates the stage functors for the horizon
+  void Setup(int num_inputs, int input_size) {
+    if (num_inputs_ == num_inputs && input_size_ == input_size)
+      return;
+    num_inputs_ = num_inputs;
+    input_size_ = input_size;
+    num_initial_states_ = functor_->GetInitialStates().rows();
+    state_size_ = functor_->GetInitialStates().cols();
+
+    int max_window = 1;
+    for (const auto& cost : functor_->costs_)
+      max_window = std::max(max_window, cost->StageWindow());
+    lifted_rows_ = std::max(max_window - 1, 1);
+    const int lifted_size = lifted_rows_*state_size_;
+
+    stages_.clear();
+    window_rows_.clear();
+    for (int k = num_initial_states_; k < num_initial_states_ + num_inputs;
+         k++) {
+      const int window_rows = std::min(max_window, k + 1);
+      StageFunctor<M, P>* stage = new StageFunctor<M, P>(params_,
+                                                         k,
+                                                         window_rows,
+                                                         state_size_,
+                                                         input_size_);
+      for (auto& cost : functor_->costs_)
+        stage->AddCost(cost);
+      stage->FreezeLayout();
+      DynamicAutoDiffCostFunction<StageFunctor<M, P>, N>* stage_cost =
+        new DynamicAutoDiffCostFunction<StageFunctor<M, P>, N>(stage);
+      for (int i = 0; i < window_rows; i++)
+        stage_cost->AddParameterBlock(state_size_);
+      stage_cost->AddParameterBlock(input_size_);
+      stage_cost->SetNumResiduals(stage->NumResiduals());
+      stages_.emplace_back(stage_cost);
+      window_rows_.push_back(window_rows);
+    }
+    if constexpr (!dynamics::HasStepJacobian<M>::value ||
+                  !dynamics::HasLinearize<I>::value) {
+      DynamicAutoDiffCostFunction<StepFunctor<M, I>, N>* step =
+        new DynamicAutoDiffCostFunction<StepFunctor<M, I>, N>(
+          new StepFunctor<M, I>(params_, state_size_, input_size_));
+      step->AddParameterBlock(state_size_);
+      step->AddParameterBlock(input_size_);
+      step->SetNumResiduals(state_size_);
+      step_.reset(step);
+    }
+    if (static_cast<int>(fixed_.size()) < num_inputs)
+      fixed_.resize(num_inputs, false);
+
+    A_.assign(num_inputs, Matrix_t<double>::Zero(lifted_size, lifted_size));
+    B_.assign(num_inputs,
+              Matrix_t<double>::Zero(lifted_size, input_size_));
+    for (int t = 0; t < num_inputs; t++) {
+      // the lifted state shifts the previous states down
+      for (int i = 1; i < lifted_rows_; i++) {
+        A_[t].block(i*state_size_, (i-1)*state_size_,
+                    state_size_, state_size_).setIdentity();
+      }
+    }
+    lz_.assign(num_inputs, Eigen::VectorXd());
+    lzz_.assign(num_inputs, Matrix_t<double>());
+    lu_.assign(num_inputs, Eigen::VectorXd());
+    luu_.assign(num_inputs, Matrix_t<double>());
+    luz_.assign(num_inputs, Matrix_t<double>());
+    k_.assign(num_inputs, Eigen::VectorXd());
+    K_.assign(num_inputs, Matrix_t<double>());
+  }
+
+  //! trajectory row the input t is applied to
+  int Row(int t) const { return num_initial_states_ - 1 + t; }
+
+  /**
+   * @brief Generates the trajectory of the inputs and evaluates the
+   * stage costs
+   *
+   * @param inputs Inputs
+   * @param trajectory Resulting trajectory
+   * @return double Cost (0.5 * squared residuals like in ceres)
+   */
+  double Rollout(const RowMatrix_t& inputs, RowMatrix_t* trajectory) {
+    auto start = functor_->Now();
+    trajectory->resize(num_initial_states_ + num_inputs_, state_size_);
+    trajectory->topRows(num_initial_states_) = functor_->GetInitialStates();
+    for (int t = 0; t < num_inputs_; t++) {
+      trajectory->row(Row(t) + 1) = dynamics::ModelStep<double, M, I>(
+        trajectory->row(Row(t)),
+        inputs.row(t),
+        functor_->GetModelParams());
+    }
+    return StageCosts(*trajectory, inputs, start);
+  }
+
+  //! sum of the stage costs; start is the beginning of the rollout
+  double StageCosts(const RowMatrix_t& trajectory,
+                    const RowMatrix_t& inputs,
+                    const std::chrono::steady_clock::time_point& start) {
+    auto rollout_end = functor_->Now();
+    double cost = 0.;
+    vector<const double*> blocks;
+    for (int t = 0; t < num_inputs_; t++) {
+      StageBlocks(trajectory, inputs, t, &blocks);
+      residuals_.resize(stages_[t]->num_residuals());
+      stages_[t]->Evaluate(blocks.data(), residuals_.data(), nullptr);
+      cost += 0.5*residuals_.squaredNorm();
+    }
+    functor_->AddEvaluationTime(start,
+                                rollout_end,
+                                functor_->Now());
+    return cost;
+  }
+
+  //! window states and input of the stage after input t
+  void StageBlocks(const RowMatrix_t& trajectory,
+                   const RowMatrix_t& inputs,
+                   int t,
+                   vector<const double*>* blocks) const {
+    blocks->clear();
+    const int row = Row(t) + 1;
+    for (int i = row - window_rows_[t] + 1; i <= row; i++)
+      blocks->push_back(trajectory.row(i).data());
+    blocks->push_back(inputs.row(t).data());
+  }
+
+  /**
+   * @brief Linearizes the dynamics of the lifted state
+   * z_t = (x_t, x_{t-1}, ..) and expands the stage costs in (z_t, u_t)
+   * using Gauss-Newton
+   *
+   */
+  void Linearize() {
+    const int lifted_size = lifted_rows_*state_size_;
+    Matrix_t<double> jac_state, jac_input;
+    vector<const double*> blocks;
+    vector<double*> jacobian_ptrs;
+    for (int t = 0; t < num_inputs_; t++) {
+      Matrix_t<double> state = x_.row(Row(t));
+      Matrix_t<double> input = u_.row(t);
+      if constexpr (dynamics::HasStepJacobian<M>::value &&
+                    dynamics::HasLinearize<I>::value) {
+        M::template StepJacobian<I>(state,
+                                    input,
+                                    functor_->GetModelParams(),
+                                    &jac_state,
+                                    &jac_input);
+      } else {
+        RowMatrix_t step_state(state_size_, state_size_);
+        RowMatrix_t step_input(state_size_, input_size_);
+        double* step_jacobians[2] = {step_state.data(), step_input.data()};
+        const double* step_blocks[2] = {state.data(), input.data()};
+        residuals_.resize(state_size_);
+        step_->Evaluate(step_blocks, residuals_.data(), step_jacobians);
+        jac_state = step_state;
+        jac_input = step_input;
+      }
+      A_[t].topLeftCorner(state_size_, state_size_) = jac_state;
+      B_[t].topRows(state_size_) = jac_input;
+
+      // stage after input t
+      const int window_rows = window_rows_[t];
+      const int num_residuals = stages_[t]->num_residuals();
+      lz_[t].setZero(lifted_size);
+      lzz_[t].setZero(lifted_size, lifted_size);
+      lu_[t].setZero(input_size_);
+      luu_[t].setZero(input_size_, input_size_);
+      luz_[t].setZero(input_size_, lifted_size);
+      if (num_residuals == 0)
+        continue;
+      StageBlocks(x_, u_, t, &blocks);
+      jacobians_.resize(window_rows + 1);
+      jacobian_ptrs.clear();
+      for (int i = 0; i < window_rows; i++) {
+        jacobians_[i].resize(num_residuals, state_size_);
+        jacobian_ptrs.push_back(jacobians_[i].data());
+      }
+      jacobians_[window_rows].resize(num_residuals, input_size_);
+      jacobian_ptrs.push_back(jacobians_[window_rows].data());
+      residuals_.resize(num_residuals);
+      stages_[t]->Evaluate(blocks.data(),
+                           residuals_.data(),
+                           jacobian_ptrs.data());
+
+      // chain rule: the newest state is the step of (z_t, u_t), the
+      // older ones are part of z_t
+      const RowMatrix_t& jac_new = jacobians_[window_rows - 1];
+      Matrix_t<double> jac_z = jac_new*A_[t].topRows(state_size_);
+      Matrix_t<double> jac_u = jacobians_[window_rows] + jac_new*jac_input;
+      for (int i = 0; i < window_rows - 1; i++) {
+        const int lifted_row = window_rows - 2 - i;
+        jac_z.middleCols(lifted_row*state_size_, state_size_) +=
+          jacobians_[i];
+      }
+      lz_[t] = jac_z.transpose()*residuals_;
+      lzz_[t] = jac_z.transpose()*jac_z;
+      lu_[t] = jac_u.transpose()*residuals_;
+      luu_[t] = jac_u.transpose()*jac_u;
+      luz_[t] = jac_u.transpose()*jac_z;
+    }
+  }
+
+  /**
+   * @brief Riccati recursion computing the feedforward and feedback terms
+   *
+   * @param mu Regularization of Q_uu
+   * @param gradient_norm Norm of the cost gradient w.r.t. the inputs
+   * @param expected_1 Expected linear cost change for a full step
+   * @param expected_2 Expected quadratic cost change for a full step
+   * @return true If all Q_uu were positive definite
+   */
+  bool BackwardPass(double mu,
+                    double* gradient_norm,
+                    double* expected_1,
+                    double* expected_2) {
+    const int lifted_size = lifted_rows_*state_size_;
+    Eigen::VectorXd V_z = Eigen::VectorXd::Zero(lifted_size);
+    Matrix_t<double> V_zz = Matrix_t<double>::Zero(lifted_size, lifted_size);
+    // costate of the unregularized problem (exact gradient)
+    Eigen::VectorXd lambda = Eigen::VectorXd::Zero(lifted_size);
+    double squared_gradient = 0.;
+    *expected_1 = 0.;
+    *expected_2 = 0.;
+    for (int t = num_inputs_ - 1; t >= 0; t--) {
+      const Matrix_t<double>& A = A_[t];
+      const Matrix_t<double>& B = B_[t];
+      if (!fixed_[t])
+        squared_gradient += (lu_[t] + B.transpose()*lambda).squaredNorm();
+      lambda = lz_[t] + A.transpose()*lambda;
+
+      const Eigen::VectorXd Q_z = lz_[t] + A.transpose()*V_z;
+      const Eigen::VectorXd Q_u = lu_[t] + B.transpose()*V_z;
+      const Matrix_t<double> V_zz_A = V_zz*A;
+      const Matrix_t<double> Q_zz = lzz_[t] + A.transpose()*V_zz_A;
+      const Matrix_t<double> Q_uu = luu_[t] + B.transpose()*V_zz*B;
+      const Matrix_t<double> Q_uz = luz_[t] + B.transpose()*V_zz_A;
+
+      if (fixed_[t]) {
+        k_[t].setZero(input_size_);
+        K_[t].setZero(input_size_, lifted_size);
+      } else {
+        Matrix_t<double> Q_uu_reg = Q_uu;
+        Q_uu_reg.diagonal().array() += mu;
+        Eigen::LLT<Matrix_t<double>> llt(Q_uu_reg);
+        if (llt.info() != Eigen::Success)
+          return false;
+        k_[t] = -llt.solve(Q_u);
+        K_[t] = -llt.solve(Q_uz);
+      }
+      const Eigen::VectorXd& k = k_[t];
+      const Matrix_t<double>& K = K_[t];
+      *expected_1 += k.dot(Q_u);
+      *expected_2 += 0.5*k.dot(Q_uu*k);
+      V_z = Q_z + K.transpose()*Q_uu*k + K.transpose()*Q_u +
+            Q_uz.transpose()*k;
+      V_zz = Q_zz + K.transpose()*Q_uu*K + K.transpose()*Q_uz +
+             Q_uz.transpose()*K;
+      V_zz = 0.5*(V_zz + V_zz.transpose());
+    }
+    *gradient_norm = std::sqrt(squared_gradient);
+    return true;
+  }
+
+  //! closed-loop rollout of the new control law
+  double ForwardPass(double alpha) {
+    auto start = functor_->Now();
+    u_new_.resize(num_inputs_, input_size_);
+    x_new_.resize(x_.rows(), x_.cols());
+    x_new_.topRows(num_initial_states_) = x_.topRows(num_initial_states_);
+    for (int t = 0; t < num_inputs_; t++) {
+      // deviation of the lifted state
+      Eigen::VectorXd dz = Eigen::VectorXd::Zero(lifted_rows_*state_size_);
+      for (int i = 0; i < lifted_rows_ && Row(t) - i >= 0; i++) {
+        dz.segment(i*state_size_, state_size_) =
+          (x_new_.row(Row(t) - i) - x_.row(Row(t) - i)).transpose();
+      }
+      u_new_.row(t) = u_.row(t) +
+                      (alpha*k_[t] + K_[t]*dz).transpose();
+      x_new_.row(Row(t) + 1) = dynamics::ModelStep<double, M, I>(
+        x_new_.row(Row(t)),
+        u_new_.row(t),
+        functor_->GetModelParams());
+    }
+    return StageCosts(x_new_, u_new_, start);
+  }
+
+  std::unique_ptr<DynamicFunctor<M, I, P>> functor_;
+  ParameterPtr params_;
+  double mu_init_;
+  double mu_max_;
+
+  int num_inputs_ = 0;
+  int input_size_ = 0;
+  int state_size_ = 0;
+  int num_initial_states_ = 0;
+  int lifted_rows_ = 1;
+  vector<std::unique_ptr<ceres::CostFunction>> stages_;
+  vector<int> window_rows_;
+  std::unique_ptr<ceres::CostFunction> step_;
+  vector<bool> fixed_;
+
+  // current and candidate iterate
+  RowMatrix_t x_, u_, x_new_, u_new_;
+  // linearization in the lifted state
+  vector<Matrix_t<double>> A_, B_, lzz_, luu_, luz_, K_;
+  vector<Eigen::VectorXd> lz_, lu_, k_;
+  vector<RowMatrix_t> jacobians_;
+  Eigen::VectorXd residuals_;
+};
+
+}  // namespace optimizer
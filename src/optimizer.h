@@ -6,12 +6,19 @@
 
 #pragma once
 #include <vector>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
 #include <ceres/ceres.h>
 #include "src/commons/parameters.h"
 #include "src/geometry/geometry.h"
 #include "src/functors/base_functor.h"
 #include "src/functors/costs/base_cost.h"
 #include "src/functors/dynamic_functor.h"
+#include "src/functors/analytic_cost_function.h"
+#include "src/functors/multiple_shooting_functor.h"
+#include "src/callbacks.h"
+#include "src/ilqr.h"
 
 namespace optimizer {
 
@@ -23,6 +30,15 @@ using std::vector;
 using ceres::DynamicAutoDiffCostFunction;
 using ceres::LossFunction;
 using ceres::TrivialLoss;
+using std::string;
+
+//! why the last Solve() stopped
+enum class SolveStatus {
+  CONVERGED = 0,
+  NO_CONVERGENCE = 1,
+  TIME_BUDGET_EXCEEDED = 2,
+  FAILURE = 3
+};
 
 /**
  * @brief Main optimization class
@@ -31,21 +47,45 @@ using ceres::TrivialLoss;
 class Optimizer {
  public:
   explicit Optimizer(const ParameterPtr& params) :
-    optimization_vectors_(),
-    parameter_block_(),
+    params_(params),
     problem_(),
     options_(),
-    params_(params),
-    optimization_vector_len_(0) {
+    parameter_block_(),
+    optimization_vectors_(),
+    optimization_vector_len_(0),
+    multiple_shooting_(false),
+    num_initial_states_(0),
+    time_budget_ms_(params->get<double>("time_budget_ms", 0.)),
+    status_(SolveStatus::NO_CONVERGENCE),
+    record_iterations_(params->get<bool>("record_iterations", false)),
+    iteration_log_file_(params->get<string>("iteration_log_file", "")),
+    solver_type_(params->get<string>("solver_type", "ceres")) {
       options_.max_num_consecutive_invalid_steps =
         params->get<int>("max_num_consecutive_invalid_steps", 50);
       options_.max_num_iterations =
         params->get<int>("max_num_iterations", 1000);
-      options_.minimizer_type = ceres::MinimizerType::LINE_SEARCH;
       options_.function_tolerance =
         params->get<double>("function_tolerance", 1e-8);
-      options_.line_search_direction_type =
-        ceres::LineSearchDirectionType::BFGS;
+      // the residuals are per timestep and component, so besides the
+      // line search also the trust region (Gauss-Newton) methods can be used
+      if (params->get<string>("minimizer_type", "line_search") ==
+          "trust_region") {
+        options_.minimizer_type = ceres::MinimizerType::TRUST_REGION;
+        options_.trust_region_strategy_type =
+          params->get<string>("trust_region_strategy_type",
+                              "levenberg_marquardt") == "dogleg" ?
+          ceres::TrustRegionStrategyType::DOGLEG :
+          ceres::TrustRegionStrategyType::LEVENBERG_MARQUARDT;
+      } else {
+        options_.minimizer_type = ceres::MinimizerType::LINE_SEARCH;
+        options_.line_search_direction_type =
+          ceres::LineSearchDirectionType::BFGS;
+      }
+      // ceres' default unless set; see AddMultipleShootingFunctors
+      const string linear_solver =
+        params->get<string>("linear_solver_type", "");
+      if (!linear_solver.empty())
+        options_.linear_solver_type = LinearSolverType(linear_solver);
       options_.minimizer_progress_to_stdout =
         params->get<bool>("minimizer_progress_to_stdout", false);
       options_.num_threads =
@@ -74,28 +114,161 @@ class Optimizer {
   }
 
   /**
-   * @brief Adds a residual block to the optimization problem
+   * @brief Adds a residual block to the optimization problem; the number of
+   * residuals is determined by the costs of the functor
+   * 
+   * If the functor has analytic Jacobians enabled (and its model provides
+   * them) the rollout is differentiated analytically, otherwise AutoDiff
+   * is used. With the solver_type "ilqr" the functor is solved by the
+   * stage-wise IterativeLQR instead of ceres (one functor only).
    * 
    * @tclass F The functor that shall be used, such as the DynamicFunctor 
    * @tparam 4 Stride used for the AutoDiff
    * @param functor Pointer to the used functor
-   * @param num_residuals amount of residuals within the functor
    */
   template<class F, int N = 60>
-  void AddResidualBlock(BaseFunctor* functor, int num_residuals = 1) {
+  void AddResidualBlock(BaseFunctor* functor) {
     // assert(optimization_vectors_.size() == 0,
     //        "You need to provide the optimization vector first.");
-    DynamicAutoDiffCostFunction<F, N>* ceres_functor =
-      new DynamicAutoDiffCostFunction<F, N>(dynamic_cast<F*>(functor));
-    for (vector<double>& vec : optimization_vectors_) {
-      ceres_functor->AddParameterBlock(optimization_vector_len_);
-    }
     functor->SetOptVecLen(optimization_vector_len_);
     functor->SetParamCount(parameter_block_.size());
-    ceres_functor->SetNumResiduals(num_residuals);
-    problem_.AddResidualBlock(ceres_functor,
-                              new ceres::TrivialLoss(),
-                              parameter_block_);
+    functor->Compile();
+    if (solver_type_ == "ilqr") {
+      // the stages need consecutive trajectories
+      F* dynamic_functor = dynamic_cast<F*>(functor);
+      if (stagewise_solver_ || dynamic_functor->GetModelParams().is_static) {
+        std::unique_ptr<BaseFunctor> rejected(functor);
+        throw std::invalid_argument(
+          "The iLQR solver optimizes a single functor of a state space "
+          "model; add only one and do not set static.");
+      }
+      functors_.push_back(functor);
+      stagewise_solver_.reset(
+        new IterativeLQR<typename F::Model,
+                         typename F::Integrator,
+                         10,
+                         typename F::Costs>(dynamic_functor));
+      return;
+    }
+    if constexpr (F::kHasAnalyticJacobians) {
+      if (functor->GetAnalyticJacobians()) {
+        AddCostFunction(
+          new AnalyticDynamicCostFunction<F, N>(dynamic_cast<F*>(functor)),
+          functor);
+        return;
+      }
+    }
+    AddCostFunction(
+      new DynamicAutoDiffCostFunction<F, N>(dynamic_cast<F*>(functor)),
+      functor);
+  }
+
+  /**
+   * @brief Formulates the problem using multiple shooting: the states are
+   * decision variables as well and continuity residuals link consecutive
+   * steps. Every stage has its own parameter and residual blocks which
+   * makes the problem block-sparse and lets ceres evaluate the stages in
+   * parallel. The optimization vector needs to be set beforehand; its
+   * rollout is used as initial guess for the states.
+   * 
+   * @tclass M Used model (e.g. SingleTrackModel)
+   * @tclass I Used integration method (e.g. Explicit Euler)
+   * @tparam N Stride used for the AutoDiff
+   * @tclass P Cost types the stages can evaluate
+   * @param initial_states Initial states of the trajectory (fixed)
+   * @param params Parameter class
+   * @param costs Cost terms (such as JerkCost, etc.)
+   */
+  template<class M, class I, int N = 10, class P = DefaultCostPack>
+  void AddMultipleShootingFunctors(const Matrix_t<double>& initial_states,
+                                   const ParameterPtr& params,
+                                   const std::vector<BaseCostPtr>& costs) {
+    // the stage buffers are registered with the problem
+    if (multiple_shooting_)
+      throw std::invalid_argument(
+        "The multiple shooting functors can only be added once.");
+    if (M::Compile(*params).is_static)
+      throw std::invalid_argument(
+        "Multiple shooting needs a state space model (static is set).");
+    Matrix_t<double> inputs = this->Result();
+    Matrix_t<double> trajectory =
+      dynamics::GenerateDynamicTrajectory<double, M, I>(initial_states,
+                                                        inputs,
+                                                        params.get());
+    const int state_size = trajectory.cols();
+    const int input_size = inputs.cols();
+    num_initial_states_ = initial_states.rows();
+    multiple_shooting_ = true;
+    // the stages make the problem block-sparse
+    if (params_->get<string>("linear_solver_type", "").empty())
+      options_.linear_solver_type = ceres::SPARSE_NORMAL_CHOLESKY;
+    stage_states_.clear();
+    stage_inputs_.clear();
+    for (int i = 0; i < trajectory.rows(); i++) {
+      stage_states_.emplace_back(state_size, 0.);
+      for (int j = 0; j < state_size; j++)
+        stage_states_[i][j] = trajectory(i, j);
+    }
+    for (int i = 0; i < inputs.rows(); i++) {
+      stage_inputs_.emplace_back(input_size, 0.);
+      for (int j = 0; j < input_size; j++)
+        stage_inputs_[i][j] = inputs(i, j);
+    }
+    for (int i = 0; i < num_initial_states_; i++) {
+      problem_.AddParameterBlock(stage_states_[i].data(), state_size);
+      problem_.SetParameterBlockConstant(stage_states_[i].data());
+    }
+
+    int max_window = 1;
+    for (const auto& cost : costs) {
+      cost->Compile(trajectory.rows());
+      max_window = std::max(max_window, cost->StageWindow());
+    }
+
+    for (int k = num_initial_states_; k < trajectory.rows(); k++) {
+      double* input = stage_inputs_[k - num_initial_states_].data();
+      // continuity between stage k-1 and k
+      DynamicAutoDiffCostFunction<ContinuityFunctor<M, I>, N>* continuity =
+        new DynamicAutoDiffCostFunction<ContinuityFunctor<M, I>, N>(
+          new ContinuityFunctor<M, I>(params, state_size, input_size));
+      continuity->AddParameterBlock(state_size);
+      continuity->AddParameterBlock(input_size);
+      continuity->AddParameterBlock(state_size);
+      continuity->SetNumResiduals(state_size);
+      problem_.AddResidualBlock(continuity,
+                                new ceres::TrivialLoss(),
+                                vector<double*>{stage_states_[k-1].data(),
+                                                input,
+                                                stage_states_[k].data()});
+
+      // costs of stage k
+      const int window_rows = std::min(max_window, k + 1);
+      StageFunctor<M, P>* stage = new StageFunctor<M, P>(params,
+                                                         k,
+                                                         window_rows,
+                                                         state_size,
+                                                         input_size);
+      for (auto& cost : costs)
+        stage->AddCost(cost);
+      stage->FreezeLayout();
+      if (stage->NumResiduals() == 0) {
+        delete stage;
+        continue;
+      }
+      DynamicAutoDiffCostFunction<StageFunctor<M, P>, N>* stage_cost =
+        new DynamicAutoDiffCostFunction<StageFunctor<M, P>, N>(stage);
+      vector<double*> stage_blocks;
+      for (int i = k - window_rows + 1; i <= k; i++) {
+        stage_cost->AddParameterBlock(state_size);
+        stage_blocks.push_back(stage_states_[i].data());
+      }
+      stage_cost->AddParameterBlock(input_size);
+      stage_blocks.push_back(input);
+      stage_cost->SetNumResiduals(stage->NumResiduals());
+      problem_.AddResidualBlock(stage_cost,
+                                new ceres::TrivialLoss(),
+                                stage_blocks);
+    }
   }
 
   /**
@@ -122,6 +295,15 @@ class Optimizer {
    * @param end Ending index
    */
   void FixOptimizationVector(int start, int end) {
+    if (multiple_shooting_) {
+      for (int i = start; i < end; i++)
+        problem_.SetParameterBlockConstant(stage_inputs_[i].data());
+      return;
+    }
+    if (stagewise_solver_) {
+      stagewise_solver_->FixInputs(start, end);
+      return;
+    }
     vector<int> vec;
     for (int i = start; i < end; i++)
       vec.push_back(i);
@@ -131,12 +313,158 @@ class Optimizer {
         new ceres::SubsetParameterization(optimization_vector_len_, vec));
   }
 
+  /**
+   * @brief Shifts the optimization vector forward by k steps; the freed
+   * rows at the end repeat the last input
+   * 
+   * @param k Amount of steps to shift
+   */
+  void ShiftOptimizationVector(int k) {
+    if (k <= 0 || optimization_vector_len_ == 0)
+      return;
+    if (multiple_shooting_) {
+      const int num_stages = stage_inputs_.size();
+      for (int i = 0; i < num_stages; i++) {
+        stage_inputs_[i] = stage_inputs_[std::min(i + k, num_stages - 1)];
+      }
+      const int num_states = stage_states_.size();
+      for (int i = num_initial_states_; i < num_states; i++) {
+        stage_states_[i] = stage_states_[std::min(i + k, num_states - 1)];
+      }
+      return;
+    }
+    for (vector<double>& vec : optimization_vectors_) {
+      for (int i = 0; i < optimization_vector_len_; i++) {
+        vec[i] = vec[std::min(i + k, optimization_vector_len_ - 1)];
+      }
+    }
+  }
+
+  /**
+   * @brief Sets new initial states for all added functors
+   * 
+   * @param initial_states Initial states (same shape as before)
+   */
+  void SetInitialStates(const Matrix_t<double>& initial_states) {
+    if (multiple_shooting_) {
+      for (int i = 0; i < num_initial_states_; i++) {
+        for (int j = 0; j < initial_states.cols(); j++)
+          stage_states_[i][j] = initial_states(i, j);
+      }
+    }
+    for (BaseFunctor* functor : functors_) {
+      functor->SetInitialStates(initial_states);
+    }
+  }
+
+  /**
+   * @brief Prepares the next receding horizon cycle: the problem and its
+   * residual blocks are kept, the initial states are replaced and the
+   * previous result shifted by k steps is used as initial guess
+   * 
+   * @param initial_states Initial states of the next cycle
+   * @param k Steps the horizon advanced since the last Solve()
+   */
+  void WarmStart(const Matrix_t<double>& initial_states, int k = 1) {
+    this->SetInitialStates(initial_states);
+    this->ShiftOptimizationVector(k);
+  }
+
   /**
    * @brief Solves the formulated optimization problem
    * 
+   * With a time budget (time_budget_ms > 0) the solver stops at the
+   * deadline and keeps the best iterate found so far.
    */
   void Solve() {
-    ceres::Solve(options_, &problem_, &summary_);
+    options_.callbacks.clear();
+    const bool record = record_iterations_ || !iteration_log_file_.empty();
+    for (BaseFunctor* functor : functors_) {
+      functor->CheckLayout();
+      functor->SetRecordTimes(record);
+    }
+    // the recorder comes first, as the solver skips the callbacks after
+    // the deadline once it stops
+    if (record) {
+      iteration_recorder_.Start(&functors_, iteration_log_file_);
+      options_.callbacks.push_back(&iteration_recorder_);
+    }
+    if (time_budget_ms_ > 0.) {
+      options_.max_solver_time_in_seconds = time_budget_ms_ / 1000.;
+      options_.callbacks.push_back(&deadline_callback_);
+    } else {
+      // ceres' default: no limit
+      options_.max_solver_time_in_seconds = 1e9;
+    }
+    deadline_callback_.Start(time_budget_ms_);
+    if (stagewise_solver_) {
+      Matrix_t<double> inputs = this->Result();
+      stagewise_solver_->Solve(options_, &inputs, &summary_);
+      for (int i = 0; i < inputs.rows(); i++) {
+        for (int j = 0; j < inputs.cols(); j++)
+          optimization_vectors_[j][i] = inputs(i, j);
+      }
+    } else {
+      ceres::Solve(options_, &problem_, &summary_);
+    }
+    iteration_recorder_.Stop();
+    if (deadline_callback_.Triggered() || BudgetExhausted()) {
+      status_ = SolveStatus::TIME_BUDGET_EXCEEDED;
+    } else if (summary_.termination_type == ceres::CONVERGENCE ||
+               summary_.termination_type == ceres::USER_SUCCESS) {
+      status_ = SolveStatus::CONVERGED;
+    } else if (summary_.termination_type == ceres::NO_CONVERGENCE) {
+      status_ = SolveStatus::NO_CONVERGENCE;
+    } else {
+      status_ = SolveStatus::FAILURE;
+    }
+  }
+
+  /**
+   * @brief Sets the wall-clock budget of Solve()
+   * 
+   * @param time_budget_ms Budget in milliseconds (<= 0 is unbounded)
+   */
+  void SetTimeBudget(double time_budget_ms) {
+    time_budget_ms_ = time_budget_ms;
+  }
+
+  //! why the last Solve() stopped
+  SolveStatus Status() const { return status_; }
+
+  /**
+   * @brief Enables the per-iteration records of Solve()
+   * 
+   * @param record Whether to record the iterations
+   * @param file Optional CSV (*.csv) or JSON-lines file to stream to
+   */
+  void RecordIterations(bool record, const string& file = "") {
+    record_iterations_ = record;
+    iteration_log_file_ = file;
+  }
+
+  //! records of the last Solve() (cost, gradient norm, timings, ..)
+  const vector<IterationRecord>& IterationRecords() const {
+    return iteration_recorder_.Records();
+  }
+
+  Matrix_t<double> IterationRecordsMatrix() const {
+    return iteration_recorder_.RecordsMatrix();
+  }
+
+  //! rollout cache hits and misses summed over all functors
+  int RolloutCacheHits() const {
+    int hits = 0;
+    for (const BaseFunctor* functor : functors_)
+      hits += functor->GetRolloutCacheHits();
+    return hits;
+  }
+
+  int RolloutCacheMisses() const {
+    int misses = 0;
+    for (const BaseFunctor* functor : functors_)
+      misses += functor->GetRolloutCacheMisses();
+    return misses;
   }
 
   /**
@@ -144,7 +472,16 @@ class Optimizer {
    * 
    * @return Matrix_t<double> Inputs for the dynamic model
    */
-  Matrix_t<double> Result() {
+  Matrix_t<double> Result() const {
+    if (multiple_shooting_) {
+      Matrix_t<double> result(stage_inputs_.size(), parameter_block_.size());
+      for (int i = 0; i < result.rows(); i++) {
+        for (int j = 0; j < result.cols(); j++) {
+          result(i, j) = stage_inputs_[i][j];
+        }
+      }
+      return result;
+    }
     Matrix_t<double> result(optimization_vector_len_,
                             parameter_block_.size());
     for ( int i = 0; i < optimization_vector_len_; i++ ) {
@@ -155,15 +492,84 @@ class Optimizer {
     return result;
   }
 
+  /**
+   * @brief Returns the optimized states of the multiple shooting
+   * formulation (including the initial states)
+   * 
+   * @return Matrix_t<double> Trajectory
+   */
+  Matrix_t<double> States() const {
+    Matrix_t<double> states(stage_states_.size(),
+                            stage_states_.empty() ?
+                            0 : stage_states_[0].size());
+    for (int i = 0; i < states.rows(); i++) {
+      for (int j = 0; j < states.cols(); j++) {
+        states(i, j) = stage_states_[i][j];
+      }
+    }
+    return states;
+  }
+
+  //! threads used by ceres to evaluate the residual blocks
+  void SetNumThreads(int num_threads) {
+    options_.num_threads = num_threads;
+  }
+
+  const ceres::Solver::Summary& Summary() const {
+    return summary_;
+  }
+
+  const ceres::Solver::Options& SolverOptions() const {
+    return options_;
+  }
+
   /**
    * @brief Information about the optimization process
    * 
    */
-  void Report() {
+  void Report() const {
     std::cout << summary_.FullReport() << std::endl;
   }
 
  private:
+  //! linear solver of the name (e.g. "sparse_normal_cholesky")
+  static ceres::LinearSolverType LinearSolverType(const string& name) {
+    if (name == "dense_qr")
+      return ceres::DENSE_QR;
+    if (name == "dense_normal_cholesky")
+      return ceres::DENSE_NORMAL_CHOLESKY;
+    if (name == "sparse_normal_cholesky")
+      return ceres::SPARSE_NORMAL_CHOLESKY;
+    if (name == "dense_schur")
+      return ceres::DENSE_SCHUR;
+    if (name == "sparse_schur")
+      return ceres::SPARSE_SCHUR;
+    if (name == "iterative_schur")
+      return ceres::ITERATIVE_SCHUR;
+    if (name == "cgnr")
+      return ceres::CGNR;
+    throw std::invalid_argument("Unknown linear_solver_type: " + name);
+  }
+
+  //! whether ceres' own max_solver_time_in_seconds ended the last Solve()
+  bool BudgetExhausted() const {
+    return time_budget_ms_ > 0. &&
+      summary_.termination_type == ceres::NO_CONVERGENCE &&
+      summary_.total_time_in_seconds >= time_budget_ms_ / 1000.;
+  }
+
+  template<class C>
+  void AddCostFunction(C* ceres_functor, BaseFunctor* functor) {
+    for (vector<double>& vec : optimization_vectors_) {
+      ceres_functor->AddParameterBlock(optimization_vector_len_);
+    }
+    ceres_functor->SetNumResiduals(functor->NumResiduals());
+    functors_.push_back(functor);
+    problem_.AddResidualBlock(ceres_functor,
+                              new ceres::TrivialLoss(),
+                              parameter_block_);
+  }
+
   ParameterPtr params_;
   ceres::Problem problem_;
   ceres::Solver::Options options_;
@@ -173,6 +579,28 @@ class Optimizer {
   vector<double*> parameter_block_;
   vector<vector<double>> optimization_vectors_;
   int optimization_vector_len_;
+  //! owned by the ceres problem
+  vector<BaseFunctor*> functors_;
+
+  // multiple shooting
+  bool multiple_shooting_;
+  int num_initial_states_;
+  vector<vector<double>> stage_states_;
+  vector<vector<double>> stage_inputs_;
+
+  // anytime solve
+  double time_budget_ms_;
+  DeadlineCallback deadline_callback_;
+  SolveStatus status_;
+
+  // instrumentation
+  bool record_iterations_;
+  string iteration_log_file_;
+  IterationRecorder iteration_recorder_;
+
+  // "ceres" or "ilqr"
+  string solver_type_;
+  std::unique_ptr<BaseStagewiseSolver> stagewise_solver_;
 };
 
 }  // namespace optimizer
@@ -4,6 +4,7 @@
 // For a copy, see <https://opensource.org/licenses/MIT>.
 #include <functional>
 #include <memory>
+#include <chrono>
 #include "gtest/gtest.h"
 #include "src/commons/parameters.h"
 #include "src/dynamics/dynamics.h"
@@ -28,11 +29,13 @@ TEST(dynamics, single_track_model) {
   inp << 0.0, 0.0;  // acceleration and steering angle
 
   SingleTrackModel model;
-  state = model.Step<double, IntegrationRK4>(state, inp, params.get());
+  const SingleTrackModel::Params model_params =
+    SingleTrackModel::Compile(*params);
+  state = model.Step<double, IntegrationRK4>(state, inp, model_params);
   Matrix_t<double> state_after(1, 4);
   state_after << 0.5, 0.0, 0.0, 5.0;  // x, y, theta, v
   ASSERT_EQ(state, state_after);
-  state = model.Step<double, IntegrationEuler>(state, inp, params.get());
+  state = model.Step<double, IntegrationEuler>(state, inp, model_params);
   Matrix_t<double> state_after_again(1, 4);
   state_after_again << 1.0, 0.0, 0.0, 5.0;  // x, y, theta, v
   ASSERT_EQ(state, state_after_again);
@@ -58,9 +61,10 @@ TEST(dynamics, triple_int_model) {
   inp << 1.0, 1.0, 1.0;  // ax, ay, az
 
   TripleIntModel model;
-  state = model.Step<double, IntegrationRK4>(state, inp, params.get());
-  state = model.Step<double, IntegrationRK4>(state, inp, params.get());
-  state = model.Step<double, IntegrationRK4>(state, inp, params.get());
+  const TripleIntModel::Params model_params = TripleIntModel::Compile(*params);
+  state = model.Step<double, IntegrationRK4>(state, inp, model_params);
+  state = model.Step<double, IntegrationRK4>(state, inp, model_params);
+  state = model.Step<double, IntegrationRK4>(state, inp, model_params);
 
   std::cout << state << std::endl;
 }
@@ -84,11 +88,12 @@ TEST(dynamics, robot_arm) {
   inp << .0, .0;  // theta0, theta1
 
   RobotArm model;
-  state = model.Step<double, IntegrationRK4>(state, inp, params.get());
+  const RobotArm::Params model_params = RobotArm::Compile(*params);
+  state = model.Step<double, IntegrationRK4>(state, inp, model_params);
   std::cout << state << std::endl;
 
   inp << 1.54, 1.54;  // theta0, theta1
-  state = model.Step<double, IntegrationRK4>(state, inp, params.get());
+  state = model.Step<double, IntegrationRK4>(state, inp, model_params);
   std::cout << state << std::endl;
 
 
@@ -139,6 +144,325 @@ TEST(dynamics, traj_gen) {
 }
 
 
+TEST(dynamics, fixed_size_states) {
+  using dynamics::SingleTrackModel;
+  using dynamics::TripleIntModel;
+  using dynamics::RobotArm;
+  using dynamics::IntegrationRK4;
+  using dynamics::HasFixedDims;
+  using geometry::Matrix_t;
+  using geometry::State_t;
+  using geometry::Input_t;
+  using commons::Parameter;
+  using commons::ParameterPtr;
+
+  static_assert(HasFixedDims<SingleTrackModel>::value, "");
+  static_assert(HasFixedDims<TripleIntModel>::value, "");
+  static_assert(!HasFixedDims<RobotArm>::value, "");
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.1);
+  const SingleTrackModel::Params model_params =
+    SingleTrackModel::Compile(*params);
+
+  // the dynamically sized fallback matches the fixed-size step
+  State_t<double, 4> state;
+  state << 0.0, 0.0, 0.3, 5.0;  // x, y, theta, v
+  Input_t<double, 2> inp;
+  inp << 0.1, 1.0;  // steering angle and acceleration
+  State_t<double, 4> next_state =
+    SingleTrackModel::Step<double, IntegrationRK4>(state, inp, model_params);
+  Matrix_t<double> next_state_dyn =
+    SingleTrackModel::Step<double, IntegrationRK4>(Matrix_t<double>(state),
+                                                   Matrix_t<double>(inp),
+                                                   model_params);
+  ASSERT_EQ(next_state_dyn.rows(), 1);
+  for (int i = 0; i < 4; i++)
+    ASSERT_DOUBLE_EQ(next_state(i), next_state_dyn(i));
+
+  // trajectories of fixed-size models
+  Matrix_t<double> initial_states(1, 9);
+  initial_states.setZero();
+  Matrix_t<double> inputs(5, 3);
+  inputs.setOnes();
+  Matrix_t<double> trajectory =
+    dynamics::GenerateDynamicTrajectory<double,
+                                        TripleIntModel,
+                                        IntegrationRK4>(initial_states,
+                                                        inputs,
+                                                        params.get());
+  ASSERT_EQ(trajectory.rows(), 6);
+  ASSERT_EQ(trajectory.cols(), 9);
+  // x = a t^3 / 6 for a constant jerk of one
+  ASSERT_NEAR(trajectory(5, 0), std::pow(0.5, 3)/6., 1e-12);
+}
+
+TEST(dynamics, integration_benchmark) {
+  using dynamics::SingleTrackModel;
+  using dynamics::IntegrationRK4;
+  using geometry::Matrix_t;
+  using geometry::State_t;
+  using geometry::Input_t;
+  using commons::Parameter;
+  using commons::ParameterPtr;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.01);
+  const int num_steps = 100000;
+  State_t<double, 4> initial_state;
+  initial_state << 0.0, 0.0, 0.0, 5.0;  // x, y, theta, v
+  Input_t<double, 2> inp;
+  inp << 0.01, 0.1;  // steering angle and acceleration
+  const SingleTrackModel::Params model_params =
+    SingleTrackModel::Compile(*params);
+
+  // same fixed-size states and compiled parameters for the first two: only
+  // the type of the derivative passed to the RK4 stages differs
+  typedef State_t<double, 4> S;
+  S state = initial_state;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < num_steps; i++) {
+    auto fDot = SingleTrackModel::Derivative<double>(inp, model_params);
+    state = IntegrationRK4::Integrate<double>(state, fDot, model_params.dt);
+  }
+  double time_inlined = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+
+  S state_erased = initial_state;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < num_steps; i++) {
+    std::function<S(const S&)> fDot =
+      SingleTrackModel::Derivative<double>(inp, model_params);
+    state_erased = IntegrationRK4::Integrate<double>(
+      state_erased, fDot, model_params.dt);
+  }
+  double time_erased = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+
+  // previous hot path: dynamically sized states, the derivative bound into
+  // a std::function and the parameters looked up by name every step
+  Matrix_t<double> state_bound = initial_state;
+  const Matrix_t<double> inp_bound = inp;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < num_steps; i++) {
+    std::function<Matrix_t<double>(const Matrix_t<double>&)> fDot =
+      std::bind(
+        static_cast<Matrix_t<double>(*)(const Matrix_t<double>&,
+                                        const Matrix_t<double>&,
+                                        const double&)>(
+          SingleTrackModel::fDot<double>),
+        std::placeholders::_1,
+        inp_bound,
+        params->get<double>("wheel_base", 2.7));
+    state_bound = IntegrationRK4::Integrate<double>(
+      state_bound, fDot, params->get<double>("dt", 0.1));
+  }
+  double time_bound = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+
+  std::cout << "RK4 step: " << time_inlined/num_steps*1e9 << "ns (lambda), "
+            << time_erased/num_steps*1e9 << "ns (std::function), "
+            << time_bound/num_steps*1e9 << "ns (std::bind, Matrix_t)"
+            << std::endl;
+  for (int i = 0; i < 4; i++) {
+    ASSERT_EQ(state(i), state_erased(i));
+    ASSERT_NEAR(state(i), state_bound(i), 1e-9);
+  }
+}
+
+TEST(dynamics, linear_model) {
+  using dynamics::LinearModel;
+  using dynamics::TripleIntModel;
+  using dynamics::IntegrationRK4;
+  using dynamics::IntegrationExact;
+  using geometry::Matrix_t;
+  using geometry::State_t;
+  using geometry::Input_t;
+  using commons::Parameter;
+  using commons::ParameterPtr;
+
+  // double integrator: Ad = [1 dt; 0 1], Bd = [dt^2/2; dt]
+  const double dt = 0.3;
+  LinearModel<2, 1> model((Eigen::Matrix2d() << 0., 1., 0., 0.).finished(),
+                          Eigen::Vector2d(0., 1.));
+  ASSERT_NEAR(model.Ad(dt)(0, 1), dt, 1e-12);
+  ASSERT_NEAR(model.Ad(dt)(1, 1), 1., 1e-12);
+  ASSERT_NEAR(model.Bd(dt)(0, 0), dt*dt/2., 1e-12);
+  ASSERT_NEAR(model.Bd(dt)(1, 0), dt, 1e-12);
+
+  // RK4 is exact for the triple integrator, too
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("dt", dt);
+  const TripleIntModel::Params model_params = TripleIntModel::Compile(*params);
+  State_t<double, 9> state;
+  state << 1.0, 2.0, 3.0, -1.0, 0.5, 0.2, 0.0, -2.0, 1.0;
+  Input_t<double, 3> inp;
+  inp << 0.5, -1.0, 2.0;
+  State_t<double, 9> exact =
+    TripleIntModel::Step<double, IntegrationExact>(state, inp, model_params);
+  State_t<double, 9> rk4 =
+    TripleIntModel::Step<double, IntegrationRK4>(state, inp, model_params);
+  for (int i = 0; i < 9; i++)
+    ASSERT_NEAR(exact(i), rk4(i), 1e-12);
+
+  Matrix_t<double> jac_state, jac_input, jac_state_rk4, jac_input_rk4;
+  TripleIntModel::StepJacobian<IntegrationExact>(
+    Matrix_t<double>(state), Matrix_t<double>(inp), model_params,
+    &jac_state, &jac_input);
+  TripleIntModel::StepJacobian<IntegrationRK4>(
+    Matrix_t<double>(state), Matrix_t<double>(inp), model_params,
+    &jac_state_rk4, &jac_input_rk4);
+  ASSERT_TRUE(jac_state.isApprox(jac_state_rk4, 1e-12));
+  ASSERT_TRUE(jac_input.isApprox(jac_input_rk4, 1e-12));
+}
+
+TEST(dynamics, batch_rollout) {
+  using dynamics::SingleTrackModel;
+  using dynamics::TripleIntModel;
+  using dynamics::IntegrationRK4;
+  using dynamics::IntegrationExact;
+  using dynamics::GenerateDynamicTrajectory;
+  using dynamics::GenerateBatchTrajectories;
+  using geometry::Matrix_t;
+  using geometry::Batch_t;
+  using commons::Parameter;
+  using commons::ParameterPtr;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  const int num_sequences = 256;
+  const int num_steps = 20;
+  std::srand(0);
+
+  // single-track model
+  Matrix_t<double> initial_state(1, 4);
+  initial_state << 0., 0., 0., 10.;
+  std::vector<Matrix_t<double>> inputs;
+  std::vector<Batch_t<2>> batch_inputs(num_steps,
+                                       Batch_t<2>(2, num_sequences));
+  for (int k = 0; k < num_sequences; k++) {
+    inputs.push_back(0.2*Matrix_t<double>::Random(num_steps, 2));
+    for (int t = 0; t < num_steps; t++)
+      batch_inputs[t].col(k) = inputs[k].row(t).transpose();
+  }
+  auto t0 = std::chrono::high_resolution_clock::now();
+  std::vector<Batch_t<4>> batch =
+    GenerateBatchTrajectories<SingleTrackModel, IntegrationRK4>(
+      initial_state, batch_inputs, params.get());
+  auto t1 = std::chrono::high_resolution_clock::now();
+  std::vector<Matrix_t<double>> trajectories;
+  for (int k = 0; k < num_sequences; k++)
+    trajectories.push_back(
+      GenerateDynamicTrajectory<double, SingleTrackModel, IntegrationRK4>(
+        initial_state, inputs[k], params.get()));
+  auto t2 = std::chrono::high_resolution_clock::now();
+  std::cout << "Rollout of " << num_sequences << " sequences: "
+            << std::chrono::duration<double, std::micro>(t1 - t0).count()
+            << "us (batched), "
+            << std::chrono::duration<double, std::micro>(t2 - t1).count()
+            << "us (sequential)" << std::endl;
+  ASSERT_EQ(static_cast<int>(batch.size()), num_steps + 1);
+  for (int k = 0; k < num_sequences; k++)
+    for (int t = 0; t <= num_steps; t++)
+      ASSERT_TRUE((batch[t].col(k).matrix().transpose() -
+                   trajectories[k].row(t)).norm() < 1e-9);
+
+  // triple integrator
+  Matrix_t<double> initial_state_ti = Matrix_t<double>::Zero(1, 9);
+  initial_state_ti(1) = 5.;
+  std::vector<Batch_t<3>> batch_inputs_ti(num_steps,
+                                          Batch_t<3>(3, num_sequences));
+  inputs.clear();
+  for (int k = 0; k < num_sequences; k++) {
+    inputs.push_back(Matrix_t<double>::Random(num_steps, 3));
+    for (int t = 0; t < num_steps; t++)
+      batch_inputs_ti[t].col(k) = inputs[k].row(t).transpose();
+  }
+  std::vector<Batch_t<9>> batch_ti =
+    GenerateBatchTrajectories<TripleIntModel, IntegrationExact>(
+      initial_state_ti, batch_inputs_ti, params.get());
+  for (int k = 0; k < num_sequences; k++) {
+    Matrix_t<double> trajectory =
+      GenerateDynamicTrajectory<double, TripleIntModel, IntegrationExact>(
+        initial_state_ti, inputs[k], params.get());
+    for (int t = 0; t <= num_steps; t++)
+      ASSERT_TRUE((batch_ti[t].col(k).matrix().transpose() -
+                   trajectory.row(t)).norm() < 1e-9);
+  }
+}
+
+TEST(dynamics, rk45_dense_output) {
+  using dynamics::SingleTrackModel;
+  using dynamics::IntegrationRK4;
+  using dynamics::IntegrationRK45;
+  using dynamics::DenseOutput;
+  using dynamics::IntegrationTolerances;
+  using dynamics::GenerateDynamicTrajectory;
+  using dynamics::GenerateDenseTrajectory;
+  using geometry::Matrix_t;
+  using commons::Parameter;
+  using commons::ParameterPtr;
+
+  Matrix_t<double> initial_state(1, 4);
+  initial_state << 0., 0., 0., 10.;
+  Matrix_t<double> inputs(3, 2);
+  inputs << 0.3, 1.0,
+            -0.2, 0.0,
+            0.1, -2.0;
+
+  // coarse control intervals
+  const int num_samples = 4;
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("dt", 1.0);
+  Matrix_t<double> trajectory =
+    GenerateDynamicTrajectory<double, SingleTrackModel, IntegrationRK45>(
+      initial_state, inputs, params.get());
+  Matrix_t<double> dense_trajectory =
+    GenerateDenseTrajectory<SingleTrackModel>(
+      initial_state, inputs, params.get(), num_samples);
+  ASSERT_EQ(dense_trajectory.rows(), 1 + 3*num_samples);
+
+  // reference using fine RK4 steps
+  const int substeps = 1000;
+  ParameterPtr fine_params = std::make_shared<Parameter>();
+  fine_params->set<double>("dt", 1.0 / substeps);
+  Matrix_t<double> fine_inputs(3*substeps, 2);
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < substeps; j++)
+      fine_inputs.row(i*substeps + j) = inputs.row(i);
+  Matrix_t<double> reference =
+    GenerateDynamicTrajectory<double, SingleTrackModel, IntegrationRK4>(
+      initial_state, fine_inputs, fine_params.get());
+
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE((trajectory.row(i + 1) -
+                 reference.row((i + 1)*substeps)).norm() < 1e-4);
+    for (int j = 1; j <= num_samples; j++) {
+      ASSERT_TRUE((dense_trajectory.row(1 + i*num_samples + j - 1) -
+                   reference.row(i*substeps + j*substeps/num_samples))
+                  .norm() < 1e-3);
+    }
+  }
+
+  // tolerances that reject all but vanishing substeps: once the substeps
+  // are used up the remainder is one step, so the state still is at dt
+  typedef geometry::State_t<double, 2> S;
+  IntegrationTolerances tolerances;
+  tolerances.abs_tol = 1e-300;
+  tolerances.rel_tol = 0.;
+  S state;
+  state << 1., 2.;
+  DenseOutput<S> dense;
+  const S end = IntegrationRK45::IntegrateDense(
+    state, [](const S& x) { return S(x); }, 0.5, tolerances, &dense);
+  ASSERT_TRUE((end - std::exp(0.5)*state).norm() < 1e-4);
+
+  // the models compile the tolerances with their other parameters
+  params->set<double>("rk45_abs_tol", 1e-9);
+  ASSERT_EQ(SingleTrackModel::Compile(*params).tolerances.abs_tol, 1e-9);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
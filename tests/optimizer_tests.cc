@@ -2,16 +2,52 @@
 //
 // This work is licensed under the terms of the MIT license.
 // For a copy, see <https://opensource.org/licenses/MIT>.
+#include <cstdlib>
+#include <new>
 #include "gtest/gtest.h"
 #include "src/commons/parameters.h"
 #include "src/dynamics/dynamics.h"
 #include "src/optimizer.h"
+#include "src/batch_optimizer.h"
 #include "src/functors/dynamic_functor.h"
 #include "src/functors/base_functor.h"
 #include "src/functors/costs/jerk.h"
 #include "src/functors/costs/base_cost.h"
 #include "src/functors/costs/distance.h"
 #include "src/functors/costs/inputs.h"
+#include "src/functors/analytic_cost_function.h"
+#include "src/functors/multiple_shooting_functor.h"
+
+//! heap allocations of the thread while counting (evaluation_arena); the
+//  replacements forward to malloc and free and are kept out of line, so
+//  that the compiler does not pair inlined frees with operator new
+static thread_local bool count_allocations = false;
+static thread_local int num_allocations = 0;
+
+__attribute__((noinline)) void* operator new(std::size_t size) {
+  if (count_allocations)
+    num_allocations++;
+  if (void* ptr = std::malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+__attribute__((noinline)) void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+__attribute__((noinline)) void operator delete[](void* ptr) noexcept {
+  std::free(ptr);
+}
+__attribute__((noinline)) void operator delete(void* ptr,
+                                               std::size_t) noexcept {
+  std::free(ptr);
+}
+__attribute__((noinline)) void operator delete[](void* ptr,
+                                                 std::size_t) noexcept {
+  std::free(ptr);
+}
 
 
 TEST(optimizer, single_track_model) {
@@ -104,6 +140,1443 @@ TEST(optimizer, single_track_model) {
   std::cout << trajectory << std::endl;
 }
 
+TEST(optimizer, residual_layout) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using optimizer::JerkCost;
+  using optimizer::JerkCostPtr;
+  using optimizer::ReferenceLineCost;
+  using optimizer::ReferenceLineCostPtr;
+  using optimizer::InputCost;
+  using optimizer::InputCostPtr;
+  using optimizer::SpeedCost;
+  using optimizer::SpeedCostPtr;
+  using optimizer::ReferenceCost;
+  using optimizer::ReferenceCostPtr;
+  using optimizer::StaticObjectCost;
+  using optimizer::StaticObjectCostPtr;
+  using optimizer::SingleTrackFunctor;
+  using commons::ObjectOutline;
+  using geometry::Matrix_t;
+  using dynamics::SingleTrackModel;
+  using dynamics::IntegrationRK4;
+  using dynamics::GenerateDynamicTrajectory;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.2);
+
+  Matrix_t<double> initial_states(3, 4);
+  initial_states << 0.0, 0.0, 0.0, 10.0,
+                    1.0, 0.0, 0.0, 10.0,
+                    2.0, 0.0, 0.0, 10.0;  // x, y, theta, v
+  Matrix_t<double> opt_vec(10, 2);
+  opt_vec.setConstant(0.3);
+  Matrix_t<double> ref_line(2, 2);
+  ref_line << 0., 1.,
+              1000., 1.;
+
+  SingleTrackFunctor functor(initial_states, params);
+  JerkCostPtr jerk_costs = std::make_shared<JerkCost>(params);
+  ReferenceLineCostPtr ref_costs = std::make_shared<ReferenceLineCost>(params);
+  ref_costs->SetReferenceLine(ref_line);
+  InputCostPtr inp_costs = std::make_shared<InputCost>(params);
+  Matrix_t<double> lb(1, 2);
+  lb << -0.2, -1.0;
+  Matrix_t<double> ub(1, 2);
+  ub << 0.2, 1.0;
+  inp_costs->SetLowerBound(lb);
+  inp_costs->SetUpperBound(ub);
+  SpeedCostPtr speed_costs = std::make_shared<SpeedCost>(params);
+  speed_costs->SetDesiredSpeed(8.);
+  ReferenceCostPtr reference_costs = std::make_shared<ReferenceCost>(params);
+  reference_costs->SetReference(Matrix_t<double>::Constant(6, 4, 1.));
+  StaticObjectCostPtr object_costs =
+    std::make_shared<StaticObjectCost>(params, 3.);
+  Matrix_t<double> outline(5, 2);
+  outline << 4., -1., 4., 3., 8., 3., 8., -1., 4., -1.;
+  object_costs->AddObjectOutline(ObjectOutline(outline, 0.));
+  object_costs->AddObjectOutline(ObjectOutline(outline.array() + 3., 0.));
+  functor.AddCost(jerk_costs);
+  functor.AddCost(ref_costs);
+  functor.AddCost(inp_costs);
+  functor.AddCost(speed_costs);
+  functor.AddCost(reference_costs);
+  functor.AddCost(object_costs);
+  functor.SetOptVecLen(opt_vec.rows());
+  functor.SetParamCount(opt_vec.cols());
+
+  // 13 trajectory rows: 10 jerk rows (x, y, z), 13 distances, 20 inputs,
+  // 13 speeds, 6 reference rows and 13 rows per object
+  ASSERT_EQ(functor.NumResiduals(), 30 + 13 + 20 + 13 + 6 + 2*13);
+
+  std::vector<const double*> parameters;
+  for (int j = 0; j < opt_vec.cols(); j++)
+    parameters.push_back(opt_vec.col(j).data());
+  std::vector<double> residuals(functor.NumResiduals());
+  functor(parameters.data(), residuals.data());
+  double squared_sum = 0.;
+  for (double r : residuals)
+    squared_sum += r*r;
+
+  Matrix_t<double> trajectory =
+    GenerateDynamicTrajectory<double, SingleTrackModel, IntegrationRK4>(
+      initial_states, opt_vec, params.get());
+  double expected =
+    jerk_costs->Evaluate<double, SingleTrackModel>(trajectory, opt_vec) +
+    ref_costs->Evaluate<double, SingleTrackModel>(trajectory, opt_vec) +
+    inp_costs->Evaluate<double, SingleTrackModel>(trajectory, opt_vec) +
+    speed_costs->Evaluate<double, SingleTrackModel>(trajectory, opt_vec) +
+    reference_costs->Evaluate<double, SingleTrackModel>(trajectory, opt_vec) +
+    object_costs->Evaluate<double, SingleTrackModel>(trajectory, opt_vec);
+  ASSERT_NEAR(squared_sum, expected, 1e-6*expected);
+}
+
+
+//! wires a functor up the way Optimizer::AddResidualBlock does
+template<class F>
+void SetUpFunctor(F* functor,
+                  const geometry::Matrix_t<double>& opt_vec,
+                  const std::vector<optimizer::BaseCostPtr>& costs) {
+  functor->SetOptVecLen(opt_vec.rows());
+  functor->SetParamCount(opt_vec.cols());
+  for (const auto& cost : costs)
+    functor->AddCost(cost);
+}
+
+//! residuals of a functor with one parameter block per column of the inputs
+template<typename T, class F>
+std::vector<T> EvaluateFunctor(F* functor,
+                               const geometry::Matrix_t<T>& inputs) {
+  std::vector<const T*> parameters;
+  for (int j = 0; j < inputs.cols(); j++)
+    parameters.push_back(inputs.col(j).data());
+  std::vector<T> residuals(functor->NumResiduals());
+  EXPECT_TRUE((*functor)(parameters.data(), residuals.data()));
+  return residuals;
+}
+
+//! the inputs as Jets; derivative k belongs to the k-th (col-major) value
+template<typename T>
+geometry::Matrix_t<T> JetInputs(const geometry::Matrix_t<double>& inputs) {
+  geometry::Matrix_t<T> jets(inputs.rows(), inputs.cols());
+  for (int k = 0; k < inputs.size(); k++)
+    jets(k) = T(inputs(k), k);
+  return jets;
+}
+
+//! one cost of each kind of the library around a drive along the x-axis
+std::vector<optimizer::BaseCostPtr> LibraryCosts(
+  const commons::ParameterPtr& params) {
+  using commons::ObjectOutline;
+  using optimizer::ReferenceLineCost;
+  using optimizer::ReferenceCost;
+  using optimizer::SpeedCost;
+  using optimizer::InputCost;
+  using optimizer::StaticObjectCost;
+  using optimizer::SdfObjectCost;
+  using geometry::Matrix_t;
+  Matrix_t<double> ref_line(2, 2);
+  ref_line << 0., 1., 1000., 1.;
+  auto ref_line_cost = std::make_shared<ReferenceLineCost>(params);
+  ref_line_cost->SetReferenceLine(ref_line);
+  auto ref_cost = std::make_shared<ReferenceCost>(params);
+  ref_cost->SetReference(Matrix_t<double>::Constant(6, 4, 1.));
+  auto speed_cost = std::make_shared<SpeedCost>(params);
+  speed_cost->SetDesiredSpeed(8.);
+  auto input_cost = std::make_shared<InputCost>(params);
+  input_cost->SetLowerBound(Matrix_t<double>::Constant(1, 2, -0.05));
+  input_cost->SetUpperBound(Matrix_t<double>::Constant(1, 2, 0.05));
+  Matrix_t<double> outline(5, 2);
+  outline << 5., -1., 5., 3., 8., 3., 8., -1., 5., -1.;
+  auto object_cost = std::make_shared<StaticObjectCost>(params, 3.);
+  object_cost->AddObjectOutline(ObjectOutline(outline, 0.));
+  object_cost->AddObjectOutline(ObjectOutline(outline.array() + 2., 0.));
+  auto sdf_cost = std::make_shared<SdfObjectCost>(params, 3.);
+  sdf_cost->AddObjectOutline(ObjectOutline(outline, 0.));
+  return {std::make_shared<optimizer::JerkCost>(params), ref_line_cost,
+          ref_cost, speed_cost, input_cost, object_cost, sdf_cost};
+}
+
+template<class F>
+void CompareAnalyticJacobians(const geometry::Matrix_t<double>& initial_states,
+                              const geometry::Matrix_t<double>& opt_vec,
+                              const commons::ParameterPtr& params,
+                              const std::vector<optimizer::BaseCostPtr>& costs) {
+  using ceres::DynamicAutoDiffCostFunction;
+  using optimizer::AnalyticDynamicCostFunction;
+  F* autodiff_functor = new F(initial_states, params);
+  F* analytic_functor = new F(initial_states, params);
+  for (auto& cost : costs) {
+    autodiff_functor->AddCost(cost);
+    analytic_functor->AddCost(cost);
+  }
+  for (F* functor : {autodiff_functor, analytic_functor}) {
+    functor->SetOptVecLen(opt_vec.rows());
+    functor->SetParamCount(opt_vec.cols());
+  }
+  const int num_residuals = autodiff_functor->NumResiduals();
+  DynamicAutoDiffCostFunction<F, 16> autodiff(autodiff_functor);
+  AnalyticDynamicCostFunction<F, 16> analytic(analytic_functor);
+  for (int j = 0; j < opt_vec.cols(); j++) {
+    autodiff.AddParameterBlock(opt_vec.rows());
+    analytic.AddParameterBlock(opt_vec.rows());
+  }
+  autodiff.SetNumResiduals(num_residuals);
+  analytic.SetNumResiduals(num_residuals);
+
+  std::vector<const double*> parameters;
+  for (int j = 0; j < opt_vec.cols(); j++)
+    parameters.push_back(opt_vec.col(j).data());
+  std::vector<double> res_autodiff(num_residuals), res_analytic(num_residuals);
+  std::vector<std::vector<double>> jac_autodiff, jac_analytic;
+  std::vector<double*> jac_autodiff_ptr, jac_analytic_ptr;
+  for (int j = 0; j < opt_vec.cols(); j++) {
+    jac_autodiff.emplace_back(num_residuals*opt_vec.rows());
+    jac_analytic.emplace_back(num_residuals*opt_vec.rows());
+  }
+  for (int j = 0; j < opt_vec.cols(); j++) {
+    jac_autodiff_ptr.push_back(jac_autodiff[j].data());
+    jac_analytic_ptr.push_back(jac_analytic[j].data());
+  }
+  ASSERT_TRUE(autodiff.Evaluate(parameters.data(),
+                                res_autodiff.data(),
+                                jac_autodiff_ptr.data()));
+  ASSERT_TRUE(analytic.Evaluate(parameters.data(),
+                                res_analytic.data(),
+                                jac_analytic_ptr.data()));
+  for (int r = 0; r < num_residuals; r++)
+    ASSERT_NEAR(res_autodiff[r], res_analytic[r], 1e-9);
+  for (int j = 0; j < opt_vec.cols(); j++) {
+    for (int k = 0; k < num_residuals*opt_vec.rows(); k++) {
+      ASSERT_NEAR(jac_autodiff[j][k], jac_analytic[j][k],
+                  1e-7*(1. + std::abs(jac_autodiff[j][k])));
+    }
+  }
+}
+
+TEST(optimizer, analytic_jacobians) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using optimizer::BaseCostPtr;
+  using optimizer::JerkCost;
+  using optimizer::ReferenceLineCost;
+  using optimizer::ReferenceLineCostPtr;
+  using optimizer::SpeedCost;
+  using optimizer::SpeedCostPtr;
+  using optimizer::InputCost;
+  using optimizer::InputCostPtr;
+  using optimizer::SingleTrackFunctor;
+  using optimizer::FastSingleTrackFunctor;
+  using optimizer::TripleIntFunctor;
+  using geometry::Matrix_t;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.2);
+
+  Matrix_t<double> ref_line(2, 2);
+  ref_line << 0., 1.,
+              1000., 1.;
+  ReferenceLineCostPtr ref_costs = std::make_shared<ReferenceLineCost>(params);
+  ref_costs->SetReferenceLine(ref_line);
+  SpeedCostPtr speed_costs = std::make_shared<SpeedCost>(params);
+  speed_costs->SetDesiredSpeed(8.);
+  InputCostPtr inp_costs = std::make_shared<InputCost>(params);
+  Matrix_t<double> lb(1, 2);
+  lb << -0.2, -1.0;
+  Matrix_t<double> ub(1, 2);
+  ub << 0.2, 1.0;
+  inp_costs->SetLowerBound(lb);
+  inp_costs->SetUpperBound(ub);
+  std::vector<BaseCostPtr> costs{std::make_shared<JerkCost>(params),
+                                 ref_costs,
+                                 speed_costs,
+                                 inp_costs};
+
+  Matrix_t<double> initial_states(2, 4);
+  initial_states << 0.0, 0.0, 0.0, 10.0,
+                    2.0, 0.0, 0.0, 10.0;  // x, y, theta, v
+  Matrix_t<double> opt_vec(12, 2);
+  for (int i = 0; i < opt_vec.rows(); i++)
+    opt_vec.row(i) << 0.05*std::sin(0.5*i), 0.3*std::cos(0.3*i) + 0.9;
+  CompareAnalyticJacobians<SingleTrackFunctor>(
+    initial_states, opt_vec, params, costs);
+  CompareAnalyticJacobians<FastSingleTrackFunctor>(
+    initial_states, opt_vec, params, costs);
+
+  // triple integrator
+  Matrix_t<double> initial_states_ti(1, 9);
+  initial_states_ti << 0.0, 1.0, 0.0,
+                       0.0, 1.0, 0.0,
+                       0.0, 1.0, 0.0;
+  Matrix_t<double> opt_vec_ti(10, 3);
+  for (int i = 0; i < opt_vec_ti.rows(); i++)
+    opt_vec_ti.row(i) << 0.1*i, -0.2*i, 0.05;
+  CompareAnalyticJacobians<TripleIntFunctor>(
+    initial_states_ti,
+    opt_vec_ti,
+    params,
+    {std::make_shared<JerkCost>(params), speed_costs});
+}
+
+TEST(optimizer, rollout_cache) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using optimizer::JerkCost;
+  using optimizer::SpeedCost;
+  using optimizer::SpeedCostPtr;
+  using optimizer::SingleTrackFunctor;
+  using geometry::Matrix_t;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.2);
+  ParameterPtr params_uncached = std::make_shared<Parameter>(*params);
+  params_uncached->set<bool>("rollout_cache", false);
+
+  Matrix_t<double> initial_states(1, 4);
+  initial_states << 0.0, 0.0, 0.0, 10.0;
+  Matrix_t<double> opt_vec(12, 2);
+  for (int i = 0; i < opt_vec.rows(); i++)
+    opt_vec.row(i) << 0.05*std::sin(0.5*i), 0.3*std::cos(0.3*i);
+  SpeedCostPtr speed_costs = std::make_shared<SpeedCost>(params);
+  speed_costs->SetDesiredSpeed(8.);
+
+  SingleTrackFunctor cached(initial_states, params);
+  SingleTrackFunctor uncached(initial_states, params_uncached);
+  for (SingleTrackFunctor* functor : {&cached, &uncached})
+    SetUpFunctor(functor, opt_vec,
+                 {std::make_shared<JerkCost>(params), speed_costs});
+
+  // miss, then a changed suffix, an unchanged vector and a changed start
+  ASSERT_EQ(EvaluateFunctor(&cached, opt_vec),
+            EvaluateFunctor(&uncached, opt_vec));
+  opt_vec.bottomRows(4).array() += 0.1;
+  ASSERT_EQ(EvaluateFunctor(&cached, opt_vec),
+            EvaluateFunctor(&uncached, opt_vec));
+  ASSERT_EQ(EvaluateFunctor(&cached, opt_vec),
+            EvaluateFunctor(&uncached, opt_vec));
+  opt_vec(0, 1) += 0.2;
+  ASSERT_EQ(EvaluateFunctor(&cached, opt_vec),
+            EvaluateFunctor(&uncached, opt_vec));
+  ASSERT_EQ(cached.GetRolloutCacheHits(), 2);
+  ASSERT_EQ(cached.GetRolloutCacheMisses(), 2);
+  ASSERT_EQ(uncached.GetRolloutCacheHits(), 0);
+  ASSERT_EQ(uncached.GetRolloutCacheMisses(), 0);
+
+  // new initial states invalidate the cache
+  initial_states(0, 3) = 5.;
+  cached.SetInitialStates(initial_states);
+  uncached.SetInitialStates(initial_states);
+  ASSERT_EQ(EvaluateFunctor(&cached, opt_vec),
+            EvaluateFunctor(&uncached, opt_vec));
+  ASSERT_EQ(cached.GetRolloutCacheMisses(), 3);
+}
+
+//! cost outside of the library: one constant residual per input row
+class ConstantCost : public optimizer::BaseCost {
+ public:
+  explicit ConstantCost(const commons::ParameterPtr& params) :
+    BaseCost(params) { weight_ = 4.; }
+
+  int NumResiduals(int trajectory_rows,
+                   int input_rows,
+                   int input_cols) const override {
+    return input_rows;
+  }
+
+  template<typename T, class M>
+  void Residuals(const geometry::MatrixRef_t<T>& trajectory,
+                 const geometry::MatrixRef_t<T>& inputs,
+                 T* residuals,
+                 int row_offset = 0) const {
+    for (int i = 0; i < inputs.rows(); i++)
+      residuals[i] = SqrtWeight<T>();
+  }
+};
+
+//! cost derived from a library cost that replaces its residuals
+class ConstantSpeedCost : public optimizer::SpeedCost {
+ public:
+  using SpeedCost::SpeedCost;
+
+  template<typename T, class M>
+  void Residuals(const geometry::MatrixRef_t<T>& trajectory,
+                 const geometry::MatrixRef_t<T>& inputs,
+                 T* residuals,
+                 int row_offset = 0) const {
+    for (int i = 0; i < trajectory.rows(); i++)
+      residuals[i] = T(3.);
+  }
+};
+
+TEST(optimizer, cost_pack) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using optimizer::Optimizer;
+  using optimizer::DynamicFunctor;
+  using optimizer::DefaultCostPack;
+  using optimizer::JerkCost;
+  using optimizer::SingleTrackFunctor;
+  using dynamics::SingleTrackModel;
+  using dynamics::IntegrationRK4;
+  using geometry::Matrix_t;
+  typedef DynamicFunctor<SingleTrackModel,
+                         IntegrationRK4,
+                         DefaultCostPack::Extend<ConstantCost,
+                                                 ConstantSpeedCost>>
+    CustomFunctor;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("dt", 0.2);
+  Matrix_t<double> initial_states(1, 4);
+  initial_states << 0.0, 0.0, 0.0, 10.0;
+  Matrix_t<double> opt_vec = Matrix_t<double>::Constant(5, 2, 0.1);
+
+  // types missing in the pack are rejected when added
+  SingleTrackFunctor functor(initial_states, params);
+  ASSERT_THROW(functor.AddCost(std::make_shared<ConstantCost>(params)),
+               std::invalid_argument);
+
+  CustomFunctor custom_functor(initial_states, params);
+  SetUpFunctor(&custom_functor, opt_vec,
+               {std::make_shared<ConstantCost>(params),
+                std::make_shared<JerkCost>(params)});
+  const std::vector<double> residuals =
+    EvaluateFunctor(&custom_functor, opt_vec);
+  for (int i = 0; i < opt_vec.rows(); i++)
+    ASSERT_EQ(residuals[i], 2.);
+
+  // a cost derived from a library cost uses its own residuals, also when
+  // the costs are fused
+  for (bool fused : {false, true}) {
+    ParameterPtr derived_params = std::make_shared<Parameter>(*params);
+    derived_params->set<bool>("fused_costs", fused);
+    CustomFunctor derived_functor(initial_states, derived_params);
+    SetUpFunctor(&derived_functor, opt_vec,
+                 {std::make_shared<ConstantSpeedCost>(derived_params)});
+    for (double residual : EvaluateFunctor(&derived_functor, opt_vec))
+      ASSERT_EQ(residual, 3.);
+  }
+
+  // and run through the stagewise formulations, too
+  params->set<std::string>("solver_type", "ilqr");
+  Optimizer opt(params);
+  opt.SetOptimizationVector(opt_vec);
+  CustomFunctor* ilqr_functor = new CustomFunctor(initial_states, params);
+  ilqr_functor->AddCost(std::make_shared<ConstantCost>(params));
+  ilqr_functor->AddCost(std::make_shared<JerkCost>(params));
+  opt.AddResidualBlock<CustomFunctor>(ilqr_functor);
+  opt.Solve();
+}
+
+TEST(optimizer, fused_costs) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using optimizer::DynamicFunctor;
+  using optimizer::DefaultCostPack;
+  using optimizer::BaseCostPtr;
+  using dynamics::SingleTrackModel;
+  using dynamics::IntegrationRK4;
+  using geometry::Matrix_t;
+  typedef DynamicFunctor<SingleTrackModel,
+                         IntegrationRK4,
+                         DefaultCostPack::Extend<ConstantCost>> Functor;
+  typedef ceres::Jet<double, 6> JetT;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.2);
+  ParameterPtr params_fused = std::make_shared<Parameter>(*params);
+  params_fused->set<bool>("fused_costs", true);
+  std::vector<BaseCostPtr> costs = LibraryCosts(params);
+  costs.push_back(std::make_shared<ConstantCost>(params));
+
+  Matrix_t<double> initial_states(1, 4);
+  initial_states << 0.0, 0.0, 0.0, 10.0;
+  Matrix_t<double> opt_vec(3, 2);
+  opt_vec << 0.1, -0.2, 0.02, 0.3, -0.1, 0.;
+
+  Functor functor(initial_states, params);
+  Functor fused_functor(initial_states, params_fused);
+  SetUpFunctor(&functor, opt_vec, costs);
+  SetUpFunctor(&fused_functor, opt_vec, costs);
+
+  // double
+  ASSERT_EQ(EvaluateFunctor(&functor, opt_vec),
+            EvaluateFunctor(&fused_functor, opt_vec));
+
+  // Jets
+  const Matrix_t<JetT> jet_inputs = JetInputs<JetT>(opt_vec);
+  const std::vector<JetT> jet_residuals =
+    EvaluateFunctor(&functor, jet_inputs);
+  const std::vector<JetT> jet_fused =
+    EvaluateFunctor(&fused_functor, jet_inputs);
+  for (std::size_t i = 0; i < jet_residuals.size(); i++) {
+    ASSERT_EQ(jet_residuals[i].a, jet_fused[i].a);
+    ASSERT_TRUE(jet_residuals[i].v == jet_fused[i].v);
+  }
+}
+
+TEST(optimizer, evaluation_arena) {
+  using commons::Arena;
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using optimizer::SingleTrackFunctor;
+  using optimizer::BaseCostPtr;
+  using geometry::Matrix_t;
+  typedef ceres::Jet<double, 6> JetT;
+
+  // scopes rewind the arena and the outermost one merges its blocks
+  Arena arena(256);
+  {
+    Arena::Scope scope(&arena);
+    double* a = arena.Matrix<double>(4, 4).data();
+    ASSERT_EQ(reinterpret_cast<std::uintptr_t>(a) % Arena::kAlignment, 0u);
+    {
+      Arena::Scope inner(&arena);
+      arena.Matrix<double>(16, 16);
+      ASSERT_EQ(arena.NumBlocks(), 2);
+    }
+    ASSERT_EQ(arena.Matrix<double>(4, 4).data(), a + 16);
+  }
+  ASSERT_EQ(arena.NumBlocks(), 1);
+  ASSERT_EQ(arena.Capacity(), 256u + 16*16*sizeof(double));
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.2);
+  const std::vector<BaseCostPtr> costs = LibraryCosts(params);
+
+  Matrix_t<double> initial_states(1, 4);
+  initial_states << 0.0, 0.0, 0.0, 10.0;
+  Matrix_t<double> opt_vec(3, 2);
+  opt_vec << 0.1, -0.2, 0.02, 0.3, -0.1, 0.;
+  const Matrix_t<JetT> jet_inputs = JetInputs<JetT>(opt_vec);
+
+  for (bool fused : {false, true}) {
+    ParameterPtr functor_params = std::make_shared<Parameter>(*params);
+    functor_params->set<bool>("fused_costs", fused);
+    SingleTrackFunctor functor(initial_states, functor_params);
+    SetUpFunctor(&functor, opt_vec, costs);
+    functor.Compile();
+    // the first evaluation sizes the arena of this thread
+    EvaluateFunctor(&functor, jet_inputs);
+    const std::size_t capacity = Arena::ThreadLocal().Capacity();
+
+    // no heap allocation within the evaluation
+    std::vector<const JetT*> parameters;
+    for (int j = 0; j < jet_inputs.cols(); j++)
+      parameters.push_back(jet_inputs.col(j).data());
+    std::vector<JetT> residuals(functor.NumResiduals());
+    num_allocations = 0;
+    count_allocations = true;
+    const bool evaluated = functor(parameters.data(), residuals.data());
+    count_allocations = false;
+    ASSERT_TRUE(evaluated);
+    ASSERT_EQ(num_allocations, 0);
+    ASSERT_EQ(Arena::ThreadLocal().Capacity(), capacity);
+    ASSERT_EQ(Arena::ThreadLocal().NumBlocks(), 1);
+  }
+}
+
+TEST(optimizer, compiled_params) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using optimizer::SingleTrackFunctor;
+  using optimizer::JerkCost;
+  using dynamics::SingleTrackModel;
+  using geometry::Matrix_t;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.2);
+
+  Matrix_t<double> initial_states(1, 4);
+  initial_states << 0.0, 0.0, 0.0, 10.0;
+  Matrix_t<double> opt_vec(5, 2);
+  opt_vec << 0.1, -0.2, 0.02, 0.3, -0.1, 0., 0.05, 1., 0., -1.;
+
+  SingleTrackFunctor functor(initial_states, params);
+  SetUpFunctor(&functor, opt_vec, {std::make_shared<JerkCost>(params)});
+  functor.Compile();
+  ASSERT_DOUBLE_EQ(functor.GetModelParams().dt, 0.2);
+  ASSERT_DOUBLE_EQ(functor.GetModelParams().wheel_base, 2.7);
+  const std::vector<double> residuals = EvaluateFunctor(&functor, opt_vec);
+
+  // the evaluation uses the snapshot until the functor is compiled again
+  params->set<double>("dt", 0.4);
+  std::vector<double> changed = EvaluateFunctor(&functor, opt_vec);
+  ASSERT_EQ(residuals, changed);
+
+  functor.Compile();
+  ASSERT_DOUBLE_EQ(functor.GetModelParams().dt, 0.4);
+  changed = EvaluateFunctor(&functor, opt_vec);
+  SingleTrackFunctor expected_functor(initial_states, params);
+  SetUpFunctor(&expected_functor, opt_vec,
+               {std::make_shared<JerkCost>(params)});
+  ASSERT_EQ(changed, EvaluateFunctor(&expected_functor, opt_vec));
+  ASSERT_NE(changed, residuals);
+}
+
+TEST(optimizer, reference_path) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using optimizer::ReferenceLineCost;
+  using dynamics::SingleTrackModel;
+  using dynamics::IntegrationRK4;
+  using dynamics::GenerateDynamicTrajectory;
+  using geometry::Matrix_t;
+  using geometry::Line;
+  using geometry::Point;
+  using geometry::ReferencePath;
+
+  // sinusoidal reference line with many vertices
+  const int num_vertices = 2000;
+  Matrix_t<double> ref_line(num_vertices, 2);
+  for (int i = 0; i < num_vertices; i++)
+    ref_line.row(i) << 0.1*i, 2.*std::sin(0.01*i);
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.2);
+  Matrix_t<double> initial_states(1, 4);
+  initial_states << 0.0, 1.0, 0.0, 10.0;
+  Matrix_t<double> opt_vec(40, 2);
+  for (int i = 0; i < opt_vec.rows(); i++)
+    opt_vec.row(i) << 0.05*std::cos(0.3*i), 0.5;
+  Matrix_t<double> trajectory =
+    GenerateDynamicTrajectory<double, SingleTrackModel, IntegrationRK4>(
+      initial_states, opt_vec, params.get());
+
+  // the windowed projection matches the distance to the whole line
+  ReferenceLineCost cost(params, 1.);
+  cost.SetReferenceLine(ref_line);
+  std::vector<double> residuals(trajectory.rows());
+  cost.Residuals<double, SingleTrackModel>(trajectory,
+                                           opt_vec,
+                                           residuals.data());
+  Line<double, 2> line(ref_line);
+  for (int i = 0; i < trajectory.rows(); i++) {
+    Point<double, 2> pt(trajectory(i, 0), trajectory(i, 1));
+    ASSERT_NEAR(residuals[i],
+                (geometry::Distance<double, Line<double, 2>,
+                                    Point<double, 2>>(line, pt)),
+                1e-9);
+  }
+
+  // points before the start and a single vertex
+  ReferencePath path(ref_line);
+  ReferencePath::Cursor cursor;
+  const int segment = path.Advance(-3., 4., &cursor);
+  ASSERT_EQ(segment, 0);
+  ASSERT_NEAR(path.Distance<double>(-3., 4., segment), 5., 1e-12);
+  ReferencePath vertex(ref_line.topRows(1));
+  cursor = ReferencePath::Cursor();
+  ASSERT_NEAR(vertex.Distance<double>(3., 4., vertex.Advance(3., 4., &cursor)),
+              5., 1e-12);
+  cursor = ReferencePath::Cursor();
+  ASSERT_THROW(ReferencePath().Advance(0., 0., &cursor),
+               std::invalid_argument);
+
+  // at a hairpin the projection stays on the leg of the trajectory
+  Matrix_t<double> hairpin(4, 2);
+  hairpin << 0., 0., 20., 0., 20., 2., 0., 2.;
+  ReferencePath hairpin_path(hairpin);
+  cursor = ReferencePath::Cursor();
+  int leg = -1;
+  for (int i = 0; i <= 10; i++)
+    leg = hairpin_path.Advance(5. + 0.5*i, 0.2 + 0.09*i, &cursor);
+  ASSERT_EQ(leg, 0);
+  ASSERT_NEAR(cursor.distance, 1.1, 1e-12);
+  // whereas the point alone is projected onto the closer leg
+  cursor = ReferencePath::Cursor();
+  ASSERT_EQ(hairpin_path.Advance(10., 1.1, &cursor), 2);
+}
+
+TEST(optimizer, object_broadphase) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using commons::ObjectOutline;
+  using optimizer::StaticObjectCost;
+  using dynamics::SingleTrackModel;
+  using dynamics::IntegrationRK4;
+  using dynamics::GenerateDynamicTrajectory;
+  using geometry::Matrix_t;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.2);
+  Matrix_t<double> initial_states(1, 4);
+  initial_states << 0.0, 0.0, 0.0, 10.0;
+  Matrix_t<double> opt_vec(30, 2);
+  for (int i = 0; i < opt_vec.rows(); i++)
+    opt_vec.row(i) << 0.05*std::sin(0.2*i), 0.;
+  Matrix_t<double> trajectory =
+    GenerateDynamicTrajectory<double, SingleTrackModel, IntegrationRK4>(
+      initial_states, opt_vec, params.get());
+
+  // a grid of static and moving boxes around the trajectory
+  StaticObjectCost cost(params, 3., 1.);
+  Matrix_t<double> box(5, 2);
+  box << 0., 0., 0., 2., 2., 2., 2., 0., 0., 0.;
+  for (int i = 0; i < 15; i++) {
+    for (int j = 0; j < 10; j++) {
+      Matrix_t<double> outline = box;
+      outline.col(0).array() += 20.*i;
+      outline.col(1).array() += 6.*(j - 5);
+      ObjectOutline obj_out(outline, 0.);
+      if ((i + j) % 2) {
+        outline.col(1).array() -= 3.;
+        obj_out.Add(outline, 4.);
+      }
+      cost.AddObjectOutline(obj_out);
+    }
+  }
+  const int rows = trajectory.rows();
+  const int num_objects = cost.object_outlines_.size();
+  const double sqrt_weight = cost.SqrtWeight<double>();
+
+  // the residuals match the exact evaluation of every object
+  auto check_residuals = [&](int row_offset) {
+    std::vector<double> residuals(rows*num_objects, -1.);
+    cost.Residuals<double, SingleTrackModel>(trajectory,
+                                             opt_vec,
+                                             residuals.data(),
+                                             row_offset);
+    std::vector<double> expected(rows);
+    int num_candidates = 0;
+    std::vector<int> candidates(cost.MaxCandidates());
+    for (int i = 0; i < rows; i++) {
+      num_candidates += cost.Candidates<double, SingleTrackModel>(
+        trajectory, i, (row_offset + i)*0.2, candidates.data());
+    }
+    for (int k = 0; k < num_objects; k++) {
+      commons::GetObjectResiduals<double, SingleTrackModel>(
+        cost.object_outlines_[k], trajectory, 3., 0.2, expected.data(),
+        row_offset);
+      for (int i = 0; i < rows; i++)
+        ASSERT_NEAR(residuals[k*rows + i], expected[i]*sqrt_weight, 1e-12);
+    }
+    // only few objects are evaluated exactly
+    ASSERT_LT(num_candidates, rows*num_objects/10);
+  };
+  for (int row_offset : {0, 5})
+    check_residuals(row_offset);
+
+  // and with the outlines sampled at the timesteps by Compile
+  cost.Compile(rows + 5);
+  check_residuals(5);
+
+  // outlines added out of order are interpolated in time
+  auto shifted = [&](double d) { return Matrix_t<double>(box.array() + d); };
+  ObjectOutline obj_out(box, 2.);
+  obj_out.Add(shifted(4.), 0.);
+  obj_out.Add(shifted(2.), 1.);
+  ASSERT_TRUE(obj_out.Query(-1.).isApprox(shifted(4.)));
+  ASSERT_TRUE(obj_out.Query(0.5).isApprox(shifted(3.)));
+  ASSERT_TRUE(obj_out.Query(1.).isApprox(shifted(2.)));
+  ASSERT_TRUE(obj_out.Query(3.).isApprox(box));
+}
+
+TEST(optimizer, polygon_distance) {
+  using geometry::Matrix_t;
+  using geometry::Point;
+  using geometry::Polygon;
+  using geometry::OutlineDistance;
+  using geometry::SignedOutlineDistance;
+  typedef ceres::Jet<double, 2> JetT;
+  namespace bg = boost::geometry;
+
+  // concave (L-shaped) outline; the kernel accepts open and closed rings
+  Matrix_t<double> closed(7, 2);
+  closed << 0., 0., 0., 4., 1., 4., 1., 1., 3., 1., 3., 0., 0., 0.;
+  const Matrix_t<double> open = closed.topRows(6);
+  Polygon<double, 2> poly(closed);
+  for (double x = -1.; x <= 4.; x += 0.25) {
+    for (double y = -1.; y <= 5.; y += 0.3) {
+      Point<double, 2> pt(x, y);
+      const double expected = bg::within(pt.obj_, poly.obj_) ? 0. :
+        bg::distance(poly.ToLine().obj_, pt.obj_);
+      ASSERT_NEAR(OutlineDistance<double>(closed, x, y), expected, 1e-12);
+      ASSERT_NEAR(OutlineDistance<double>(open, x, y), expected, 1e-12);
+      const double dist = geometry::Distance<double, 2>(poly, pt);
+      ASSERT_NEAR(dist, expected, 1e-12);
+      if (expected > 0.)
+        ASSERT_NEAR(SignedOutlineDistance(open, x, y), expected, 1e-12);
+      else
+        ASSERT_LE(SignedOutlineDistance(open, x, y), 0.);
+    }
+  }
+
+  // the gradient points away from the closest point of the outline
+  const JetT x(4., 0), y(2.5, 1);
+  const JetT dist = OutlineDistance<JetT>(closed, x, y);
+  ASSERT_NEAR(dist.a, std::hypot(1.5, 1.), 1e-12);
+  ASSERT_NEAR(dist.v(0), 1. / dist.a, 1e-12);
+  ASSERT_NEAR(dist.v(1), 1.5 / dist.a, 1e-12);
+  ASSERT_EQ(OutlineDistance<JetT>(closed, JetT(0.5, 0), JetT(2., 1)).v(0),
+            0.);
+}
+
+TEST(optimizer, footprint) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using commons::ObjectOutline;
+  using optimizer::StaticObjectCost;
+  using dynamics::SingleTrackModel;
+  using dynamics::TripleIntModel;
+  using geometry::Matrix_t;
+  using geometry::Point;
+  using geometry::Polygon;
+  typedef ceres::Jet<double, 3> JetT;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("dt", 0.2);
+  Matrix_t<double> outline(5, 2);
+  outline << 4.5, -1., 4.5, 1., 8., 1., 8., -1., 4.5, -1.;
+  StaticObjectCost cost(params, 1., 1.);
+  cost.AddObjectOutline(ObjectOutline(outline, 0.));
+  Matrix_t<double> circles(3, 3);
+  circles << -1., 0., 1.,
+             1., 0., 1.,
+             3., 0.5, 1.;
+  cost.SetFootprint(circles);
+  ASSERT_NEAR(cost.FootprintReach(), std::sqrt(9.25) + 1., 1e-12);
+
+  // headings towards and away from the object
+  Matrix_t<double> trajectory(4, 4);
+  trajectory << 0., 0., 0., 5.,
+                1., 0., 0.2, 5.,
+                1., 0., 3., 5.,
+                2., 3., -0.5, 5.;
+  const int rows = trajectory.rows();
+  cost.Compile(rows);
+  std::vector<double> residuals(rows);
+  cost.Residuals<double, SingleTrackModel>(trajectory,
+                                           Matrix_t<double>(),
+                                           residuals.data());
+  Polygon<double, 2> poly(outline);
+  for (int i = 0; i < rows; i++) {
+    const double c = std::cos(trajectory(i, 2));
+    const double s = std::sin(trajectory(i, 2));
+    double closest = 1e10;
+    for (int j = 0; j < circles.rows(); j++) {
+      Point<double, 2> center(
+        trajectory(i, 0) + c*circles(j, 0) - s*circles(j, 1),
+        trajectory(i, 1) + s*circles(j, 0) + c*circles(j, 1));
+      closest = std::min(closest,
+                         geometry::Distance<double, 2>(poly, center) -
+                         circles(j, 2));
+    }
+    ASSERT_NEAR(residuals[i], closest < 1. ? 1. - closest : 0., 1e-12);
+  }
+  // only the front circle reaches the object
+  ASSERT_GT(residuals[0], 0.);
+  ASSERT_EQ(residuals[2], 0.);
+
+  // the heading is differentiated through the closest circle
+  Matrix_t<JetT> jet_trajectory = trajectory.cast<JetT>();
+  for (int j = 0; j < 3; j++)
+    jet_trajectory(1, j).v(j) = 1.;
+  std::vector<JetT> jet_residuals(rows);
+  cost.Residuals<JetT, SingleTrackModel>(jet_trajectory,
+                                         Matrix_t<JetT>(),
+                                         jet_residuals.data());
+  const double h = 1e-7;
+  Matrix_t<double> rotated = trajectory;
+  rotated(1, 2) += h;
+  std::vector<double> rotated_residuals(rows);
+  cost.Residuals<double, SingleTrackModel>(rotated,
+                                           Matrix_t<double>(),
+                                           rotated_residuals.data());
+  ASSERT_NEAR(jet_residuals[1].v(2),
+              (rotated_residuals[1] - residuals[1])/h, 1e-5);
+  ASSERT_NE(jet_residuals[1].v(2), 0.);
+
+  // models without a heading keep the footprint axis-aligned
+  Matrix_t<double> triple_int_trajectory = Matrix_t<double>::Zero(1, 9);
+  triple_int_trajectory(0, 0) = 1.;
+  cost.Residuals<double, TripleIntModel>(triple_int_trajectory,
+                                         Matrix_t<double>(),
+                                         residuals.data());
+  ASSERT_NEAR(residuals[0], 1.5, 1e-12);
+}
+
+TEST(optimizer, sdf_object_cost) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using commons::ObjectOutline;
+  using optimizer::StaticObjectCost;
+  using optimizer::SdfObjectCost;
+  using dynamics::SingleTrackModel;
+  using dynamics::IntegrationRK4;
+  using dynamics::GenerateDynamicTrajectory;
+  using geometry::Matrix_t;
+  typedef ceres::Jet<double, 2> JetT;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.2);
+  params->set<double>("sdf_resolution", 0.05);
+  Matrix_t<double> initial_states(1, 4);
+  initial_states << 0.0, 0.0, 0.0, 10.0;
+  Matrix_t<double> opt_vec(30, 2);
+  for (int i = 0; i < opt_vec.rows(); i++)
+    opt_vec.row(i) << 0.05*std::sin(0.2*i), 0.;
+  Matrix_t<double> trajectory =
+    GenerateDynamicTrajectory<double, SingleTrackModel, IntegrationRK4>(
+      initial_states, opt_vec, params.get());
+  const int rows = trajectory.rows();
+
+  // 100 static boxes along the trajectory
+  StaticObjectCost exact_cost(params, 2., 1.);
+  SdfObjectCost sdf_cost(params, 2., 1.);
+  Matrix_t<double> box(5, 2);
+  box << 0., 0., 0., 1., 1., 1., 1., 0., 0., 0.;
+  for (int i = 0; i < 20; i++) {
+    for (int j = 0; j < 5; j++) {
+      Matrix_t<double> outline = box;
+      outline.col(0).array() += 3.*i + 1.;
+      outline.col(1).array() += 4.*(j - 2) + 1.5;
+      exact_cost.AddObjectOutline(ObjectOutline(outline, 0.));
+      sdf_cost.AddObjectOutline(ObjectOutline(outline, 0.));
+    }
+  }
+  exact_cost.Compile(rows);
+  sdf_cost.Compile(rows);
+  const int num_objects = exact_cost.object_outlines_.size();
+
+  // the hinge of the closest object matches the interpolated field
+  // outside of the objects and keeps increasing within them
+  std::vector<double> exact(rows*num_objects), sdf(rows);
+  exact_cost.Residuals<double, SingleTrackModel>(trajectory,
+                                                 opt_vec,
+                                                 exact.data());
+  sdf_cost.Residuals<double, SingleTrackModel>(trajectory,
+                                               opt_vec,
+                                               sdf.data());
+  int num_active = 0;
+  for (int i = 0; i < rows; i++) {
+    double closest = 0.;
+    for (int k = 0; k < num_objects; k++)
+      closest = std::max(closest, exact[k*rows + i]);
+    num_active += closest > 0.;
+    if (closest < 2.)
+      ASSERT_NEAR(sdf[i], closest, 1e-2);
+    else
+      ASSERT_GT(sdf[i], 2.);
+  }
+  ASSERT_GT(num_active, 0);
+
+  // Jets
+  Matrix_t<JetT> jet_trajectory = trajectory.cast<JetT>();
+  for (int i = 0; i < rows; i++) {
+    jet_trajectory(i, 0).v(0) = 1.;
+    jet_trajectory(i, 1).v(1) = 1.;
+  }
+  std::vector<JetT> jet_sdf(rows);
+  sdf_cost.Residuals<JetT, SingleTrackModel>(jet_trajectory,
+                                             opt_vec.cast<JetT>(),
+                                             jet_sdf.data());
+  const double h = 1e-6;
+  for (int i = 0; i < rows; i++) {
+    ASSERT_NEAR(jet_sdf[i].a, sdf[i], 1e-12);
+    Matrix_t<double> shifted = trajectory;
+    shifted(i, 0) += h;
+    std::vector<double> sdf_shifted(rows);
+    sdf_cost.Residuals<double, SingleTrackModel>(shifted,
+                                                 opt_vec,
+                                                 sdf_shifted.data());
+    ASSERT_NEAR(jet_sdf[i].v(0), (sdf_shifted[i] - sdf[i])/h, 1e-4);
+  }
+
+  // benchmark against the exact evaluation
+  const int num_evaluations = 200;
+  auto start = std::chrono::steady_clock::now();
+  for (int n = 0; n < num_evaluations; n++)
+    exact_cost.Residuals<double, SingleTrackModel>(trajectory,
+                                                   opt_vec,
+                                                   exact.data());
+  double time_exact = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+  start = std::chrono::steady_clock::now();
+  for (int n = 0; n < num_evaluations; n++)
+    sdf_cost.Residuals<double, SingleTrackModel>(trajectory,
+                                                 opt_vec,
+                                                 sdf.data());
+  double time_sdf = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+  std::cout << "Object cost: " << time_exact/num_evaluations*1e6
+            << "us (exact), " << time_sdf/num_evaluations*1e6
+            << "us (sdf)" << std::endl;
+}
+
+TEST(optimizer, warm_start) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using optimizer::Optimizer;
+  using commons::ObjectOutline;
+  using optimizer::BaseFunctor;
+  using optimizer::JerkCost;
+  using optimizer::StaticObjectCost;
+  using optimizer::SingleTrackFunctor;
+  using geometry::Matrix_t;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.2);
+
+  Matrix_t<double> initial_states(1, 4);
+  initial_states << 0.0, 0.0, 0.0, 10.0;  // x, y, theta, v
+  Matrix_t<double> opt_vec(5, 2);
+  opt_vec << 0.0, 0.0,
+             0.1, 1.0,
+             0.2, 2.0,
+             0.3, 3.0,
+             0.4, 4.0;
+
+  Optimizer opt(params);
+  opt.SetOptimizationVector(opt_vec);
+  SingleTrackFunctor* functor = new SingleTrackFunctor(initial_states, params);
+  functor->AddCost(std::make_shared<JerkCost>(params));
+  opt.AddResidualBlock<SingleTrackFunctor>(functor);
+  opt.Solve();
+
+  // next cycle: the vehicle advanced by two steps
+  Matrix_t<double> result = opt.Result();
+  Matrix_t<double> next_states(1, 4);
+  next_states << 4.0, 0.0, 0.0, 10.0;
+  opt.WarmStart(next_states, 2);
+  Matrix_t<double> shifted = opt.Result();
+  ASSERT_EQ(shifted.rows(), result.rows());
+  for (int i = 0; i < shifted.rows(); i++) {
+    ASSERT_EQ(shifted.row(i), result.row(std::min(i + 2, 4)));
+  }
+  ASSERT_EQ(functor->GetInitialStates(), next_states);
+  opt.Solve();
+
+  // the initial states keep their shape
+  ASSERT_THROW(opt.WarmStart(Matrix_t<double>::Zero(2, 4)),
+               std::invalid_argument);
+
+  // so does the residual layout ceres sized the block with
+  Matrix_t<double> outline(5, 2);
+  outline << 5., -1., 5., 3., 8., 3., 8., -1., 5., -1.;
+  auto object_cost = std::make_shared<StaticObjectCost>(params, 3.);
+  object_cost->AddObjectOutline(ObjectOutline(outline, 0.));
+  Optimizer object_opt(params);
+  object_opt.SetOptimizationVector(opt_vec);
+  SingleTrackFunctor* object_functor =
+    new SingleTrackFunctor(initial_states, params);
+  object_functor->AddCost(object_cost);
+  object_opt.AddResidualBlock<SingleTrackFunctor>(object_functor);
+  object_opt.Solve();
+  object_cost->AddObjectOutline(ObjectOutline(outline.array() + 2., 0.));
+  ASSERT_THROW(object_opt.Solve(), std::logic_error);
+  ASSERT_THROW(EvaluateFunctor(object_functor, opt_vec), std::logic_error);
+}
+
+TEST(optimizer, batch_optimizer) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using optimizer::BatchOptimizer;
+  using optimizer::BaseCostPtr;
+  using optimizer::JerkCost;
+  using optimizer::SpeedCost;
+  using optimizer::SpeedCostPtr;
+  using optimizer::SingleTrackFunctor;
+  using geometry::Matrix_t;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.2);
+  params->set<int>("batch_num_threads", 3);
+
+  SpeedCostPtr speed_costs = std::make_shared<SpeedCost>(params);
+  speed_costs->SetDesiredSpeed(10.);
+  std::vector<BaseCostPtr> costs{std::make_shared<JerkCost>(params),
+                                 speed_costs};
+
+  // same problems solved by a single and by several threads
+  auto solve = [&](int num_threads, double* time) {
+    BatchOptimizer batch(params);
+    ASSERT_EQ(batch.GetNumThreads(), 3);
+    batch.SetNumThreads(num_threads);
+    for (int i = 0; i < 8; i++) {
+      Matrix_t<double> initial_states(1, 4);
+      initial_states << 0.0, 0.5*i, 0.0, 8.0 + i;  // x, y, theta, v
+      Matrix_t<double> opt_vec(15, 2);
+      opt_vec.setConstant(0.01*i);
+      ASSERT_EQ(batch.AddProblem<SingleTrackFunctor>(initial_states,
+                                                     opt_vec,
+                                                     costs), i);
+    }
+    auto start = std::chrono::steady_clock::now();
+    batch.Solve();
+    *time = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+    ASSERT_EQ(batch.NumProblems(), 8);
+    for (int i = 0; i < batch.NumProblems(); i++) {
+      ASSERT_EQ(batch.Result(i).rows(), 15);
+      ASSERT_TRUE(batch.Summary(i).IsSolutionUsable());
+    }
+  };
+
+  double serial_time, parallel_time;
+  solve(1, &serial_time);
+  solve(3, &parallel_time);
+  std::cout << "8 problems: " << serial_time*1e3 << "ms (1 thread), "
+            << parallel_time*1e3 << "ms (3 threads)" << std::endl;
+}
+
+TEST(optimizer, multiple_shooting) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using optimizer::Optimizer;
+  using optimizer::BaseCostPtr;
+  using optimizer::JerkCost;
+  using optimizer::SpeedCost;
+  using optimizer::SpeedCostPtr;
+  using optimizer::InputCost;
+  using optimizer::InputCostPtr;
+  using optimizer::SingleTrackFunctor;
+  using optimizer::StageFunctor;
+  using optimizer::ContinuityFunctor;
+  using geometry::Matrix_t;
+  using dynamics::SingleTrackModel;
+  using dynamics::IntegrationRK4;
+  using dynamics::GenerateDynamicTrajectory;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.2);
+
+  SpeedCostPtr speed_costs = std::make_shared<SpeedCost>(params);
+  speed_costs->SetDesiredSpeed(8.);
+  InputCostPtr inp_costs = std::make_shared<InputCost>(params);
+  Matrix_t<double> lb(1, 2);
+  lb << -0.2, -1.0;
+  Matrix_t<double> ub(1, 2);
+  ub << 0.2, 1.0;
+  inp_costs->SetLowerBound(lb);
+  inp_costs->SetUpperBound(ub);
+  std::vector<BaseCostPtr> costs{std::make_shared<JerkCost>(params),
+                                 speed_costs,
+                                 inp_costs};
+
+  Matrix_t<double> initial_states(2, 4);
+  initial_states << 0.0, 0.0, 0.0, 10.0,
+                    2.0, 0.0, 0.0, 10.0;  // x, y, theta, v
+  Matrix_t<double> opt_vec(8, 2);
+  for (int i = 0; i < opt_vec.rows(); i++)
+    opt_vec.row(i) << 0.3*std::sin(0.5*i), 1.5*std::cos(0.3*i);
+
+  // single shooting reference
+  SingleTrackFunctor functor(initial_states, params);
+  for (auto& cost : costs)
+    functor.AddCost(cost);
+  functor.SetOptVecLen(opt_vec.rows());
+  functor.SetParamCount(opt_vec.cols());
+  std::vector<const double*> parameters;
+  for (int j = 0; j < opt_vec.cols(); j++)
+    parameters.push_back(opt_vec.col(j).data());
+  std::vector<double> residuals(functor.NumResiduals());
+  functor(parameters.data(), residuals.data());
+  double single_shooting = 0.;
+  for (double r : residuals)
+    single_shooting += r*r;
+
+  // the stages on the rolled out states partition the same residuals
+  Matrix_t<double> trajectory =
+    GenerateDynamicTrajectory<double, SingleTrackModel, IntegrationRK4>(
+      initial_states, opt_vec, params.get());
+  std::vector<std::vector<double>> states, inputs;
+  for (int i = 0; i < trajectory.rows(); i++) {
+    states.emplace_back();
+    for (int j = 0; j < trajectory.cols(); j++)
+      states[i].push_back(trajectory(i, j));
+  }
+  for (int i = 0; i < opt_vec.rows(); i++)
+    inputs.push_back({opt_vec(i, 0), opt_vec(i, 1)});
+  double multiple_shooting = 0.;
+  ContinuityFunctor<SingleTrackModel, IntegrationRK4> continuity(params, 4, 2);
+  for (int k = initial_states.rows(); k < trajectory.rows(); k++) {
+    const int window_rows = std::min(4, k + 1);
+    StageFunctor<SingleTrackModel> stage(params, k, window_rows, 4, 2);
+    for (auto& cost : costs)
+      stage.AddCost(cost);
+    std::vector<const double*> blocks;
+    for (int i = k - window_rows + 1; i <= k; i++)
+      blocks.push_back(states[i].data());
+    blocks.push_back(inputs[k - initial_states.rows()].data());
+    std::vector<double> stage_residuals(stage.NumResiduals());
+    stage(blocks.data(), stage_residuals.data());
+    for (double r : stage_residuals)
+      multiple_shooting += r*r;
+
+    const double* continuity_blocks[3] = {
+      states[k-1].data(),
+      inputs[k - initial_states.rows()].data(),
+      states[k].data()};
+    double defects[4];
+    continuity(continuity_blocks, defects);
+    for (double d : defects)
+      ASSERT_NEAR(d, 0., 1e-9);
+  }
+  // the initial states only add constant speed residuals
+  for (int k = 0; k < initial_states.rows(); k++) {
+    double r = initial_states(k, 3) - 8.;
+    multiple_shooting += speed_costs->weight_*r*r;
+  }
+  ASSERT_NEAR(multiple_shooting, single_shooting, 1e-8*single_shooting);
+
+  // optimizer
+  Optimizer opt(params);
+  opt.SetOptimizationVector(opt_vec);
+  opt.AddMultipleShootingFunctors<SingleTrackModel, IntegrationRK4>(
+    initial_states, params, costs);
+  opt.FixOptimizationVector(0, 1);
+  opt.Solve();
+  ASSERT_EQ(opt.Result().rows(), opt_vec.rows());
+  ASSERT_EQ(opt.States().rows(), trajectory.rows());
+
+  // a sparse linear solver unless one is set; ceres' default otherwise
+  ASSERT_EQ(opt.SolverOptions().linear_solver_type,
+            ceres::SPARSE_NORMAL_CHOLESKY);
+  ASSERT_EQ(Optimizer(params).SolverOptions().linear_solver_type,
+            ceres::Solver::Options().linear_solver_type);
+  ParameterPtr solver_params = std::make_shared<Parameter>(*params);
+  solver_params->set<std::string>("linear_solver_type", "dense_schur");
+  ASSERT_EQ(Optimizer(solver_params).SolverOptions().linear_solver_type,
+            ceres::DENSE_SCHUR);
+  solver_params->set<std::string>("linear_solver_type", "sparse_shur");
+  ASSERT_THROW(Optimizer{solver_params}, std::invalid_argument);
+
+  // the stages are added once and need a state space model
+  ASSERT_THROW((opt.AddMultipleShootingFunctors<SingleTrackModel,
+                                                IntegrationRK4>(
+                  initial_states, params, costs)),
+               std::invalid_argument);
+  ParameterPtr static_params = std::make_shared<Parameter>(*params);
+  static_params->set<bool>("static", true);
+  Optimizer static_opt(static_params);
+  static_opt.SetOptimizationVector(opt_vec);
+  ASSERT_THROW((static_opt.AddMultipleShootingFunctors<SingleTrackModel,
+                                                       IntegrationRK4>(
+                  initial_states, static_params, costs)),
+               std::invalid_argument);
+}
+
+TEST(optimizer, time_budget) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using optimizer::Optimizer;
+  using optimizer::SolveStatus;
+  using optimizer::JerkCost;
+  using optimizer::SingleTrackFunctor;
+  using geometry::Matrix_t;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.2);
+  // practically zero budget: stops after the first iteration
+  params->set<double>("time_budget_ms", 1e-6);
+
+  Matrix_t<double> initial_states(1, 4);
+  initial_states << 0.0, 0.0, 0.0, 10.0;  // x, y, theta, v
+  Matrix_t<double> opt_vec(20, 2);
+  opt_vec.setConstant(0.1);
+
+  Optimizer opt(params);
+  opt.SetOptimizationVector(opt_vec);
+  SingleTrackFunctor* functor = new SingleTrackFunctor(initial_states, params);
+  functor->AddCost(std::make_shared<JerkCost>(params));
+  opt.AddResidualBlock<SingleTrackFunctor>(functor);
+  opt.Solve();
+  ASSERT_EQ(opt.Status(), SolveStatus::TIME_BUDGET_EXCEEDED);
+  ASSERT_EQ(opt.Result().rows(), opt_vec.rows());
+
+  // without a budget the deadline does not stop the solver
+  opt.SetTimeBudget(0.);
+  opt.Solve();
+  ASSERT_NE(opt.Status(), SolveStatus::TIME_BUDGET_EXCEEDED);
+  ASSERT_EQ(opt.SolverOptions().max_solver_time_in_seconds, 1e9);
+
+  // the iteration that exhausts the budget is still recorded
+  ParameterPtr record_params = std::make_shared<Parameter>(*params);
+  record_params->set<std::string>("solver_type", "ilqr");
+  record_params->set<bool>("record_iterations", true);
+  Optimizer record_opt(record_params);
+  record_opt.SetOptimizationVector(opt_vec);
+  SingleTrackFunctor* record_functor =
+    new SingleTrackFunctor(initial_states, record_params);
+  record_functor->AddCost(std::make_shared<JerkCost>(record_params));
+  record_opt.AddResidualBlock<SingleTrackFunctor>(record_functor);
+  record_opt.Solve();
+  ASSERT_EQ(record_opt.Status(), SolveStatus::TIME_BUDGET_EXCEEDED);
+  ASSERT_EQ(record_opt.IterationRecords().size(), 1u);
+}
+
+TEST(optimizer, iteration_records) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using optimizer::Optimizer;
+  using optimizer::JerkCost;
+  using optimizer::SingleTrackFunctor;
+  using geometry::Matrix_t;
+
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<double>("wheel_base", 2.7);
+  params->set<double>("dt", 0.2);
+  params->set<bool>("record_iterations", true);
+
+  Matrix_t<double> initial_states(1, 4);
+  initial_states << 0.0, 0.0, 0.0, 10.0;  // x, y, theta, v
+  Matrix_t<double> opt_vec(20, 2);
+  opt_vec.setConstant(0.1);
+
+  Optimizer opt(params);
+  opt.SetOptimizationVector(opt_vec);
+  SingleTrackFunctor* functor = new SingleTrackFunctor(initial_states, params);
+  functor->AddCost(std::make_shared<JerkCost>(params));
+  opt.AddResidualBlock<SingleTrackFunctor>(functor);
+  opt.Solve();
+
+  const auto& records = opt.IterationRecords();
+  ASSERT_GT(records.size(), 0u);
+  int num_evaluations = 0;
+  for (const auto& record : records) {
+    ASSERT_GE(record.rollout_time, 0.);
+    ASSERT_GE(record.cost_time, 0.);
+    ASSERT_NEAR(record.evaluation_time,
+                record.rollout_time + record.cost_time, 1e-12);
+    num_evaluations += record.num_evaluations;
+  }
+  ASSERT_LE(num_evaluations, functor->GetNumEvaluations());
+  Matrix_t<double> table = opt.IterationRecordsMatrix();
+  ASSERT_EQ(table.rows(), static_cast<int>(records.size()));
+  ASSERT_EQ(table.cols(), 12);
+
+  // records start anew with every solve
+  opt.Solve();
+  ASSERT_EQ(opt.IterationRecordsMatrix().rows(),
+            static_cast<int>(opt.IterationRecords().size()));
+
+  // without records the evaluations are not timed
+  ASSERT_TRUE(functor->GetRecordTimes());
+  opt.RecordIterations(false);
+  opt.Solve();
+  ASSERT_FALSE(functor->GetRecordTimes());
+  const double rollout_time = functor->GetRolloutTime();
+  const int evaluations = functor->GetNumEvaluations();
+  EvaluateFunctor(functor, opt_vec);
+  ASSERT_EQ(functor->GetRolloutTime(), rollout_time);
+  ASSERT_EQ(functor->GetNumEvaluations(), evaluations + 1);
+  functor->SetRecordTimes(true);
+  EvaluateFunctor(functor, opt_vec);
+  ASSERT_GT(functor->GetRolloutTime(), rollout_time);
+}
+
+TEST(optimizer, ilqr) {
+  using commons::Parameter;
+  using commons::ParameterPtr;
+  using optimizer::Optimizer;
+  using optimizer::SolveStatus;
+  using optimizer::JerkCost;
+  using optimizer::SpeedCost;
+  using optimizer::SingleTrackFunctor;
+  using geometry::Matrix_t;
+
+  Matrix_t<double> initial_states(1, 4);
+  initial_states << 0.0, 0.0, 0.0, 10.0;  // x, y, theta, v
+  Matrix_t<double> opt_vec(20, 2);
+  opt_vec.setZero();
+
+  // same problem solved by ceres and by the iLQR
+  auto solve = [&](const std::string& solver_type, double* cost,
+                   double* time) {
+    ParameterPtr params = std::make_shared<Parameter>();
+    params->set<double>("wheel_base", 2.7);
+    params->set<double>("dt", 0.2);
+    params->set<std::string>("solver_type", solver_type);
+    Optimizer opt(params);
+    opt.SetOptimizationVector(opt_vec);
+    SingleTrackFunctor* functor =
+      new SingleTrackFunctor(initial_states, params);
+    functor->AddCost(std::make_shared<JerkCost>(params, 10.));
+    std::shared_ptr<SpeedCost> speed_cost =
+      std::make_shared<SpeedCost>(params, 1.);
+    speed_cost->SetDesiredSpeed(5.);
+    functor->AddCost(speed_cost);
+    opt.AddResidualBlock<SingleTrackFunctor>(functor);
+    auto start = std::chrono::steady_clock::now();
+    opt.Solve();
+    *time = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+    // cost of the result evaluated on the full single shooting residuals
+    Matrix_t<double> result = opt.Result();
+    SingleTrackFunctor eval(initial_states, params);
+    eval.AddCost(functor->costs_[0]);
+    eval.AddCost(functor->costs_[1]);
+    eval.SetOptVecLen(result.rows());
+    eval.SetParamCount(result.cols());
+    std::vector<double> residuals(eval.NumResiduals());
+    std::vector<const double*> blocks;
+    std::vector<std::vector<double>> columns;
+    for (int j = 0; j < result.cols(); j++)
+      columns.emplace_back(result.col(j).data(),
+                           result.col(j).data() + result.rows());
+    for (auto& col : columns)
+      blocks.push_back(col.data());
+    eval(blocks.data(), residuals.data());
+    *cost = 0.;
+    for (double r : residuals)
+      *cost += 0.5*r*r;
+    return opt.Status();
+  };
+
+  double ceres_cost, ceres_time, ilqr_cost, ilqr_time;
+  solve("ceres", &ceres_cost, &ceres_time);
+  SolveStatus status = solve("ilqr", &ilqr_cost, &ilqr_time);
+  std::cout << "ceres: " << ceres_cost << " in " << ceres_time*1e3 << "ms, "
+            << "ilqr: " << ilqr_cost << " in " << ilqr_time*1e3 << "ms"
+            << std::endl;
+  ASSERT_EQ(status, SolveStatus::CONVERGED);
+  ASSERT_LE(ilqr_cost, 1.05*ceres_cost + 1e-6);
+
+  // the initial guess keeps the speed at 10 m/s
+  double initial_cost = 0.5*21.*25.;
+  ASSERT_LT(ilqr_cost, 0.5*initial_cost);
+
+  // one functor of a state space model only
+  ParameterPtr params = std::make_shared<Parameter>();
+  params->set<std::string>("solver_type", "ilqr");
+  Optimizer opt(params);
+  opt.SetOptimizationVector(opt_vec);
+  opt.AddResidualBlock<SingleTrackFunctor>(
+    new SingleTrackFunctor(initial_states, params));
+  ASSERT_THROW(opt.AddResidualBlock<SingleTrackFunctor>(
+                 new SingleTrackFunctor(initial_states, params)),
+               std::invalid_argument);
+  params->set<bool>("static", true);
+  Optimizer static_opt(params);
+  static_opt.SetOptimizationVector(opt_vec);
+  ASSERT_THROW(static_opt.AddResidualBlock<SingleTrackFunctor>(
+                 new SingleTrackFunctor(initial_states, params)),
+               std::invalid_argument);
+
+  // functors without parameters use the defaults
+  params->set<bool>("static", false);
+  Optimizer default_opt(params);
+  default_opt.SetOptimizationVector(opt_vec);
+  SingleTrackFunctor* default_functor = new SingleTrackFunctor(initial_states);
+  default_functor->AddCost(std::make_shared<JerkCost>(params));
+  default_opt.AddResidualBlock<SingleTrackFunctor>(default_functor);
+  default_opt.Solve();
+}
 
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);